@@ -0,0 +1,230 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Negative cache of tiles the server does not have.
+ *
+ * Some sources (e.g. aerial imagery) do not cover every zoom level
+ * everywhere. Tiles answered with 404 or 403 are remembered here for a
+ * while, so they are not asked for on every redraw. The cache is bounded,
+ * and entries expire so that tiles added to the server later eventually
+ * show up. It can be saved beside the disk cache, so that a restart does
+ * not ask for all the same tiles again.
+ */
+
+#include <stdio.h>
+#include <glib.h>
+
+#include "tile-cache.h"
+#include "missing-tiles.h"
+
+typedef struct
+{
+    /* the hash table key points here */
+    guint64 key;
+    /* wall clock time after which the tile is asked for again */
+    gint64 expires;
+    /* our position in the expiry list, link.data points back to us */
+    GList link;
+} OsmMissingTile;
+
+struct _OsmMissingTiles
+{
+    GHashTable *tiles;
+    /* newest tile at the head, first to expire at the tail */
+    GQueue expiry;
+    guint max_tiles;
+    GTimeSpan ttl;
+    /* whether there are changes to save */
+    gboolean dirty;
+};
+
+static void
+missing_tile_free (OsmMissingTile *tile)
+{
+    g_slice_free (OsmMissingTile, tile);
+}
+
+static void
+osm_missing_tiles_drop (OsmMissingTiles *missing, OsmMissingTile *tile)
+{
+    g_queue_unlink (&missing->expiry, &tile->link);
+    /* frees the tile, which owns the key */
+    g_hash_table_remove (missing->tiles, &tile->key);
+}
+
+OsmMissingTiles *
+osm_missing_tiles_new (guint max_tiles, GTimeSpan ttl)
+{
+    OsmMissingTiles *missing = g_new0 (OsmMissingTiles, 1);
+
+    missing->tiles = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                            NULL, (GDestroyNotify)missing_tile_free);
+    g_queue_init (&missing->expiry);
+    missing->max_tiles = max_tiles;
+    missing->ttl = ttl;
+
+    return missing;
+}
+
+void
+osm_missing_tiles_free (OsmMissingTiles *missing)
+{
+    g_hash_table_destroy (missing->tiles);
+    g_free (missing);
+}
+
+/* Adds key, expiring at expires. Entries must be added in order of
+ * expiry, which holds as long as they all have the same ttl */
+static void
+osm_missing_tiles_add_full (OsmMissingTiles *missing, guint64 key, gint64 expires)
+{
+    OsmMissingTile *tile = g_hash_table_lookup (missing->tiles, &key);
+
+    if (tile)
+        osm_missing_tiles_drop (missing, tile);
+
+    while (missing->expiry.length >= missing->max_tiles && missing->expiry.tail)
+        osm_missing_tiles_drop (missing, missing->expiry.tail->data);
+
+    if (missing->max_tiles == 0)
+        return;
+
+    tile = g_slice_new0 (OsmMissingTile);
+    tile->key = key;
+    tile->expires = expires;
+    tile->link.data = tile;
+
+    g_hash_table_insert (missing->tiles, &tile->key, tile);
+    g_queue_push_head_link (&missing->expiry, &tile->link);
+    missing->dirty = TRUE;
+}
+
+void
+osm_missing_tiles_add (OsmMissingTiles *missing, guint64 key)
+{
+    osm_missing_tiles_add_full (missing, key, g_get_real_time () + missing->ttl);
+}
+
+/* Whether key is known to be missing. Expired tiles are forgotten */
+gboolean
+osm_missing_tiles_contains (OsmMissingTiles *missing, guint64 key)
+{
+    OsmMissingTile *tile = g_hash_table_lookup (missing->tiles, &key);
+
+    if (!tile)
+        return FALSE;
+
+    if (tile->expires <= g_get_real_time ()) {
+        osm_missing_tiles_drop (missing, tile);
+        missing->dirty = TRUE;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void
+osm_missing_tiles_clear (OsmMissingTiles *missing)
+{
+    g_hash_table_remove_all (missing->tiles);
+    g_queue_init (&missing->expiry);
+    missing->dirty = FALSE;
+}
+
+guint
+osm_missing_tiles_get_size (OsmMissingTiles *missing)
+{
+    return g_hash_table_size (missing->tiles);
+}
+
+/* Adds the tiles saved in filename by osm_missing_tiles_save(), with keys
+ * for source_id. A missing or corrupt file is not an error, the tiles are
+ * then simply asked for again */
+void
+osm_missing_tiles_load (OsmMissingTiles *missing, const gchar *filename,
+                        guint16 source_id)
+{
+    gchar *contents;
+    gchar **lines;
+    gint64 now = g_get_real_time ();
+    int i, zoom, x, y;
+    gint64 expires;
+
+    if (!g_file_get_contents (filename, &contents, NULL, NULL))
+        return;
+
+    /* oldest first, so that the expiry list stays ordered */
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i] != NULL; i++) {
+        if (sscanf (lines[i], "%d/%d/%d %" G_GINT64_FORMAT,
+                    &zoom, &x, &y, &expires) != 4)
+            continue;
+        if (expires > now && expires <= now + missing->ttl)
+            osm_missing_tiles_add_full (missing,
+                                        OSM_TILE_KEY (source_id, zoom, x, y),
+                                        expires);
+    }
+    g_strfreev (lines);
+    g_free (contents);
+
+    g_debug ("Loaded %u missing tiles from %s",
+             osm_missing_tiles_get_size (missing), filename);
+    missing->dirty = FALSE;
+}
+
+/* Writes the tiles of source_id which have not expired yet to filename,
+ * one "zoom/x/y expiry" line per tile, if anything changed since the
+ * cache was loaded or last saved. The file belongs to a single source,
+ * tiles of others (e.g. answered after the source changed) are left out */
+gboolean
+osm_missing_tiles_save (OsmMissingTiles *missing, const gchar *filename,
+                        guint16 source_id)
+{
+    GString *contents;
+    GList *link;
+    GError *error = NULL;
+    gint64 now = g_get_real_time ();
+    gboolean ok;
+
+    if (!missing->dirty)
+        return TRUE;
+
+    contents = g_string_new (NULL);
+    for (link = missing->expiry.tail; link != NULL; link = link->prev) {
+        OsmMissingTile *tile = link->data;
+        if (tile->expires <= now || OSM_TILE_KEY_SOURCE (tile->key) != source_id)
+            continue;
+        g_string_append_printf (contents, "%d/%d/%d %" G_GINT64_FORMAT "\n",
+                                OSM_TILE_KEY_ZOOM (tile->key),
+                                OSM_TILE_KEY_X (tile->key),
+                                OSM_TILE_KEY_Y (tile->key),
+                                tile->expires);
+    }
+
+    ok = g_file_set_contents (filename, contents->str, contents->len, &error);
+    if (ok) {
+        missing->dirty = FALSE;
+    } else {
+        g_warning ("Error saving missing tiles: %s", error->message);
+        g_error_free (error);
+    }
+    g_string_free (contents, TRUE);
+
+    return ok;
+}
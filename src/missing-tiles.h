@@ -0,0 +1,41 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MISSING_TILES_H__
+#define __MISSING_TILES_H__
+
+#include <glib.h>
+
+/* how many missing tiles are remembered, the oldest are forgotten first */
+#define MISSING_TILES_DEFAULT_MAX   4096
+/* how long a tile is believed missing before it is asked for again */
+#define MISSING_TILES_DEFAULT_TTL   (24 * G_TIME_SPAN_HOUR)
+
+typedef struct _OsmMissingTiles OsmMissingTiles;
+
+OsmMissingTiles *osm_missing_tiles_new          (guint max_tiles, GTimeSpan ttl);
+void            osm_missing_tiles_free          (OsmMissingTiles *missing);
+void            osm_missing_tiles_add           (OsmMissingTiles *missing, guint64 key);
+gboolean        osm_missing_tiles_contains      (OsmMissingTiles *missing, guint64 key);
+void            osm_missing_tiles_clear         (OsmMissingTiles *missing);
+guint           osm_missing_tiles_get_size      (OsmMissingTiles *missing);
+void            osm_missing_tiles_load          (OsmMissingTiles *missing, const gchar *filename, guint16 source_id);
+gboolean        osm_missing_tiles_save          (OsmMissingTiles *missing, const gchar *filename, guint16 source_id);
+
+#endif /* __MISSING_TILES_H__ */
@@ -141,6 +141,14 @@
 #include "osm-gps-map-source.h"
 #include "osm-gps-map-widget.h"
 #include "osm-gps-map-compat.h"
+#include "missing-tiles.h"
+#include "tile-cache.h"
+#include "tile-store.h"
+#include "tile-decode.h"
+#include "tile-dedup.h"
+#include "tile-disk.h"
+#include "tile-pmtiles.h"
+#include "tile-worker.h"
 
 #define ENABLE_DEBUG                (0)
 #define EXTRA_BORDER                (0)
@@ -149,6 +157,50 @@
 #define DOWNLOAD_RETRIES            3
 #define MAX_DOWNLOAD_TILES          10000
 #define DOT_RADIUS                  4.0
+/* how many zoom levels of cached tiles a missing tile is composed from */
+#define MAX_DOWNSCALE_LEVELS        2
+/* saved beside the tiles on disk */
+#define MISSING_TILES_FILENAME      "missing-tiles"
+/* seconds a downloaded tile is fresh if the server does not say */
+#define TILE_DEFAULT_MAX_AGE        (7 * 24 * 60 * 60)
+/* tiles between two progress reports of a tile pack export or import */
+#define PACK_PROGRESS_INTERVAL      64
+/* tiles around the view still decoded when they are queued, as they
+ * are likely to be panned into view */
+#define TILE_PREFETCH_MARGIN        1
+/* number of buckets of the download latency histogram */
+#define LATENCY_BUCKETS             8
+
+/* upper bounds of the download latency buckets, in milliseconds. The last
+ * bucket has no upper bound */
+static const guint32 latency_bounds[LATENCY_BUCKETS - 1] = {
+    50, 100, 250, 500, 1000, 2500, 5000
+};
+
+/* counters reported by the statistics property, since the map was created */
+typedef struct {
+    guint64 memory_hits;
+    guint64 memory_misses;
+    guint64 disk_hits;
+    guint64 disk_misses;
+    guint64 upscaled;
+    guint64 downscaled;
+    guint64 decoded;
+    /* microseconds */
+    guint64 decode_time;
+    /* tiles given the surface of an identical tile instead of decoding */
+    guint64 dedup_hits;
+    /* tiles not read or decoded because they left the view first */
+    guint64 decodes_dropped;
+    guint64 downloads;
+    guint64 download_failures;
+    guint64 download_bytes;
+    guint64 download_retries;
+    guint64 download_latency[LATENCY_BUCKETS];
+    guint64 trimmed_bytes;
+    guint64 revalidations;
+    guint64 revalidations_unchanged;
+} OsmGpsMapStats;
 
 #ifndef SOUP_CHECK_VERSION
 // SOUP_CHECK_VERSION was introduced only in 2.42
@@ -159,11 +211,35 @@
 #define SOUP_OLD_SESSION
 #endif
 
+/* The part of the map in view, shared with the worker threads so that
+ * they drop the tiles which left it before reading or decoding them */
+typedef struct {
+    GMutex lock;
+    /* FALSE until the map is first drawn */
+    gboolean valid;
+    /* the zoom level of the tiles painted, and the area in view plus the
+     * prefetch margin, in pixels at that zoom level */
+    int zoom;
+    double x0;
+    double y0;
+    double x1;
+    double y1;
+} OsmTileView;
+
 struct _OsmGpsMapPrivate
 {
     GHashTable *tile_queue;
-    GHashTable *missing_tiles;
-    GHashTable *tile_cache;
+    /* keys of the tiles being read from disk or decoded by the worker
+     * threads, and the workers */
+    GHashTable *tile_loads;
+    OsmTileWorker *tile_worker;
+    OsmTileView *tile_view;
+    /* tiles the server does not have */
+    OsmMissingTiles *missing_tiles;
+    /* private or shared with other maps, see the shared-tile-cache
+     * property. tile_cache is the cache of the store */
+    OsmTileStore *tile_store;
+    OsmTileCache *tile_cache;
 
     int map_zoom;
     int max_zoom;
@@ -181,12 +257,25 @@ struct _OsmGpsMapPrivate
     gfloat center_rlat;
     gfloat center_rlon;
 
-    guint max_tile_cache_size;
-    /* Incremented at each redraw */
-    guint redraw_cycle;
+    /* Tile cache clock at the start of the last redraw, tiles used after
+     * this are on screen and must survive osm_gps_map_purge_cache() */
+    guint64 redraw_cycle;
     /* ID of the idle redraw operation */
     guint idle_map_redraw;
 
+    OsmGpsMapStats stats;
+    /* ID of the timeout emitting the statistics signal */
+    guint statistics_source;
+    guint statistics_interval;
+
+    /* keys of the stale tiles shown, and the ID of the idle source
+     * revalidating them */
+    GHashTable *stale_tiles;
+    guint revalidate_source;
+#if GLIB_CHECK_VERSION(2, 64, 0)
+    GMemoryMonitor *memory_monitor;
+#endif
+
     //how we download tiles
     SoupSession *soup_session;
     char *proxy_uri;
@@ -196,6 +285,11 @@ struct _OsmGpsMapPrivate
     char *tile_dir;
     char *tile_base_dir;
     char *cache_dir;
+    /* the tiles in cache_dir, NULL if there is none */
+    OsmTileDisk *tile_disk;
+    guint64 disk_cache_max_bytes;
+    /* the surfaces of identical tiles, NULL unless tile-dedup is set */
+    OsmTileDedup *tile_dedup;
 
     //contains flags indicating the various special characters
     //the uri string contains, that will be replaced when calculating
@@ -204,6 +298,8 @@ struct _OsmGpsMapPrivate
     char *repo_uri;
     char *image_format;
     int uri_format;
+    /* identifies repo_uri in the keys of the tile cache */
+    guint16 source_id;
 
     //gps tracking state
     GSList *trip_history;
@@ -222,7 +318,7 @@ struct _OsmGpsMapPrivate
     cairo_surface_t *pixmap;
 
     //The tile painted when one cannot be found
-    GdkPixbuf *null_tile;
+    cairo_surface_t *null_tile;
 
     //A list of OsmGpsMapLayer* layers, such as the OSD
     GSList *layers;
@@ -267,25 +363,52 @@ struct _OsmGpsMapPrivate
     guint is_dragging_point : 1;
 };
 
-typedef struct
-{
-    GdkPixbuf *pixbuf;
-    /* We keep track of the number of the redraw cycle this tile was last used,
-     * so that osm_gps_map_purge_cache() can remove the older ones */
-    guint redraw_cycle;
-} OsmCachedTile;
-
 typedef struct {
     /* The details of the tile to download */
     char *uri;
-    char *folder;
-    char *filename;
+    int zoom;
+    int x;
+    int y;
+    /* the tile cache key, of the source at the time of the request */
+    guint64 key;
     OsmGpsMap *map;
     /* whether to redraw the map when the tile arrives */
     gboolean redraw;
     int ttl;
+    /* monotonic time when the download was queued */
+    gint64 started;
 } OsmTileDownload;
 
+typedef struct {
+    /* the disk cache is referenced, the map could switch to another one
+     * while the tile is read. NULL for a downloaded tile */
+    OsmTileDisk *disk;
+    /* the map's, which outlives the workers */
+    OsmTileDedup *dedup;
+    /* the downloaded tile, decoded instead of reading the disk */
+    GBytes *data;
+    gchar *format;
+    int zoom;
+    int x;
+    int y;
+    guint64 key;
+    /* whether to download the tile if it is not on disk */
+    gboolean download;
+    gboolean redraw;
+    /* the download of the tile, which stays open in the tile store until
+     * the tile is in the cache, so the maps waiting for it are told then */
+    gchar *uri;
+    /* the view of the map if the tile is to be dropped when it leaves
+     * it, and whether the worker did so */
+    OsmTileView *view;
+    gboolean dropped;
+    /* the tile and microseconds spent decoding, set by the worker */
+    cairo_surface_t *surface;
+    gint64 decode_time;
+    /* set by the worker if an identical tile was already decoded */
+    gboolean dedup_hit;
+} OsmTileLoad;
+
 enum
 {
     PROP_0,
@@ -307,6 +430,9 @@ enum
     PROP_MAP_X,
     PROP_MAP_Y,
     PROP_TILES_QUEUED,
+    PROP_TILES_MISSING,
+    PROP_STATISTICS,
+    PROP_STATISTICS_INTERVAL,
     PROP_GPS_TRACK_WIDTH,
     PROP_GPS_POINT_R1,
     PROP_GPS_POINT_R2,
@@ -314,7 +440,12 @@ enum
     PROP_IMAGE_FORMAT,
     PROP_DRAG_LIMIT,
     PROP_AUTO_CENTER_THRESHOLD,
-    PROP_SHOW_GPS_POINT
+    PROP_SHOW_GPS_POINT,
+    PROP_TILE_CACHE_BYTES,
+    PROP_TILE_PIN_BYTES,
+    PROP_SHARED_TILE_CACHE,
+    PROP_DISK_CACHE_MAX_BYTES,
+    PROP_TILE_DEDUP
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (OsmGpsMap, osm_gps_map, GTK_TYPE_DRAWING_AREA);
@@ -326,14 +457,8 @@ static gchar    *replace_string(const gchar *src, const gchar *from, const gchar
 static gchar    *replace_map_uri(OsmGpsMap *map, const gchar *uri, int zoom, int x, int y);
 static void     osm_gps_map_tile_download_complete (SoupSession *session, SoupMessage *msg, gpointer user_data);
 static void     osm_gps_map_download_tile (OsmGpsMap *map, int zoom, int x, int y, gboolean redraw);
-static GdkPixbuf* osm_gps_map_render_tile_upscaled (OsmGpsMap *map, GdkPixbuf *tile, int tile_zoom, int zoom, int x, int y);
-
-static void
-cached_tile_free (OsmCachedTile *tile)
-{
-    g_object_unref (tile->pixbuf);
-    g_slice_free (OsmCachedTile, tile);
-}
+static void     osm_gps_map_download_tile_full (OsmGpsMap *map, int zoom, int x, int y, gboolean redraw, const OsmTileMeta *validators);
+static void     osm_gps_map_push_tile_load (OsmGpsMap *map, OsmTileLoad *load);
 
 /*
  * Description:
@@ -715,28 +840,40 @@ osm_gps_map_draw_gps_point (OsmGpsMap *map, cairo_t *cr)
                                 mr*2);
 }
 
+/* Paints a tile of zoom level tile_zoom at offset_x,offset_y. If the tile
+ * is from a lower zoom level than the map, the part of it covering the
+ * tile target_x,target_y (at the map zoom level) is magnified instead */
 static void
-osm_gps_map_blit_tile(OsmGpsMap *map, GdkPixbuf *pixbuf, cairo_t *cr, int offset_x, int offset_y,
+osm_gps_map_blit_tile(OsmGpsMap *map, cairo_surface_t *surface, cairo_t *cr, int offset_x, int offset_y,
                       int tile_zoom, int target_x, int target_y)
 {
     OsmGpsMapPrivate *priv = map->priv;
-    int target_zoom = priv->map_zoom;
+    int zoom_diff = priv->map_zoom - tile_zoom;
 
-    if (tile_zoom == target_zoom) {
+    if (zoom_diff <= 0) {
         g_debug("Blit @ %d,%d", offset_x,offset_y);
-        /* draw pixbuf */
-        gdk_cairo_set_source_pixbuf (cr, pixbuf, offset_x, offset_y);
+        /* the surface is already premultiplied, just paint it */
+        cairo_set_source_surface (cr, surface, offset_x, offset_y);
         cairo_paint (cr);
     } else {
-        /* get an upscaled version of the pixbuf */
-        GdkPixbuf *pixmap_scaled = osm_gps_map_render_tile_upscaled (
-                                            map, pixbuf, tile_zoom,
-                                            target_zoom, target_x, target_y);
-
-        osm_gps_map_blit_tile (map, pixmap_scaled, cr, offset_x, offset_y,
-                               target_zoom, target_x, target_y);
-
-        g_object_unref (pixmap_scaled);
+        int modulo = 1 << zoom_diff;
+        double area_size = (double)TILESIZE / modulo;
+
+        g_debug ("Upscaling by %d levels into tile %d,%d", zoom_diff, target_x, target_y);
+
+        /* magnify the area of the bigger tile while painting it, rather
+         * than rendering an intermediate upscaled copy */
+        cairo_save (cr);
+        cairo_rectangle (cr, offset_x, offset_y, TILESIZE, TILESIZE);
+        cairo_clip (cr);
+        cairo_translate (cr, offset_x, offset_y);
+        cairo_scale (cr, modulo, modulo);
+        cairo_set_source_surface (cr, surface,
+                                  -(target_x % modulo) * area_size,
+                                  -(target_y % modulo) * area_size);
+        cairo_pattern_set_filter (cairo_get_source (cr), CAIRO_FILTER_NEAREST);
+        cairo_paint (cr);
+        cairo_restore (cr);
     }
 }
 
@@ -745,101 +882,539 @@ osm_gps_map_blit_tile(OsmGpsMap *map, GdkPixbuf *pixbuf, cairo_t *cr, int offset
 #define MSG_RESPONSE_LEN_FORMAT "%"G_GOFFSET_FORMAT
 
 static void
-osm_gps_map_tile_download_complete (SoupSession *session, SoupMessage *msg, gpointer user_data)
+osm_gps_map_count_decode (OsmGpsMap *map, gint64 decode_time, cairo_surface_t *surface)
+{
+    OsmGpsMapStats *stats = &map->priv->stats;
+
+    if (surface) {
+        stats->decoded++;
+        stats->decode_time += decode_time;
+    }
+}
+
+/* Returns the surface of an identical tile, or decodes the tile and
+ * remembers its surface, if dedup is not NULL. Sets hit if the tile was
+ * not decoded. May run in a worker thread */
+static cairo_surface_t *
+osm_gps_map_decode_shared (OsmTileDedup *dedup, const guchar *data, gsize len,
+                           const gchar *format, gboolean *hit)
+{
+    cairo_surface_t *surface;
+    gchar *digest;
+
+    *hit = FALSE;
+    if (!dedup)
+        return osm_tile_decode_data (data, len, format);
+
+    digest = osm_tile_dedup_digest (data, len);
+    surface = osm_tile_dedup_lookup (dedup, digest);
+    if (surface) {
+        *hit = TRUE;
+    } else {
+        surface = osm_tile_decode_data (data, len, format);
+        if (surface)
+            osm_tile_dedup_insert (dedup, digest, surface);
+    }
+    g_free (digest);
+
+    return surface;
+}
+
+static void
+osm_gps_map_count_download (OsmGpsMap *map, OsmTileDownload *dl, SoupMessage *msg)
+{
+    OsmGpsMapStats *stats = &map->priv->stats;
+    gint64 ms = (g_get_monotonic_time () - dl->started) / 1000;
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS - 1; i++)
+        if (ms < latency_bounds[i])
+            break;
+
+    stats->downloads++;
+    stats->download_bytes += MSG_RESPONSE_LEN(msg);
+    stats->download_latency[i]++;
+}
+
+/* Fills meta from the caching headers of the response. Validators the
+ * response does not repeat (in a 304) are kept */
+static void
+osm_gps_map_update_meta (SoupMessage *msg, OsmTileMeta *meta)
+{
+    SoupMessageHeaders *headers = msg->response_headers;
+    gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+    const char *value;
+    SoupDate *date;
+
+    meta->fetched = now;
+    meta->expires = 0;
+
+    /* max-age takes precedence over Expires */
+    value = soup_message_headers_get_one (headers, "Cache-Control");
+    if (value) {
+        GHashTable *params = soup_header_parse_param_list (value);
+        const char *max_age = g_hash_table_lookup (params, "max-age");
+
+        if (max_age)
+            meta->expires = now + g_ascii_strtoll (max_age, NULL, 10);
+        soup_header_free_param_list (params);
+    }
+    value = soup_message_headers_get_one (headers, "Expires");
+    if (value && meta->expires == 0) {
+        date = soup_date_new_from_string (value);
+        if (date) {
+            meta->expires = soup_date_to_time_t (date);
+            soup_date_free (date);
+        }
+    }
+
+    value = soup_message_headers_get_one (headers, "Last-Modified");
+    if (value) {
+        date = soup_date_new_from_string (value);
+        if (date) {
+            meta->last_modified = soup_date_to_time_t (date);
+            soup_date_free (date);
+        }
+    }
+    value = soup_message_headers_get_one (headers, "ETag");
+    if (value) {
+        g_free (meta->etag);
+        meta->etag = g_strdup (value);
+    }
+}
+
+static gboolean
+osm_gps_map_tile_is_stale (const OsmTileMeta *meta)
+{
+    gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+
+    if (meta->expires != 0)
+        return now >= meta->expires;
+    return now >= meta->fetched + TILE_DEFAULT_MAX_AGE;
+}
+
+/* Downloads the tile again, unless the one on disk is still current */
+static void
+osm_gps_map_revalidate_tile (OsmGpsMap *map, int zoom, int x, int y)
 {
-    FILE *file;
-    OsmTileDownload *dl = (OsmTileDownload *)user_data;
-    OsmGpsMap *map = OSM_GPS_MAP(dl->map);
     OsmGpsMapPrivate *priv = map->priv;
-    gboolean file_saved = FALSE;
+    OsmTileMeta meta;
 
-    if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code)) {
-        /* save tile into cachedir if one has been specified */
-        if (priv->cache_dir) {
-            if (g_mkdir_with_parents(dl->folder,0700) == 0) {
-                file = g_fopen(dl->filename, "wb");
-                if (file != NULL) {
-                    fwrite (MSG_RESPONSE_BODY(msg), 1, MSG_RESPONSE_LEN(msg), file);
-                    file_saved = TRUE;
-                    g_debug("Wrote "MSG_RESPONSE_LEN_FORMAT" bytes to %s", MSG_RESPONSE_LEN(msg), dl->filename);
-                    fclose (file);
+    if (!priv->tile_disk ||
+        !osm_tile_disk_get_meta (priv->tile_disk, zoom, x, y, &meta))
+        return;
 
-                }
-            } else {
-                g_warning("Error creating tile download directory: %s", dl->folder);
-            }
+    if (osm_gps_map_tile_is_stale (&meta))
+        osm_gps_map_download_tile_full (map, zoom, x, y, TRUE, &meta);
+    g_free (meta.etag);
+}
+
+static gboolean
+osm_gps_map_revalidate_stale_tiles (gpointer data)
+{
+    OsmGpsMap *map = OSM_GPS_MAP(data);
+    OsmGpsMapPrivate *priv = map->priv;
+    GHashTableIter iter;
+    guint64 *key;
+
+    priv->revalidate_source = 0;
+
+    g_hash_table_iter_init (&iter, priv->stale_tiles);
+    while (g_hash_table_iter_next (&iter, (gpointer *)&key, NULL)) {
+        if (OSM_TILE_KEY_SOURCE (*key) == priv->source_id)
+            osm_gps_map_revalidate_tile (map, OSM_TILE_KEY_ZOOM (*key),
+                                         OSM_TILE_KEY_X (*key), OSM_TILE_KEY_Y (*key));
+    }
+    g_hash_table_remove_all (priv->stale_tiles);
+
+    return FALSE;
+}
+
+/* Revalidates the tile when the map is idle, if it is stale. Only tiles
+ * which are shown are revalidated, once they are loaded from disk */
+static void
+osm_gps_map_check_fresh (OsmGpsMap *map, int zoom, int x, int y)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    OsmTileMeta meta;
+    guint64 *key;
+
+    if (!priv->map_auto_download_enabled ||
+        !osm_tile_disk_get_meta (priv->tile_disk, zoom, x, y, &meta))
+        return;
+
+    if (osm_gps_map_tile_is_stale (&meta)) {
+        key = g_new (guint64, 1);
+        *key = OSM_TILE_KEY (priv->source_id, zoom, x, y);
+        g_hash_table_add (priv->stale_tiles, key);
+        if (priv->revalidate_source == 0)
+            priv->revalidate_source = g_idle_add_full (G_PRIORITY_LOW,
+                                                       osm_gps_map_revalidate_stale_tiles,
+                                                       map, NULL);
+    }
+    g_free (meta.etag);
+}
+
+/* The format of the tiles of the map source: the one of the disk cache,
+ * else the image-format property. It labels exported packs and checks
+ * imported ones, decoding goes by the content of each tile */
+static const gchar *
+osm_gps_map_get_tile_format (OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    const gchar *format = NULL;
+
+    if (priv->tile_disk)
+        format = osm_tile_disk_get_format (priv->tile_disk);
+    return format ? format : priv->image_format;
+}
+
+/* Redraws the maps sharing our tile store which were waiting for a
+ * download we made. If it failed they will try again themselves */
+static void
+osm_gps_map_notify_waiters (GSList *waiters)
+{
+    GSList *list;
+
+    for (list = waiters; list != NULL; list = list->next)
+        osm_gps_map_map_redraw_idle (OSM_GPS_MAP (list->data));
+    g_slist_free (waiters);
+}
+
+/* Whether tile x,y is in view, or in the prefetch margin around it. The
+ * tiles of a few zoom levels above the view are kept, they make the
+ * tiles missing after zooming out. May run in a worker thread */
+static gboolean
+osm_tile_view_contains (OsmTileView *view, int zoom, int x, int y)
+{
+    gboolean contains = TRUE;
+    double size;
+
+    g_mutex_lock (&view->lock);
+    if (view->valid) {
+        if (zoom > view->zoom + MAX_DOWNSCALE_LEVELS) {
+            contains = FALSE;
+        } else {
+            /* the size of the tile at the zoom level of the view */
+            size = ldexp (TILESIZE, view->zoom - zoom);
+            contains = x * size < view->x1 && (x + 1) * size > view->x0 &&
+                       y * size < view->y1 && (y + 1) * size > view->y0;
         }
+    }
+    g_mutex_unlock (&view->lock);
 
-        if (dl->redraw) {
-            GdkPixbuf *pixbuf = NULL;
+    return contains;
+}
 
-            /* if the file was actually stored on disk, we can simply */
-            /* load and decode it from that file */
-            if (priv->cache_dir) {
-                if (file_saved) {
-                    pixbuf = gdk_pixbuf_new_from_file (dl->filename, NULL);
-                }
-            } else {
-                GdkPixbufLoader *loader;
-                char *extension = strrchr (dl->filename, '.');
+/* Tells the workers about the area about to be drawn */
+static void
+osm_gps_map_update_tile_view (OsmGpsMap *map, int width, int height)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    OsmTileView *view = priv->tile_view;
+    int zoom = priv->map_zoom;
+    double scale = 1.0;
 
-                /* parse file directly from memory */
-                if (extension) {
-                    loader = gdk_pixbuf_loader_new_with_type (extension+1, NULL);
-                    if (!gdk_pixbuf_loader_write (loader, (unsigned char*)MSG_RESPONSE_BODY(msg), MSG_RESPONSE_LEN(msg), NULL))
-                    {
-                        g_warning("Error: Decoding of image failed");
-                    }
-                    gdk_pixbuf_loader_close(loader, NULL);
+    /* as in osm_gps_map_load_tile() */
+    if (zoom > MIN_ZOOM) {
+        zoom -= priv->tile_zoom_offset;
+        scale = ldexp (1.0, -priv->tile_zoom_offset);
+    }
 
-                    pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+    g_mutex_lock (&view->lock);
+    view->valid = TRUE;
+    view->zoom = zoom;
+    view->x0 = (priv->map_x - TILE_PREFETCH_MARGIN * TILESIZE) * scale;
+    view->y0 = (priv->map_y - TILE_PREFETCH_MARGIN * TILESIZE) * scale;
+    view->x1 = (priv->map_x + width + TILE_PREFETCH_MARGIN * TILESIZE) * scale;
+    view->y1 = (priv->map_y + height + TILE_PREFETCH_MARGIN * TILESIZE) * scale;
+    g_mutex_unlock (&view->lock);
+}
 
-                    /* give up loader but keep the pixbuf */
-                    g_object_ref(pixbuf);
-                    g_object_unref(loader);
-                } else {
-                    g_warning("Error: Unable to determine image file format");
-                }
-            }
+static void
+osm_gps_map_tile_load_free (OsmTileLoad *load)
+{
+    if (load->disk)
+        osm_tile_disk_unref (load->disk);
+    if (load->data)
+        g_bytes_unref (load->data);
+    if (load->surface)
+        cairo_surface_destroy (load->surface);
+    g_free (load->uri);
+    g_free (load->format);
+    g_free (load);
+}
+
+/* Runs in a worker thread, must not touch the map */
+static void
+osm_gps_map_tile_load_thread (gpointer job, gpointer user_data)
+{
+    OsmTileLoad *load = job;
+    gint64 started;
+    GBytes *bytes;
+
+    if (load->view && !osm_tile_view_contains (load->view, load->zoom, load->x, load->y)) {
+        load->dropped = TRUE;
+        return;
+    }
+
+    if (load->data)
+        bytes = g_bytes_ref (load->data);
+    else
+        bytes = osm_tile_disk_read (load->disk, load->zoom, load->x, load->y);
+
+    if (bytes) {
+        started = g_get_monotonic_time ();
+        load->surface = osm_gps_map_decode_shared (load->dedup,
+                                                   g_bytes_get_data (bytes, NULL),
+                                                   g_bytes_get_size (bytes),
+                                                   load->format,
+                                                   &load->dedup_hit);
+        load->decode_time = g_get_monotonic_time () - started;
+        g_bytes_unref (bytes);
+    }
+}
+
+/* Queues a dropped load again, without the view, for a tile pinned after
+ * it was queued. What the load owns is moved to the new one */
+static void
+osm_gps_map_requeue_tile_load (OsmGpsMap *map, OsmTileLoad *load)
+{
+    OsmTileLoad *again = g_new0 (OsmTileLoad, 1);
+
+    again->disk = load->disk;
+    again->data = load->data;
+    again->format = load->format;
+    again->uri = load->uri;
+    load->disk = NULL;
+    load->data = NULL;
+    load->format = NULL;
+    load->uri = NULL;
+    again->zoom = load->zoom;
+    again->x = load->x;
+    again->y = load->y;
+    again->key = load->key;
+    again->download = load->download;
+    again->redraw = load->redraw;
+    osm_gps_map_push_tile_load (map, again);
+}
+
+/* Takes the tiles the workers finished since the last call into the
+ * cache, and redraws the map once for all of them */
+static void
+osm_gps_map_tile_loads_done (GPtrArray *loads, gpointer user_data)
+{
+    OsmGpsMap *map = OSM_GPS_MAP(user_data);
+    OsmGpsMapPrivate *priv = map->priv;
+    gboolean redraw = FALSE;
+    OsmTileLoad *load;
+    guint i;
+
+    for (i = 0; i < loads->len; i++) {
+        load = g_ptr_array_index (loads, i);
+        g_hash_table_remove (priv->tile_loads, &load->key);
+
+        if (load->dropped && osm_tile_cache_is_pinned (priv->tile_cache, load->key)) {
+            osm_gps_map_requeue_tile_load (map, load);
+            continue;
+        }
+
+        if (load->dropped) {
+            priv->stats.decodes_dropped++;
+            /* a derived tile standing in for the tile would keep it from
+             * being read from disk when it comes back into view. The real
+             * tile may have arrived meanwhile, from a download or another
+             * map sharing the cache */
+            if (osm_tile_cache_contains_derived (priv->tile_cache, load->key))
+                osm_tile_cache_remove (priv->tile_cache, load->key);
+            if (load->uri)
+                osm_gps_map_notify_waiters (osm_tile_store_end_download (priv->tile_store,
+                                                                         load->uri));
+            continue;
+        }
 
-            /* Store the tile into the cache */
-            if (G_LIKELY (pixbuf)) {
-                OsmCachedTile *tile = g_slice_new (OsmCachedTile);
-                tile->pixbuf = pixbuf;
-                tile->redraw_cycle = priv->redraw_cycle;
-                /* if the tile is already in the cache (it could be one
-                 * rendered from another zoom level), it will be
-                 * overwritten */
-                g_hash_table_insert (priv->tile_cache, dl->filename, tile);
-                /* NULL-ify dl->filename so that it won't be freed, as
-                 * we are using it as a key in the hash table */
-                dl->filename = NULL;
+        /* the map source changed while the tile was read. A downloaded
+         * tile is still good, its key holds the source it came from */
+        if (!load->data && OSM_TILE_KEY_SOURCE (load->key) != priv->source_id)
+            continue;
+
+        if (load->surface) {
+            if (!load->data)
+                priv->stats.disk_hits++;
+            if (load->dedup_hit)
+                priv->stats.dedup_hits++;
+            else
+                osm_gps_map_count_decode (map, load->decode_time, load->surface);
+            /* if the tile is already in the cache (it could be one
+             * rendered from another zoom level), it will be overwritten */
+            osm_tile_cache_insert (priv->tile_cache, load->key, load->surface);
+            if (load->redraw) {
+                redraw = TRUE;
+                if (!load->data)
+                    osm_gps_map_check_fresh (map, load->zoom, load->x, load->y);
             }
-            osm_gps_map_map_redraw_idle (map);
+        } else if (!load->data) {
+            priv->stats.disk_misses++;
+            if (load->download)
+                osm_gps_map_download_tile (map, load->zoom, load->x, load->y, load->redraw);
+        }
+
+        if (load->uri)
+            osm_gps_map_notify_waiters (osm_tile_store_end_download (priv->tile_store,
+                                                                     load->uri));
+    }
+
+    if (redraw)
+        osm_gps_map_map_redraw_idle (map);
+}
+
+/* The order tiles are decoded in: by distance from the center of the
+ * view, in sixteenths of a tile squared, so the tiles in the middle of
+ * the screen show up first. Tiles not to be shown come last */
+static guint
+osm_gps_map_tile_priority (OsmGpsMap *map, int zoom, int x, int y, gboolean redraw)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    GtkWidget *widget = GTK_WIDGET(map);
+    double scale, dx, dy, distance;
+
+    if (!redraw)
+        return G_MAXUINT;
+
+    /* the center of the view in tiles of the tile's zoom level */
+    scale = ldexp (1.0, zoom - priv->map_zoom) / TILESIZE;
+    dx = (x + 0.5) - (priv->map_x + gtk_widget_get_allocated_width (widget) / 2.0) * scale;
+    dy = (y + 0.5) - (priv->map_y + gtk_widget_get_allocated_height (widget) / 2.0) * scale;
+
+    distance = (dx * dx + dy * dy) * 16;
+    return distance < G_MAXUINT - 1 ? (guint)distance : G_MAXUINT - 1;
+}
+
+static void
+osm_gps_map_push_tile_load (OsmGpsMap *map, OsmTileLoad *load)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    guint64 *pending;
+
+    pending = g_new (guint64, 1);
+    *pending = load->key;
+    g_hash_table_add (priv->tile_loads, pending);
+
+    load->dedup = priv->tile_dedup;
+    osm_tile_worker_push (priv->tile_worker, load,
+                          osm_gps_map_tile_priority (map, load->zoom, load->x,
+                                                     load->y, load->redraw));
+}
+
+/* Decodes a downloaded tile in a worker thread, then adds it to the tile
+ * cache and ends its download, telling the waiters. If the tile is on
+ * disk and nobody else waits for it, it is dropped if it leaves the view
+ * first */
+static void
+osm_gps_map_decode_tile_async (OsmGpsMap *map, OsmTileDownload *dl,
+                               GBytes *bytes, gboolean stored)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    OsmTileLoad *load;
+
+    load = g_new0 (OsmTileLoad, 1);
+    load->data = g_bytes_ref (bytes);
+    load->format = g_strdup (osm_gps_map_get_tile_format (map));
+    load->zoom = dl->zoom;
+    load->x = dl->x;
+    load->y = dl->y;
+    load->key = dl->key;
+    load->redraw = dl->redraw;
+    load->uri = g_strdup (dl->uri);
+    if (dl->redraw && stored && !osm_tile_store_has_waiters (priv->tile_store, dl->uri) &&
+        !osm_tile_cache_is_pinned (priv->tile_cache, dl->key))
+        load->view = priv->tile_view;
+    osm_gps_map_push_tile_load (map, load);
+}
+
+static void
+osm_gps_map_tile_download_complete (SoupSession *session, SoupMessage *msg, gpointer user_data)
+{
+    OsmTileDownload *dl = (OsmTileDownload *)user_data;
+    OsmGpsMap *map = OSM_GPS_MAP(dl->map);
+    OsmGpsMapPrivate *priv = map->priv;
+    GBytes *bytes;
+    gboolean stored = FALSE;
+
+    if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code)) {
+        osm_gps_map_count_download (map, dl, msg);
+
+        /* save tile into cachedir if one has been specified, unless the
+         * map source changed while it was downloaded. This happens in
+         * the background, the tile is decoded from memory below */
+        bytes = g_bytes_new (MSG_RESPONSE_BODY(msg), MSG_RESPONSE_LEN(msg));
+        if (priv->tile_disk && OSM_TILE_KEY_SOURCE (dl->key) == priv->source_id) {
+            OsmTileMeta meta = { 0, };
+
+            /* the writer records the metadata with the tile */
+            osm_gps_map_update_meta (msg, &meta);
+            stored = osm_tile_disk_write_async (priv->tile_disk, dl->zoom, dl->x, dl->y,
+                                                bytes, &meta);
+            g_free (meta.etag);
+        }
+
+        /* decode the tile if it is to be shown, by us or by another map,
+         * or if it is to be kept in memory. The download stays open until
+         * the tile is in the cache, the waiters are told then */
+        if (dl->redraw || osm_tile_store_has_waiters (priv->tile_store, dl->uri) ||
+            osm_tile_cache_is_pinned (priv->tile_cache, dl->key)) {
+            osm_gps_map_decode_tile_async (map, dl, bytes, stored);
+        } else {
+            /* the tile is on disk now, forget any derived tile standing
+             * in for it so the real one is loaded next time */
+            osm_tile_cache_remove (priv->tile_cache, dl->key);
+            osm_gps_map_notify_waiters (osm_tile_store_end_download (priv->tile_store, dl->uri));
         }
+        g_bytes_unref (bytes);
         g_hash_table_remove(priv->tile_queue, dl->uri);
         g_object_notify(G_OBJECT(map), "tiles-queued");
 
-        g_free(dl->folder);
-        g_free(dl->filename);
         g_free(dl);
     } else {
-        if ((msg->status_code == SOUP_STATUS_NOT_FOUND) || (msg->status_code == SOUP_STATUS_FORBIDDEN)) {
-            g_hash_table_insert(priv->missing_tiles, dl->uri, NULL);
+        if (msg->status_code == SOUP_STATUS_NOT_MODIFIED) {
+            /* the tile on disk is current, only its metadata changes */
+            OsmTileMeta meta;
+
+            priv->stats.revalidations_unchanged++;
+            if (priv->tile_disk && OSM_TILE_KEY_SOURCE (dl->key) == priv->source_id &&
+                osm_tile_disk_get_meta (priv->tile_disk, dl->zoom, dl->x, dl->y, &meta)) {
+                osm_gps_map_update_meta (msg, &meta);
+                osm_tile_disk_set_meta (priv->tile_disk, dl->zoom, dl->x, dl->y, &meta);
+                g_free (meta.etag);
+            }
+            osm_gps_map_notify_waiters (osm_tile_store_end_download (priv->tile_store, dl->uri));
+            g_hash_table_remove(priv->tile_queue, dl->uri);
+            g_object_notify(G_OBJECT(map), "tiles-queued");
+        } else if ((msg->status_code == SOUP_STATUS_NOT_FOUND) || (msg->status_code == SOUP_STATUS_FORBIDDEN)) {
+            /* the missing tiles are those of the current source */
+            if (OSM_TILE_KEY_SOURCE(dl->key) == priv->source_id) {
+                osm_missing_tiles_add(priv->missing_tiles, dl->key);
+                g_object_notify(G_OBJECT(map), "tiles-missing");
+            }
+            osm_gps_map_notify_waiters (osm_tile_store_end_download (priv->tile_store, dl->uri));
             g_hash_table_remove(priv->tile_queue, dl->uri);
             g_object_notify(G_OBJECT(map), "tiles-queued");
         } else if (msg->status_code == SOUP_STATUS_CANCELLED) {
             /* called as application exit or after osm_gps_map_download_cancel_all */
+            osm_gps_map_notify_waiters (osm_tile_store_end_download (priv->tile_store, dl->uri));
             g_hash_table_remove(priv->tile_queue, dl->uri);
             g_object_notify(G_OBJECT(map), "tiles-queued");
         } else {
             g_warning("Error downloading tile: %d - %s", msg->status_code, msg->reason_phrase);
             dl->ttl--;
             if (dl->ttl) {
+                priv->stats.download_retries++;
                 soup_session_requeue_message(session, msg);
                 return;
             }
 
+            priv->stats.download_failures++;
+            osm_gps_map_notify_waiters (osm_tile_store_end_download (priv->tile_store, dl->uri));
             g_hash_table_remove(priv->tile_queue, dl->uri);
             g_object_notify(G_OBJECT(map), "tiles-queued");
         }
@@ -850,10 +1425,32 @@ osm_gps_map_tile_download_complete (SoupSession *session, SoupMessage *msg, gpoi
 
 static void
 osm_gps_map_download_tile (OsmGpsMap *map, int zoom, int x, int y, gboolean redraw)
+{
+    osm_gps_map_download_tile_full (map, zoom, x, y, redraw, NULL);
+}
+
+/* Downloads a tile, with a conditional request if validators are given */
+static void
+osm_gps_map_download_tile_full (OsmGpsMap *map, int zoom, int x, int y,
+                                gboolean redraw, const OsmTileMeta *validators)
 {
     SoupMessage *msg;
     OsmGpsMapPrivate *priv = map->priv;
-    OsmTileDownload *dl = g_new0(OsmTileDownload,1);
+    OsmTileDownload *dl;
+    guint64 key = OSM_TILE_KEY (priv->source_id, zoom, x, y);
+
+    /* a PMTiles archive is all there is */
+    if (priv->tile_disk && osm_tile_disk_is_read_only(priv->tile_disk))
+        return;
+
+    //check the tile has not been attempted and found missing, before
+    //spending time on the uri
+    if (osm_missing_tiles_contains(priv->missing_tiles, key)) {
+        g_debug("Tile missing");
+        return;
+    }
+
+    dl = g_new0(OsmTileDownload,1);
 
     // set retries
     dl->ttl = DOWNLOAD_RETRIES;
@@ -861,27 +1458,22 @@ osm_gps_map_download_tile (OsmGpsMap *map, int zoom, int x, int y, gboolean redr
     //calculate the uri to download
     dl->uri = replace_map_uri(map, priv->repo_uri, zoom, x, y);
 
-    //check the tile has not already been queued for download,
-    //or has been attempted, and its missing
-    if (g_hash_table_lookup_extended(priv->tile_queue, dl->uri, NULL, NULL) ||
-        g_hash_table_lookup_extended(priv->missing_tiles, dl->uri, NULL, NULL) )
+    //check the tile is not already being downloaded (by us or a map
+    //sharing our tile store)
+    if (!osm_tile_store_begin_download(priv->tile_store, dl->uri, map))
     {
-        g_debug("Tile already downloading (or missing)");
+        g_debug("Tile already downloading");
         g_free(dl->uri);
         g_free(dl);
     } else {
-        dl->folder = g_strdup_printf("%s%c%d%c%d%c",
-                            priv->cache_dir, G_DIR_SEPARATOR,
-                            zoom, G_DIR_SEPARATOR,
-                            x, G_DIR_SEPARATOR);
-        dl->filename = g_strdup_printf("%s%d.%s",
-                            dl->folder,
-                            y,
-                            priv->image_format);
+        dl->zoom = zoom;
+        dl->x = x;
+        dl->y = y;
+        dl->key = key;
         dl->map = map;
         dl->redraw = redraw;
 
-        g_debug("Download tile: %d,%d z:%d\n\t%s --> %s", x, y, zoom, dl->uri, dl->filename);
+        g_debug("Download tile: %d,%d z:%d\n\t%s", x, y, zoom, dl->uri);
 
         msg = soup_message_new (SOUP_METHOD_GET, dl->uri);
         if (msg) {
@@ -899,156 +1491,304 @@ osm_gps_map_download_tile (OsmGpsMap *map, int zoom, int x, int y, gboolean redr
                 }
             }
 
+            if (validators) {
+                priv->stats.revalidations++;
+                if (validators->etag)
+                    soup_message_headers_append(msg->request_headers, "If-None-Match",
+                                                validators->etag);
+                if (validators->last_modified) {
+                    SoupDate *date = soup_date_new_from_time_t (validators->last_modified);
+                    char *since = soup_date_to_string (date, SOUP_DATE_HTTP);
+
+                    soup_message_headers_append(msg->request_headers, "If-Modified-Since", since);
+                    g_free (since);
+                    soup_date_free (date);
+                }
+            }
+
+            dl->started = g_get_monotonic_time ();
             g_hash_table_insert (priv->tile_queue, dl->uri, msg);
             g_object_notify (G_OBJECT (map), "tiles-queued");
             /* the soup session unrefs the message when the download finishes */
             soup_session_queue_message (priv->soup_session, msg, osm_gps_map_tile_download_complete, dl);
         } else {
             g_warning("Could not create soup message");
+            osm_gps_map_notify_waiters (osm_tile_store_end_download (priv->tile_store, dl->uri));
             g_free(dl->uri);
-            g_free(dl->folder);
-            g_free(dl->filename);
             g_free(dl);
         }
     }
 }
 
-static GdkPixbuf *
-osm_gps_map_load_cached_tile (OsmGpsMap *map, int zoom, int x, int y)
+/* Starts reading a tile from disk in a worker thread, unless it is
+ * already being read. When the tile is read it is added to the tile
+ * cache, if it is not on disk it is downloaded if download is set */
+static void
+osm_gps_map_load_disk_tile_async (OsmGpsMap *map, int zoom, int x, int y,
+                                  gboolean download, gboolean redraw)
 {
     OsmGpsMapPrivate *priv = map->priv;
-    gchar *filename;
-    GdkPixbuf *pixbuf = NULL;
-    OsmCachedTile *tile;
-
-    filename = g_strdup_printf("%s%c%d%c%d%c%d.%s",
-                priv->cache_dir, G_DIR_SEPARATOR,
-                zoom, G_DIR_SEPARATOR,
-                x, G_DIR_SEPARATOR,
-                y,
-                priv->image_format);
-
-    tile = g_hash_table_lookup (priv->tile_cache, filename);
-    if (tile)
-    {
-        g_free (filename);
-    }
-    else
-    {
-        pixbuf = gdk_pixbuf_new_from_file (filename, NULL);
-        if (pixbuf)
-        {
-            tile = g_slice_new (OsmCachedTile);
-            tile->pixbuf = pixbuf;
-            g_hash_table_insert (priv->tile_cache, filename, tile);
-        }
-        else
-        {
-            g_free (filename);
-        }
-    }
+    guint64 key = OSM_TILE_KEY (priv->source_id, zoom, x, y);
+    OsmTileLoad *load;
 
-    /* set/update the redraw_cycle timestamp on the tile */
-    if (tile)
-    {
-        tile->redraw_cycle = priv->redraw_cycle;
-        pixbuf = g_object_ref (tile->pixbuf);
-    }
-
-    return pixbuf;
-}
+    if (g_hash_table_contains (priv->tile_loads, &key))
+        return;
 
-static GdkPixbuf *
-osm_gps_map_find_bigger_tile (OsmGpsMap *map, int zoom, int x, int y,
-                              int *zoom_found)
-{
-    GdkPixbuf *pixbuf;
-    int next_zoom, next_x, next_y;
-
-    if (zoom == 0) return NULL;
-    next_zoom = zoom - 1;
-    next_x = x / 2;
-    next_y = y / 2;
-    pixbuf = osm_gps_map_load_cached_tile (map, next_zoom, next_x, next_y);
-    if (pixbuf)
-        *zoom_found = next_zoom;
-    else
-        pixbuf = osm_gps_map_find_bigger_tile (map, next_zoom, next_x, next_y,
-                                               zoom_found);
-    return pixbuf;
+    load = g_new0 (OsmTileLoad, 1);
+    load->disk = osm_tile_disk_ref (priv->tile_disk);
+    load->format = g_strdup (osm_gps_map_get_tile_format (map));
+    load->zoom = zoom;
+    load->x = x;
+    load->y = y;
+    load->key = key;
+    load->download = download;
+    load->redraw = redraw;
+    /* a pinned tile must be loaded wherever it is */
+    if (redraw && !osm_tile_cache_is_pinned (priv->tile_cache, key))
+        load->view = priv->tile_view;
+    osm_gps_map_push_tile_load (map, load);
 }
 
-static GdkPixbuf *
-osm_gps_map_render_missing_tile_upscaled (OsmGpsMap *map, int zoom,
-                                          int x, int y)
+/* Returns the tile if it is in the memory cache. Otherwise it is read
+ * from disk in the background, or downloaded if there is no disk cache
+ * and download is set, and NULL is returned. With redraw set the map is
+ * redrawn when the tile arrives */
+static cairo_surface_t *
+osm_gps_map_load_cached_tile (OsmGpsMap *map, int zoom, int x, int y,
+                              gboolean download, gboolean redraw)
 {
-    GdkPixbuf *pixbuf, *big;
-    int zoom_big;
-
-    big = osm_gps_map_find_bigger_tile (map, zoom, x, y, &zoom_big);
-    if (!big) return NULL;
+    OsmGpsMapPrivate *priv = map->priv;
+    guint64 key = OSM_TILE_KEY (priv->source_id, zoom, x, y);
+    cairo_surface_t *surface;
+
+    /* the lookup marks the tile as used in this redraw, and does not
+     * allocate, so a fully cached redraw stays off the heap */
+    surface = osm_tile_cache_lookup (priv->tile_cache, key);
+    if (surface) {
+        priv->stats.memory_hits++;
+        return cairo_surface_reference (surface);
+    }
+    priv->stats.memory_misses++;
 
-    g_debug ("Found bigger tile (zoom = %d, wanted = %d)", zoom_big, zoom);
+    /* already being read or decoded */
+    if (g_hash_table_contains (priv->tile_loads, &key))
+        return NULL;
 
-    pixbuf = osm_gps_map_render_tile_upscaled (map, big, zoom_big,
-                                               zoom, x, y);
-    g_object_unref (big);
+    /* a derived tile is painted while the tile is read, and stays in
+     * the cache only if the read found nothing (a dropped read removes
+     * it), don't hit the disk again on every redraw */
+    if (priv->tile_disk && !osm_tile_cache_contains_derived (priv->tile_cache, key))
+        osm_gps_map_load_disk_tile_async (map, zoom, x, y, download, redraw);
+    else if (download)
+        osm_gps_map_download_tile (map, zoom, x, y, redraw);
 
-    return pixbuf;
+    return NULL;
 }
-static GdkPixbuf*
-osm_gps_map_render_tile_upscaled (OsmGpsMap *map, GdkPixbuf *big, int zoom_big,
-                                  int zoom, int x, int y)
+
+static gboolean
+osm_gps_map_is_loading_tile (OsmGpsMap *map, int zoom, int x, int y)
 {
-    GdkPixbuf *pixbuf, *area;
-    int area_size, area_x, area_y;
-    int modulo;
-    int zoom_diff;
+    OsmGpsMapPrivate *priv = map->priv;
+    guint64 key = OSM_TILE_KEY (priv->source_id, zoom, x, y);
 
-    /* get a Pixbuf for the area to magnify */
-    zoom_diff = zoom - zoom_big;
+    return g_hash_table_contains (priv->tile_loads, &key);
+}
 
-    g_debug ("Upscaling by %d levels into tile %d,%d", zoom_diff, x, y);
+/* Looks for the closest tile covering x,y among the zoom levels between
+ * zoom and min_zoom (both exclusive) in the memory cache. If from_disk is
+ * set, the tiles not in memory are read from disk for the next redraw */
+static cairo_surface_t *
+osm_gps_map_find_bigger_tile (OsmGpsMap *map, int zoom, int x, int y,
+                              int min_zoom, gboolean from_disk, int *zoom_found)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    cairo_surface_t *surface;
 
-    area_size = TILESIZE >> zoom_diff;
-    modulo = 1 << zoom_diff;
-    area_x = (x % modulo) * area_size;
-    area_y = (y % modulo) * area_size;
-    area = gdk_pixbuf_new_subpixbuf (big, area_x, area_y,
-                                     area_size, area_size);
-    pixbuf = gdk_pixbuf_scale_simple (area, TILESIZE, TILESIZE,
-                                      GDK_INTERP_NEAREST);
-    g_object_unref (area);
-    return pixbuf;
+    while (--zoom > min_zoom) {
+        x /= 2;
+        y /= 2;
+        if (from_disk) {
+            surface = osm_gps_map_load_cached_tile (map, zoom, x, y, FALSE, TRUE);
+        } else {
+            surface = osm_tile_cache_lookup (priv->tile_cache,
+                                             OSM_TILE_KEY (priv->source_id, zoom, x, y));
+            if (surface)
+                cairo_surface_reference (surface);
+        }
+        if (surface) {
+            *zoom_found = zoom;
+            return surface;
+        }
+    }
+    return NULL;
 }
 
-static GdkPixbuf *
-osm_gps_map_render_missing_tile (OsmGpsMap *map, int zoom, int x, int y)
+/* Returns a tile of a lower zoom level (stored in zoom_found) covering the
+ * missing tile, which osm_gps_map_blit_tile() magnifies while painting.
+ * The result is remembered as a derived tile, so the search through the
+ * lower zoom levels (and the disk) is not repeated on every redraw */
+static cairo_surface_t *
+osm_gps_map_render_missing_tile_upscaled (OsmGpsMap *map, int zoom,
+                                          int x, int y, int *zoom_found)
 {
-    /* maybe TODO: render from downscaled tiles, if the following fails */
-    return osm_gps_map_render_missing_tile_upscaled (map, zoom, x, y);
+    OsmGpsMapPrivate *priv = map->priv;
+    guint64 key = OSM_TILE_KEY (priv->source_id, zoom, x, y);
+    cairo_surface_t *big, *closer;
+    gboolean stale = FALSE;
+    int zoom_closer;
+
+    big = osm_tile_cache_lookup_upscaled (priv->tile_cache, key, zoom_found, &stale);
+    if (big) {
+        cairo_surface_reference (big);
+        if (!stale)
+            return big;
+
+        /* tiles have arrived since, maybe one of them is closer */
+        closer = osm_gps_map_find_bigger_tile (map, zoom, x, y, *zoom_found,
+                                               FALSE, &zoom_closer);
+        if (closer) {
+            cairo_surface_destroy (big);
+            big = closer;
+            *zoom_found = zoom_closer;
+        }
+    } else {
+        big = osm_gps_map_find_bigger_tile (map, zoom, x, y, -1, TRUE, zoom_found);
+        if (!big) return NULL;
+    }
+
+    g_debug ("Found bigger tile (zoom = %d, wanted = %d)", *zoom_found, zoom);
+
+    osm_tile_cache_insert_upscaled (priv->tile_cache, key,
+                                    OSM_TILE_KEY (priv->source_id, *zoom_found,
+                                                  x >> (zoom - *zoom_found),
+                                                  y >> (zoom - *zoom_found)),
+                                    *zoom_found);
+    return big;
 }
 
-static void
-osm_gps_map_load_tile (OsmGpsMap *map, cairo_t *cr, int zoom, int x, int y, int offset_x, int offset_y)
+/* Whether the area of tile x,y is entirely covered by cached tiles of up to
+ * "levels" higher zoom levels. Checking first avoids composing a tile which
+ * would have holes, and does not mark the children as used */
+static gboolean
+osm_gps_map_children_cached (OsmGpsMap *map, int zoom, int x, int y, int levels)
 {
     OsmGpsMapPrivate *priv = map->priv;
-    gchar *filename;
-    GdkPixbuf *pixbuf;
-    int zoom_offset = priv->tile_zoom_offset;
-    int target_x, target_y;
+    int i, cx, cy;
 
-    g_debug("Load virtual tile %d,%d (%d,%d) z:%d", x, y, offset_x, offset_y, zoom);
+    if (levels == 0 || zoom >= priv->max_zoom)
+        return FALSE;
 
-    if (zoom > MIN_ZOOM) {
-      zoom -= zoom_offset;
-      x >>= zoom_offset;
-      y >>= zoom_offset;
+    for (i = 0; i < 4; i++) {
+        cx = 2 * x + (i & 1);
+        cy = 2 * y + (i >> 1);
+        if (!osm_tile_cache_contains (priv->tile_cache,
+                                      OSM_TILE_KEY (priv->source_id, zoom + 1, cx, cy)) &&
+            !osm_gps_map_children_cached (map, zoom + 1, cx, cy, levels - 1))
+            return FALSE;
     }
+    return TRUE;
+}
+
+/* Paints the cached children of tile x,y into its four quadrants of cr */
+static void
+osm_gps_map_paint_children (OsmGpsMap *map, cairo_t *cr, int zoom, int x, int y)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    cairo_surface_t *child;
+    int i, cx, cy;
+
+    for (i = 0; i < 4; i++) {
+        cx = 2 * x + (i & 1);
+        cy = 2 * y + (i >> 1);
+
+        cairo_save (cr);
+        cairo_translate (cr, (i & 1) * TILESIZE / 2, (i >> 1) * TILESIZE / 2);
+        cairo_scale (cr, 0.5, 0.5);
+
+        child = osm_tile_cache_lookup (priv->tile_cache,
+                                       OSM_TILE_KEY (priv->source_id, zoom + 1, cx, cy));
+        if (child) {
+            cairo_set_source_surface (cr, child, 0, 0);
+            cairo_paint (cr);
+        } else {
+            osm_gps_map_paint_children (map, cr, zoom + 1, cx, cy);
+        }
+
+        cairo_restore (cr);
+    }
+}
+
+/* Returns the missing tile composed from cached tiles of up to
+ * MAX_DOWNSCALE_LEVELS higher zoom levels, e.g. after zooming out. The
+ * result is kept in the tile cache until the real tile arrives */
+static cairo_surface_t *
+osm_gps_map_render_missing_tile_downscaled (OsmGpsMap *map, int zoom, int x, int y)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    guint64 key = OSM_TILE_KEY (priv->source_id, zoom, x, y);
+    cairo_surface_t *surface;
+    cairo_t *cr;
+
+    surface = osm_tile_cache_lookup_downscaled (priv->tile_cache, key);
+    if (surface)
+        return cairo_surface_reference (surface);
+
+    if (!osm_gps_map_children_cached (map, zoom, x, y, MAX_DOWNSCALE_LEVELS))
+        return NULL;
 
+    g_debug ("Composing tile %d,%d z:%d from smaller tiles", x, y, zoom);
+
+    surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, TILESIZE, TILESIZE);
+    cr = cairo_create (surface);
+    osm_gps_map_paint_children (map, cr, zoom, x, y);
+    cairo_destroy (cr);
+
+    osm_tile_cache_insert_downscaled (priv->tile_cache, key, surface);
+    return surface;
+}
+
+static cairo_surface_t *
+osm_gps_map_render_missing_tile (OsmGpsMap *map, int zoom, int x, int y,
+                                 int *zoom_found)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    cairo_surface_t *surface;
+
+    /* smaller tiles give a sharper result, if we have all of them */
+    surface = osm_gps_map_render_missing_tile_downscaled (map, zoom, x, y);
+    if (surface) {
+        priv->stats.downscaled++;
+        *zoom_found = zoom;
+        return surface;
+    }
+
+    surface = osm_gps_map_render_missing_tile_upscaled (map, zoom, x, y, zoom_found);
+    if (surface)
+        priv->stats.upscaled++;
+    return surface;
+}
+
+static void
+osm_gps_map_load_tile (OsmGpsMap *map, cairo_t *cr, int zoom, int x, int y, int offset_x, int offset_y)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    cairo_surface_t *surface;
+    int zoom_offset = priv->tile_zoom_offset;
+    int zoom_found;
+    int target_x, target_y;
+
+    g_debug("Load virtual tile %d,%d (%d,%d) z:%d", x, y, offset_x, offset_y, zoom);
+
+    /* the tile being painted, at the map zoom level */
     target_x = x;
     target_y = y;
 
+    if (zoom > MIN_ZOOM) {
+      zoom -= zoom_offset;
+      x >>= zoom_offset;
+      y >>= zoom_offset;
+    }
+
     g_debug("Load actual tile %d,%d (%d,%d) z:%d", x, y, offset_x, offset_y, zoom);
 
     if (priv->map_source == OSM_GPS_MAP_SOURCE_NULL && priv->repo_uri == NULL) {
@@ -1057,41 +1797,31 @@ osm_gps_map_load_tile (OsmGpsMap *map, cairo_t *cr, int zoom, int x, int y, int
         return;
     }
 
-    filename = g_strdup_printf("%s%c%d%c%d%c%d.%s",
-                priv->cache_dir, G_DIR_SEPARATOR,
-                zoom, G_DIR_SEPARATOR,
-                x, G_DIR_SEPARATOR,
-                y,
-                priv->image_format);
+    /* try to get file from internal cache first, else it is loaded from
+     * disk or downloaded, and painted in a later redraw */
+    surface = osm_gps_map_load_cached_tile(map, zoom, x, y,
+                                           priv->map_auto_download_enabled, TRUE);
 
-    /* try to get file from internal cache first */
-    if(!(pixbuf = osm_gps_map_load_cached_tile(map, zoom, x, y)))
-        pixbuf = gdk_pixbuf_new_from_file (filename, NULL);
-
-    if(pixbuf) {
-        g_debug("Found tile %s", filename);
-        osm_gps_map_blit_tile(map, pixbuf, cr, offset_x, offset_y,
+    if(surface) {
+        g_debug("Found tile %d,%d z:%d", x, y, zoom);
+        osm_gps_map_blit_tile(map, surface, cr, offset_x, offset_y,
                               zoom, target_x, target_y);
-        g_object_unref (pixbuf);
+        cairo_surface_destroy (surface);
     } else {
-        if (priv->map_auto_download_enabled) {
-            osm_gps_map_download_tile(map, zoom, x, y, TRUE);
-        }
-
-        /* try to render the tile by scaling cached tiles from other zoom
-         * levels */
-        pixbuf = osm_gps_map_render_missing_tile (map, zoom, x, y);
-        if (pixbuf) {
-            osm_gps_map_blit_tile(map, pixbuf, cr, offset_x, offset_y,
-                                   zoom, target_x, target_y);
-            g_object_unref (pixbuf);
+        /* meanwhile try to render the tile by scaling cached tiles from
+         * other zoom levels */
+        surface = osm_gps_map_render_missing_tile (map, zoom, x, y, &zoom_found);
+        if (surface) {
+            osm_gps_map_blit_tile(map, surface, cr, offset_x, offset_y,
+                                   zoom_found, target_x, target_y);
+            cairo_surface_destroy (surface);
         } else {
             /* prevent some artifacts when drawing not yet loaded areas. */
-            g_warning ("Error getting missing tile"); /* FIXME: is this a warning? */
+            if (!osm_gps_map_is_loading_tile (map, zoom, x, y))
+                g_warning ("Error getting missing tile"); /* FIXME: is this a warning? */
             draw_white_rectangle (cr, offset_x, offset_y, TILESIZE, TILESIZE);
         }
     }
-    g_free(filename);
 }
 
 static void
@@ -1109,6 +1839,9 @@ osm_gps_map_fill_tiles_pixel (OsmGpsMap *map, cairo_t *cr)
 
     gtk_widget_get_allocation(GTK_WIDGET(map), &allocation);
 
+    /* the tiles queued for a previous view which left it are dropped */
+    osm_gps_map_update_tile_view(map, allocation.width, allocation.height);
+
     offset_x = - priv->map_x % TILESIZE;
     offset_y = - priv->map_y % TILESIZE;
     if (offset_x > 0) offset_x -= TILESIZE;
@@ -1396,24 +2129,19 @@ osm_gps_map_print_polygons (OsmGpsMap *map, cairo_t* cr)
     }
 }
 
-
-static gboolean
-osm_gps_map_purge_cache_check(gpointer key, gpointer value, gpointer user)
-{
-   return (((OsmCachedTile*)value)->redraw_cycle != ((OsmGpsMapPrivate*)user)->redraw_cycle);
-}
-
 static void
 osm_gps_map_purge_cache (OsmGpsMap *map)
 {
    OsmGpsMapPrivate *priv = map->priv;
 
-   if (g_hash_table_size (priv->tile_cache) < priv->max_tile_cache_size)
-       return;
+   /* evict least recently used tiles until we are within the
+    * tile-cache-bytes budget, but keep the ones used during the last
+    * redraw operation */
+   osm_tile_store_purge (priv->tile_store);
 
-   /* run through the cache, and remove the tiles which have not been used
-    * during the last redraw operation */
-   g_hash_table_foreach_remove(priv->tile_cache, osm_gps_map_purge_cache_check, priv);
+   /* forget the surfaces of identical tiles which were all evicted */
+   if (priv->tile_dedup)
+       osm_tile_dedup_prune (priv->tile_dedup);
 }
 
 gboolean
@@ -1456,7 +2184,7 @@ osm_gps_map_map_redraw (OsmGpsMap *map)
     priv->drag_mouse_dx = 0;
     priv->drag_mouse_dy = 0;
 
-    priv->redraw_cycle++;
+    priv->redraw_cycle = osm_tile_cache_get_clock (priv->tile_cache);
 
     /* clear white background */
     w = gtk_widget_get_allocated_width (widget);
@@ -1637,6 +2365,19 @@ on_track_changed (OsmGpsMapTrack *track, GParamSpec *pspec, OsmGpsMap *map)
     osm_gps_map_map_redraw_idle (map);
 }
 
+#if GLIB_CHECK_VERSION(2, 64, 0)
+static void
+on_low_memory_warning (GMemoryMonitor *monitor, GMemoryMonitorWarningLevel level, OsmGpsMap *map)
+{
+    if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_CRITICAL)
+        osm_gps_map_trim_memory (map, OSM_GPS_MAP_TRIM_CRITICAL);
+    else if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM)
+        osm_gps_map_trim_memory (map, OSM_GPS_MAP_TRIM_MEDIUM);
+    else
+        osm_gps_map_trim_memory (map, OSM_GPS_MAP_TRIM_LOW);
+}
+#endif
+
 static void
 osm_gps_map_init (OsmGpsMap *object)
 {
@@ -1698,14 +2439,30 @@ osm_gps_map_init (OsmGpsMap *object)
     priv->tile_queue = g_hash_table_new_full (g_str_hash, g_str_equal,
                                               g_free, NULL);
 
+    /* tiles being read from disk or decoded, the keys are allocated */
+    priv->tile_loads = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                              g_free, NULL);
+    priv->tile_worker = osm_tile_worker_new (osm_gps_map_tile_load_thread,
+                                             osm_gps_map_tile_loads_done,
+                                             (GDestroyNotify)osm_gps_map_tile_load_free,
+                                             object);
+    priv->tile_view = g_new0 (OsmTileView, 1);
+    g_mutex_init (&priv->tile_view->lock);
+
+    priv->stale_tiles = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                               g_free, NULL);
+
     //Some mapping providers (Google) have varying degrees of tiles at multiple
     //zoom levels
-    priv->missing_tiles = g_hash_table_new (g_str_hash, g_str_equal);
+    priv->missing_tiles = osm_missing_tiles_new (MISSING_TILES_DEFAULT_MAX,
+                                                 MISSING_TILES_DEFAULT_TTL);
 
-    /* memory cache for most recently used tiles */
-    priv->tile_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                              g_free, (GDestroyNotify)cached_tile_free);
-    priv->max_tile_cache_size = 20;
+    /* memory cache for most recently used tiles, the budget is set by
+     * the tile-cache-bytes property. Replaced by the shared store if the
+     * shared-tile-cache property is set */
+    priv->tile_store = osm_tile_store_new ();
+    priv->tile_cache = osm_tile_store_get_cache (priv->tile_store);
+    osm_tile_store_add_client (priv->tile_store, object, &priv->redraw_cycle);
 
     gtk_widget_add_events (GTK_WIDGET (object),
                            GDK_BUTTON_PRESS_MASK | GDK_BUTTON_RELEASE_MASK |
@@ -1721,6 +2478,13 @@ osm_gps_map_init (OsmGpsMap *object)
     /* setup signal handlers */
     g_signal_connect(object, "key_press_event",
                     G_CALLBACK(on_window_key_press), priv);
+
+#if GLIB_CHECK_VERSION(2, 64, 0)
+    /* give memory back when the system runs low */
+    priv->memory_monitor = g_memory_monitor_dup_default();
+    g_signal_connect(priv->memory_monitor, "low-memory-warning",
+                    G_CALLBACK(on_low_memory_warning), object);
+#endif
 }
 
 static char*
@@ -1731,20 +2495,157 @@ osm_gps_map_get_cache_base_dir(OsmGpsMapPrivate *priv)
     return osm_gps_map_get_default_cache_directory();
 }
 
+static GVariant *
+osm_gps_map_build_statistics (OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    OsmGpsMapStats *stats = &priv->stats;
+    OsmTileDiskStats disk_stats = { 0, };
+    GVariantBuilder builder, array;
+    int i;
+
+    if (priv->tile_disk)
+        osm_tile_disk_get_stats (priv->tile_disk, &disk_stats);
+
+#define ADD_COUNTER(name, value) \
+    g_variant_builder_add (&builder, "{sv}", name, g_variant_new_uint64 (value))
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    ADD_COUNTER ("memory-hits", stats->memory_hits);
+    ADD_COUNTER ("memory-misses", stats->memory_misses);
+    ADD_COUNTER ("disk-hits", stats->disk_hits);
+    ADD_COUNTER ("disk-misses", stats->disk_misses);
+    ADD_COUNTER ("upscaled", stats->upscaled);
+    ADD_COUNTER ("downscaled", stats->downscaled);
+    ADD_COUNTER ("decoded", stats->decoded);
+    ADD_COUNTER ("decode-time", stats->decode_time);
+    ADD_COUNTER ("dedup-hits", stats->dedup_hits);
+    ADD_COUNTER ("decodes-dropped", stats->decodes_dropped);
+    ADD_COUNTER ("downloads", stats->downloads);
+    ADD_COUNTER ("download-failures", stats->download_failures);
+    ADD_COUNTER ("download-bytes", stats->download_bytes);
+    ADD_COUNTER ("download-retries", stats->download_retries);
+    ADD_COUNTER ("revalidations", stats->revalidations);
+    ADD_COUNTER ("revalidations-unchanged", stats->revalidations_unchanged);
+    ADD_COUNTER ("cache-bytes", osm_tile_cache_get_bytes (priv->tile_cache));
+    ADD_COUNTER ("cache-max-bytes", osm_tile_cache_get_max_bytes (priv->tile_cache));
+    ADD_COUNTER ("pinned-bytes", osm_tile_cache_get_pinned_bytes (priv->tile_cache));
+    ADD_COUNTER ("pinned-max-bytes", osm_tile_cache_get_max_pinned_bytes (priv->tile_cache));
+    ADD_COUNTER ("trimmed-bytes", stats->trimmed_bytes);
+    ADD_COUNTER ("disk-writes", disk_stats.written);
+    ADD_COUNTER ("disk-write-failures", disk_stats.write_failures);
+    ADD_COUNTER ("disk-writes-dropped", disk_stats.dropped);
+    ADD_COUNTER ("disk-write-queue", disk_stats.queued);
+    ADD_COUNTER ("disk-write-queue-peak", disk_stats.queued_peak);
+    ADD_COUNTER ("disk-cache-bytes", disk_stats.bytes);
+    ADD_COUNTER ("disk-evicted", disk_stats.evicted);
+    ADD_COUNTER ("disk-deduplicated", disk_stats.deduplicated);
+
+#undef ADD_COUNTER
+
+    g_variant_builder_init (&array, G_VARIANT_TYPE ("at"));
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+        g_variant_builder_add (&array, "t", stats->download_latency[i]);
+    g_variant_builder_add (&builder, "{sv}", "download-latency",
+                           g_variant_builder_end (&array));
+
+    g_variant_builder_init (&array, G_VARIANT_TYPE ("au"));
+    for (i = 0; i < LATENCY_BUCKETS - 1; i++)
+        g_variant_builder_add (&array, "u", latency_bounds[i]);
+    g_variant_builder_add (&builder, "{sv}", "download-latency-bounds",
+                           g_variant_builder_end (&array));
+
+    return g_variant_builder_end (&builder);
+}
+
+static gboolean
+osm_gps_map_emit_statistics (gpointer data)
+{
+    OsmGpsMap *map = OSM_GPS_MAP(data);
+    GVariant *stats = g_variant_ref_sink (osm_gps_map_build_statistics (map));
+
+    g_signal_emit_by_name (map, "statistics", stats);
+    g_variant_unref (stats);
+
+    return TRUE;
+}
+
+/* Saves the missing tiles beside the tiles, so that they are not asked
+ * for again after a restart */
+static void
+osm_gps_map_save_missing_tiles(OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    char *filename, *dir;
+
+    if (!priv->tile_disk)
+        return;
+
+    /* nothing was downloaded if the directory does not exist */
+    filename = osm_tile_disk_get_sidecar(priv->tile_disk, MISSING_TILES_FILENAME);
+    dir = g_path_get_dirname(filename);
+    if (g_file_test(dir, G_FILE_TEST_IS_DIR))
+        osm_missing_tiles_save(priv->missing_tiles, filename, priv->source_id);
+    g_free(dir);
+    g_free(filename);
+}
+
+/* Opens the tiles in cache_dir, a directory, an MBTiles file or a PMTiles
+ * archive */
+static void
+osm_gps_map_open_tile_disk(OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    char *filename;
+
+    if (priv->tile_disk)
+        osm_tile_disk_unref(priv->tile_disk);
+    priv->tile_disk = NULL;
+
+    if (!priv->cache_dir)
+        return;
+
+    priv->tile_disk = osm_tile_disk_new(priv->cache_dir, priv->image_format,
+                                        priv->tile_dedup != NULL);
+    if (!priv->tile_disk)
+        return;
+
+    if (priv->disk_cache_max_bytes)
+        osm_tile_disk_set_max_bytes(priv->tile_disk, priv->disk_cache_max_bytes);
+
+    filename = osm_tile_disk_get_sidecar(priv->tile_disk, MISSING_TILES_FILENAME);
+    osm_missing_tiles_load(priv->missing_tiles, filename, priv->source_id);
+    g_free(filename);
+}
+
 static void
 osm_gps_map_setup(OsmGpsMap *map)
 {
     const char *uri;
     OsmGpsMapPrivate *priv = map->priv;
 
+    /* the missing tiles are those of the previous source */
+    if ( priv->is_constructed ) {
+        osm_gps_map_save_missing_tiles(map);
+        osm_missing_tiles_clear(priv->missing_tiles);
+        g_object_notify(G_OBJECT(map), "tiles-missing");
+    }
+
    /* user can specify a map source ID, or a repo URI as the map source */
     uri = osm_gps_map_source_get_repo_uri(OSM_GPS_MAP_SOURCE_NULL);
     if ( (priv->map_source == 0) || (strcmp(priv->repo_uri, uri) == 0) ) {
+        cairo_t *cr;
+
         g_debug("Using null source");
         priv->map_source = OSM_GPS_MAP_SOURCE_NULL;
 
-        priv->null_tile = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, 256, 256);
-        gdk_pixbuf_fill(priv->null_tile, 0xcccccc00);
+        if (priv->null_tile)
+            cairo_surface_destroy (priv->null_tile);
+        priv->null_tile = cairo_image_surface_create(CAIRO_FORMAT_RGB24, TILESIZE, TILESIZE);
+        cr = cairo_create(priv->null_tile);
+        cairo_set_source_rgb(cr, 0.8, 0.8, 0.8);
+        cairo_paint(cr);
+        cairo_destroy(cr);
     }
     else if (priv->map_source >= 0) {
         /* check if the source given is valid */
@@ -1764,6 +2665,7 @@ osm_gps_map_setup(OsmGpsMap *map)
     }
     /* parse the source uri */
     inspect_map_uri(priv);
+    priv->source_id = osm_tile_cache_source_id(priv->repo_uri);
 
     /* setup the tile cache */
     if ( g_strcmp0(priv->tile_dir, OSM_GPS_MAP_CACHE_DISABLED) == 0 ) {
@@ -1787,12 +2689,15 @@ osm_gps_map_setup(OsmGpsMap *map)
     }
     g_debug("Cache dir: %s", priv->cache_dir);
 
+    osm_gps_map_open_tile_disk(map);
+
     /* check if we are being called for a second (or more) time in the lifetime
        of the object, and if so, do some extra cleanup */
     if ( priv->is_constructed ) {
         g_debug("Setup called again in map lifetime");
-        /* flush the ram cache */
-        g_hash_table_remove_all(priv->tile_cache);
+        /* flush the ram cache, unless other maps are using it */
+        if (!osm_tile_store_is_shared(priv->tile_store))
+            osm_tile_cache_remove_all(priv->tile_cache);
 
         /* adjust zoom if necessary */
         if(priv->map_zoom > priv->max_zoom)
@@ -1833,14 +2738,33 @@ osm_gps_map_dispose (GObject *object)
 
     priv->is_disposed = TRUE;
 
+    /* cancels our downloads, telling the maps waiting for them */
     soup_session_abort(priv->soup_session);
     g_object_unref(priv->soup_session);
 
+    /* the maps waiting for tiles we still decode are told to get them
+     * themselves */
+    osm_gps_map_notify_waiters(osm_tile_store_remove_client(priv->tile_store, map));
+    osm_tile_store_unref(priv->tile_store);
+
     g_object_unref(priv->gps_track);
 
     g_hash_table_destroy(priv->tile_queue);
-    g_hash_table_destroy(priv->missing_tiles);
-    g_hash_table_destroy(priv->tile_cache);
+
+    /* waits for the tiles being decoded, the others are dropped */
+    osm_tile_worker_free(priv->tile_worker);
+    g_mutex_clear(&priv->tile_view->lock);
+    g_free(priv->tile_view);
+    g_hash_table_destroy(priv->tile_loads);
+
+    osm_gps_map_save_missing_tiles(map);
+    osm_missing_tiles_free(priv->missing_tiles);
+
+    /* the tiles queued for the disk are written first, even those of an
+     * import still running, which holds a reference of its own */
+    if (priv->tile_disk)
+        osm_tile_disk_unref(priv->tile_disk);
+    priv->tile_disk = NULL;
 
     /* images and layers contain GObjects which need unreffing, so free here */
     gslist_of_gobjects_free(&priv->images);
@@ -1851,7 +2775,7 @@ osm_gps_map_dispose (GObject *object)
         cairo_surface_destroy (priv->pixmap);
 
     if (priv->null_tile)
-        g_object_unref (priv->null_tile);
+        cairo_surface_destroy (priv->null_tile);
 
     if (priv->idle_map_redraw != 0)
         g_source_remove (priv->idle_map_redraw);
@@ -1859,6 +2783,18 @@ osm_gps_map_dispose (GObject *object)
     if (priv->drag_expose_source != 0)
         g_source_remove (priv->drag_expose_source);
 
+    if (priv->statistics_source != 0)
+        g_source_remove (priv->statistics_source);
+
+    if (priv->revalidate_source != 0)
+        g_source_remove (priv->revalidate_source);
+    g_hash_table_destroy (priv->stale_tiles);
+
+#if GLIB_CHECK_VERSION(2, 64, 0)
+    g_signal_handlers_disconnect_by_data (priv->memory_monitor, map);
+    g_object_unref (priv->memory_monitor);
+#endif
+
     g_free(priv->gps);
 
 
@@ -1887,6 +2823,10 @@ osm_gps_map_finalize (GObject *object)
     /* trip and tracks contain simple non GObject types, so free them here */
     gslist_of_data_free(&priv->trip_history);
 
+    /* not in dispose, the tile loads still running may use it */
+    if (priv->tile_dedup)
+        osm_tile_dedup_free(priv->tile_dedup);
+
     G_OBJECT_CLASS (osm_gps_map_parent_class)->finalize (object);
 }
 
@@ -1956,10 +2896,16 @@ osm_gps_map_set_property (GObject *object, guint prop_id, const GValue *value, G
                     (g_strcmp0(priv->tile_dir, OSM_GPS_MAP_CACHE_FRIENDLY) == 0)) {
                     /* this case is handled by osm_gps_map_setup */
                 } else {
+                    if (priv->is_constructed) {
+                        osm_gps_map_save_missing_tiles(map);
+                        osm_missing_tiles_clear(priv->missing_tiles);
+                    }
                     if (priv->cache_dir)
                         g_free(priv->cache_dir);
                     priv->cache_dir = g_strdup(priv->tile_dir);
                     g_debug("Cache dir: %s", priv->cache_dir);
+                    if (priv->is_constructed)
+                        osm_gps_map_open_tile_disk(map);
                 }
             } else {
                 if (priv->tile_dir)
@@ -2030,6 +2976,43 @@ osm_gps_map_set_property (GObject *object, guint prop_id, const GValue *value, G
         case PROP_SHOW_GPS_POINT:
             priv->gps_point_enabled = g_value_get_boolean (value);
             break;
+        case PROP_TILE_CACHE_BYTES:
+            osm_tile_cache_set_max_bytes (priv->tile_cache,
+                    MIN (g_value_get_uint64 (value), G_MAXSIZE));
+            osm_gps_map_purge_cache (map);
+            break;
+        case PROP_TILE_PIN_BYTES:
+            osm_tile_cache_set_max_pinned_bytes (priv->tile_cache,
+                    MIN (g_value_get_uint64 (value), G_MAXSIZE));
+            break;
+        case PROP_DISK_CACHE_MAX_BYTES:
+            priv->disk_cache_max_bytes = g_value_get_uint64 (value);
+            if (priv->tile_disk)
+                osm_tile_disk_set_max_bytes (priv->tile_disk, priv->disk_cache_max_bytes);
+            break;
+        case PROP_STATISTICS_INTERVAL:
+            priv->statistics_interval = g_value_get_uint (value);
+            if (priv->statistics_source != 0)
+                g_source_remove (priv->statistics_source);
+            priv->statistics_source = 0;
+            if (priv->statistics_interval > 0)
+                priv->statistics_source = g_timeout_add_seconds (priv->statistics_interval,
+                                                                 osm_gps_map_emit_statistics,
+                                                                 map);
+            break;
+        case PROP_TILE_DEDUP:
+            if (g_value_get_boolean (value))
+                priv->tile_dedup = osm_tile_dedup_new ();
+            break;
+        case PROP_SHARED_TILE_CACHE:
+            if (g_value_get_boolean (value)) {
+                g_slist_free (osm_tile_store_remove_client (priv->tile_store, map));
+                osm_tile_store_unref (priv->tile_store);
+                priv->tile_store = osm_tile_store_get_shared ();
+                priv->tile_cache = osm_tile_store_get_cache (priv->tile_store);
+                osm_tile_store_add_client (priv->tile_store, map, &priv->redraw_cycle);
+            }
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
             break;
@@ -2099,6 +3082,15 @@ osm_gps_map_get_property (GObject *object, guint prop_id, GValue *value, GParamS
         case PROP_TILES_QUEUED:
             g_value_set_int(value, g_hash_table_size(priv->tile_queue));
             break;
+        case PROP_TILES_MISSING:
+            g_value_set_uint(value, osm_missing_tiles_get_size(priv->missing_tiles));
+            break;
+        case PROP_STATISTICS:
+            g_value_take_variant(value, osm_gps_map_build_statistics(map));
+            break;
+        case PROP_STATISTICS_INTERVAL:
+            g_value_set_uint(value, priv->statistics_interval);
+            break;
         case PROP_GPS_TRACK_WIDTH: {
             gfloat f;
             g_object_get (priv->gps_track, "line-width", &f, NULL);
@@ -2125,6 +3117,21 @@ osm_gps_map_get_property (GObject *object, guint prop_id, GValue *value, GParamS
         case PROP_SHOW_GPS_POINT:
             g_value_set_boolean(value, priv->gps_point_enabled);
             break;
+        case PROP_TILE_CACHE_BYTES:
+            g_value_set_uint64(value, osm_tile_cache_get_max_bytes(priv->tile_cache));
+            break;
+        case PROP_TILE_PIN_BYTES:
+            g_value_set_uint64(value, osm_tile_cache_get_max_pinned_bytes(priv->tile_cache));
+            break;
+        case PROP_DISK_CACHE_MAX_BYTES:
+            g_value_set_uint64(value, priv->disk_cache_max_bytes);
+            break;
+        case PROP_SHARED_TILE_CACHE:
+            g_value_set_boolean(value, osm_tile_store_is_shared(priv->tile_store));
+            break;
+        case PROP_TILE_DEDUP:
+            g_value_set_boolean(value, priv->tile_dedup != NULL);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
             break;
@@ -2696,7 +3703,23 @@ osm_gps_map_class_init (OsmGpsMapClass *klass)
      * of #OsmGpsMap:repo-uri. #OSM_GPS_MAP_CACHE_FRIENDLY
      * causes the tile cache to be /tile-cache-base/friendlyname(repo-uri).
      *
-     * Any other string is interpreted as a local path, i.e. /path/to/cache
+     * Any other string is interpreted as a local path, i.e. /path/to/cache.
+     * If the path ends in .mbtiles, tiles are stored in that single
+     * <ulink url="https://github.com/mapbox/mbtiles-spec">MBTiles</ulink>
+     * (SQLite) file instead of one file per tile, if the library was built
+     * with SQLite support.
+     *
+     * If the path ends in .pmtiles, the tiles are read from that
+     * <ulink url="https://github.com/protomaps/PMTiles">PMTiles</ulink>
+     * archive of raster tiles, which is never written to. The map then works
+     * offline: tiles missing from the archive are not downloaded.
+     *
+     * The HTTP caching headers of the downloaded tiles are kept too. When a
+     * tile loaded from the cache for display has expired (or is a week old,
+     * if the server did not say) it is revalidated when the map is idle,
+     * with a conditional request which only downloads the tile again if it
+     * changed. osm_gps_map_download_maps() revalidates the expired tiles it
+     * finds in the cache.
      **/
     g_object_class_install_property (object_class,
                                      PROP_TILE_CACHE_DIR,
@@ -2730,6 +3753,121 @@ osm_gps_map_class_init (OsmGpsMapClass *klass)
                                                           NULL,
                                                           G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY));
 
+    /**
+     * OsmGpsMap:tile-cache-bytes:
+     *
+     * The amount of memory, in bytes of decoded image data, that may be
+     * used to keep recently shown tiles in memory. When the budget is
+     * exceeded the least recently used tiles are dropped. Tiles that are
+     * currently on screen are never dropped, even if they alone exceed
+     * the budget.
+     *
+     * Maps using the #OsmGpsMap:shared-tile-cache share a single budget,
+     * which is set by whichever of them sets this property last.
+     *
+     * Since: 1.2.2
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_TILE_CACHE_BYTES,
+                                     g_param_spec_uint64 ("tile-cache-bytes",
+                                                          "tile cache bytes",
+                                                          "Memory budget for decoded tiles in bytes",
+                                                          0,            /* minimum property value */
+                                                          G_MAXUINT64,  /* maximum property value */
+                                                          TILE_CACHE_DEFAULT_BYTES,
+                                                          G_PARAM_READABLE | G_PARAM_WRITABLE));
+
+    /**
+     * OsmGpsMap:tile-pin-bytes:
+     *
+     * The amount of memory, in bytes of decoded image data, that the
+     * tiles pinned with osm_gps_map_pin_region() may use, on top of
+     * #OsmGpsMap:tile-cache-bytes. Every pinned tile is counted as a
+     * decoded 256x256 tile, whether it is loaded yet or not. Lowering it
+     * does not unpin anything, but no more tiles are pinned until the
+     * pins fit again.
+     *
+     * Maps using the #OsmGpsMap:shared-tile-cache share a single limit,
+     * which is set by whichever of them sets this property last.
+     *
+     * Since: 1.2.2
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_TILE_PIN_BYTES,
+                                     g_param_spec_uint64 ("tile-pin-bytes",
+                                                          "tile pin bytes",
+                                                          "Memory limit of the pinned tiles in bytes",
+                                                          0,            /* minimum property value */
+                                                          G_MAXUINT64,  /* maximum property value */
+                                                          TILE_PIN_DEFAULT_BYTES,
+                                                          G_PARAM_READABLE | G_PARAM_WRITABLE));
+
+    /**
+     * OsmGpsMap:shared-tile-cache:
+     *
+     * Whether to share tiles with the other maps of the process that have
+     * this property set, rather than keeping a private cache. Maps showing
+     * the same source then share their decoded tiles, their memory budget
+     * (see #OsmGpsMap:tile-cache-bytes) and the downloads in progress, so
+     * that a tile shown by several maps is only downloaded and decoded
+     * once.
+     *
+     * Since: 1.2.2
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_SHARED_TILE_CACHE,
+                                     g_param_spec_boolean ("shared-tile-cache",
+                                                           "shared tile cache",
+                                                           "Share the tile cache with other maps",
+                                                           FALSE,
+                                                           G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY));
+
+    /**
+     * OsmGpsMap:disk-cache-max-bytes:
+     *
+     * The quota of the tiles downloaded to the #OsmGpsMap:tile-cache, in
+     * bytes, or 0 for no limit. When the quota is exceeded the least
+     * recently used tiles are removed in the background, until the cache
+     * takes 90% of the quota.
+     *
+     * To do so the size and last use of the tiles are kept in a
+     * "tile-index" file beside them. A cache written by an older version
+     * is indexed once in the background, until then its size is
+     * underestimated.
+     *
+     * Since: 1.2.2
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_DISK_CACHE_MAX_BYTES,
+                                     g_param_spec_uint64 ("disk-cache-max-bytes",
+                                                          "disk cache max bytes",
+                                                          "Quota of the tiles on disk in bytes",
+                                                          0,            /* minimum property value */
+                                                          G_MAXUINT64,  /* maximum property value */
+                                                          0,
+                                                          G_PARAM_READABLE | G_PARAM_WRITABLE));
+
+    /**
+     * OsmGpsMap:tile-dedup:
+     *
+     * Whether to store identical tiles, like open sea, only once. The
+     * #OsmGpsMap:tile-cache then keeps each distinct tile once, the other
+     * tiles linking to it (an MBTiles cache uses the map and images tables
+     * for this, a directory uses hard links where the filesystem supports
+     * them), and identical tiles share one decoded surface in memory.
+     *
+     * An existing MBTiles cache keeps the layout it was created with.
+     *
+     * Since: 1.2.2
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_TILE_DEDUP,
+                                     g_param_spec_boolean ("tile-dedup",
+                                                           "tile dedup",
+                                                           "Store identical tiles once",
+                                                           FALSE,
+                                                           G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY));
+
     /**
      * OsmGpsMap:zoom:
      *
@@ -2832,6 +3970,110 @@ osm_gps_map_class_init (OsmGpsMapClass *klass)
                                                        0,
                                                        G_PARAM_READABLE));
 
+    /**
+     * OsmGpsMap:tiles-missing:
+     *
+     * The number of tiles the server was found not to have, which are not
+     * asked for again until they expire after a day. At most 4096 tiles
+     * are remembered; if the map has a cache directory, they are saved
+     * there so that they are remembered across restarts. Connect to
+     * ::notify::tiles-missing if you want to be informed when this changes.
+     *
+     * Since: 1.2.2
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_TILES_MISSING,
+                                     g_param_spec_uint ("tiles-missing",
+                                                        "tiles-missing",
+                                                        "The number of tiles known to be missing on the server",
+                                                        0,          /* minimum property value */
+                                                        G_MAXUINT,  /* maximum property value */
+                                                        0,
+                                                        G_PARAM_READABLE));
+
+    /**
+     * OsmGpsMap:statistics:
+     *
+     * Counters describing how tiles were obtained since the map was
+     * created, as a dictionary (a{sv}) with the following entries:
+     *
+     * <itemizedlist>
+     * <listitem><para>"memory-hits", "memory-misses" (t): tile lookups in
+     * the memory cache</para></listitem>
+     * <listitem><para>"disk-hits", "disk-misses" (t): tiles looked for in
+     * the disk cache after a memory miss</para></listitem>
+     * <listitem><para>"upscaled", "downscaled" (t): missing tiles painted
+     * from tiles of a lower or higher zoom level</para></listitem>
+     * <listitem><para>"decoded" (t): tiles decoded, and "decode-time" (t)
+     * the time spent doing so, in microseconds</para></listitem>
+     * <listitem><para>"dedup-hits" (t): tiles given the surface of an
+     * identical tile instead of being decoded, see
+     * #OsmGpsMap:tile-dedup</para></listitem>
+     * <listitem><para>"decodes-dropped" (t): tiles not read from disk or
+     * decoded because they were scrolled out of view while they waited
+     * for a worker thread</para></listitem>
+     * <listitem><para>"downloads", "download-failures", "download-bytes"
+     * and "download-retries" (t)</para></listitem>
+     * <listitem><para>"revalidations" (t): conditional requests for stale
+     * tiles, and "revalidations-unchanged" (t) those answered with 304 Not
+     * Modified</para></listitem>
+     * <listitem><para>"download-latency" (at): the number of downloads
+     * which took less than each of the "download-latency-bounds" (au), in
+     * milliseconds, and a last one for the slower ones</para></listitem>
+     * <listitem><para>"cache-bytes", "cache-max-bytes" (t): the memory used
+     * by the tile cache, and its budget</para></listitem>
+     * <listitem><para>"pinned-bytes" (t): the memory used by the tiles
+     * pinned with osm_gps_map_pin_region(), which is not part of the
+     * budget, and "pinned-max-bytes" (t) their limit, see
+     * #OsmGpsMap:tile-pin-bytes</para></listitem>
+     * <listitem><para>"trimmed-bytes" (t): the memory freed by
+     * osm_gps_map_trim_memory()</para></listitem>
+     * <listitem><para>"disk-writes", "disk-write-failures" (t): tiles
+     * written to the disk cache in the background, and
+     * "disk-writes-dropped" (t) those not written because too many were
+     * waiting</para></listitem>
+     * <listitem><para>"disk-write-queue", "disk-write-queue-peak" (t): the
+     * tiles waiting to be written, now and at most</para></listitem>
+     * <listitem><para>"disk-cache-bytes" (t): the size of the tiles in the
+     * disk cache, and "disk-evicted" (t) the tiles removed to stay within
+     * #OsmGpsMap:disk-cache-max-bytes</para></listitem>
+     * <listitem><para>"disk-deduplicated" (t): tiles written whose content
+     * was already stored</para></listitem>
+     * </itemizedlist>
+     *
+     * Counters never decrease, except that the disk-write ones restart
+     * when #OsmGpsMap:tile-cache changes; compare two snapshots to get
+     * rates. More entries may be added in later versions.
+     *
+     * Since: 1.2.2
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_STATISTICS,
+                                     g_param_spec_variant ("statistics",
+                                                           "statistics",
+                                                           "Tile loading statistics",
+                                                           G_VARIANT_TYPE_VARDICT,
+                                                           NULL,
+                                                           G_PARAM_READABLE));
+
+    /**
+     * OsmGpsMap:statistics-interval:
+     *
+     * If not 0, the #OsmGpsMap::statistics signal is emitted with the
+     * #OsmGpsMap:statistics every that many seconds.
+     *
+     * Since: 1.2.2
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_STATISTICS_INTERVAL,
+                                     g_param_spec_uint ("statistics-interval",
+                                                        "statistics interval",
+                                                        "Seconds between statistics signals, or 0",
+                                                        0,          /* minimum property value */
+                                                        G_MAXUINT,  /* maximum property value */
+                                                        0,
+                                                        G_PARAM_READABLE | G_PARAM_WRITABLE));
+
     g_object_class_install_property (object_class,
                                      PROP_GPS_TRACK_WIDTH,
                                      g_param_spec_float ("gps-track-width",
@@ -2889,7 +4131,7 @@ osm_gps_map_class_init (OsmGpsMapClass *klass)
                                      PROP_IMAGE_FORMAT,
                                      g_param_spec_string ("image-format",
                                                           "image format",
-                                                          "The map source tile repository image format (jpg, png)",
+                                                          "The map source tile repository image format (jpg, png, webp)",
                                                           OSM_IMAGE_FORMAT,
                                                           G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY));
 
@@ -2919,6 +4161,20 @@ osm_gps_map_class_init (OsmGpsMapClass *klass)
     g_signal_new ("changed", OSM_TYPE_GPS_MAP,
                   G_SIGNAL_RUN_FIRST, 0, NULL, NULL,
                   g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
+
+    /**
+     * OsmGpsMap::statistics:
+     * @map: the map
+     * @statistics: the #OsmGpsMap:statistics
+     *
+     * Emitted periodically if #OsmGpsMap:statistics-interval is set.
+     *
+     * Since: 1.2.2
+     **/
+    g_signal_new ("statistics", OSM_TYPE_GPS_MAP,
+                  G_SIGNAL_RUN_FIRST, 0, NULL, NULL,
+                  g_cclosure_marshal_VOID__VARIANT, G_TYPE_NONE, 1,
+                  G_TYPE_VARIANT);
 }
 
 /**
@@ -2939,7 +4195,6 @@ osm_gps_map_download_maps (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *
     OsmGpsMapPrivate *priv = map->priv;
 
     if (pt1 && pt2) {
-        gchar *filename;
         int i,j,zoom;
         int num_tiles = 0;
         zoom_end = CLAMP(zoom_end, priv->min_zoom, priv->max_zoom);
@@ -2966,17 +4221,13 @@ osm_gps_map_download_maps (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *
                 /* loop y1 - y2 */
                 for(j=y1; j<=y2; j++) {
                     /* x = i, y = j */
-                    filename = g_strdup_printf("%s%c%d%c%d%c%d.%s",
-                                    priv->cache_dir, G_DIR_SEPARATOR,
-                                    zoom, G_DIR_SEPARATOR,
-                                    i, G_DIR_SEPARATOR,
-                                    j,
-                                    priv->image_format);
-                    if (!g_file_test(filename, G_FILE_TEST_EXISTS)) {
+                    if (!priv->tile_disk ||
+                        !osm_tile_disk_contains(priv->tile_disk, zoom, i, j)) {
                         osm_gps_map_download_tile(map, zoom, i, j, FALSE);
                         num_tiles++;
+                    } else {
+                        osm_gps_map_revalidate_tile(map, zoom, i, j);
                     }
-                    g_free(filename);
                 }
             }
             g_debug("DL @Z:%d = %d tiles", zoom, num_tiles);
@@ -2984,6 +4235,846 @@ osm_gps_map_download_maps (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *
     }
 }
 
+/**
+ * osm_gps_map_estimate_download:
+ * @map: a #OsmGpsMap widget
+ * @pt1: (in): north west corner
+ * @pt2: (in): south east corner
+ * @zoom_start: (in): start of zoom range
+ * @zoom_end: (in): end of zoom range
+ * @bytes: (out) (allow-none): the estimated size of the tiles to download
+ *
+ * Counts the tiles osm_gps_map_download_maps() would download for the
+ * same region, those not in the #OsmGpsMap:tile-cache. Once the cache
+ * is indexed (shortly after it is opened) this does not touch the disk.
+ *
+ * The size is estimated from the mean size of the tiles in the cache,
+ * or of those downloaded so far; it is 0 if neither is known.
+ *
+ * Returns: the number of tiles missing
+ *
+ * Since: 1.2.2
+ **/
+guint
+osm_gps_map_estimate_download (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *pt2,
+                               int zoom_start, int zoom_end, guint64 *bytes)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    OsmTileDiskStats disk_stats = { 0, };
+    guint64 mean = 0;
+    guint num_tiles = 0;
+    int zoom;
+
+    if (bytes)
+        *bytes = 0;
+    g_return_val_if_fail (OSM_GPS_MAP_IS_MAP (map), 0);
+    g_return_val_if_fail (pt1 && pt2, 0);
+
+    zoom_end = CLAMP(zoom_end, priv->min_zoom, priv->max_zoom);
+    zoom_start = CLAMP(zoom_start, priv->min_zoom, priv->max_zoom);
+
+    for(zoom=zoom_start; zoom<=zoom_end; zoom++) {
+        int x1,y1,x2,y2;
+
+        x1 = (int)floorf((float)lon2pixel(zoom, pt1->rlon) / (float)TILESIZE);
+        y1 = (int)floorf((float)lat2pixel(zoom, pt1->rlat) / (float)TILESIZE);
+
+        x2 = (int)floorf((float)lon2pixel(zoom, pt2->rlon) / (float)TILESIZE);
+        y2 = (int)floorf((float)lat2pixel(zoom, pt2->rlat) / (float)TILESIZE);
+
+        /* the same limit as osm_gps_map_download_maps() */
+        if ( (x2-x1) * (y2-y1) > MAX_DOWNLOAD_TILES )
+            break;
+
+        if (x2 < x1 || y2 < y1)
+            continue;
+        num_tiles += (x2 - x1 + 1) * (y2 - y1 + 1);
+        if (priv->tile_disk)
+            num_tiles -= osm_tile_disk_count(priv->tile_disk, zoom, x1, y1, x2, y2);
+    }
+
+    if (priv->tile_disk)
+        osm_tile_disk_get_stats (priv->tile_disk, &disk_stats);
+    if (disk_stats.tiles > 0)
+        mean = disk_stats.bytes / disk_stats.tiles;
+    else if (priv->stats.downloads > 0)
+        mean = priv->stats.download_bytes / priv->stats.downloads;
+    if (bytes)
+        *bytes = num_tiles * mean;
+
+    return num_tiles;
+}
+
+/**
+ * osm_gps_map_pin_region:
+ * @map: a #OsmGpsMap widget
+ * @pt1: (in): north west corner
+ * @pt2: (in): south east corner
+ * @zoom_start: (in): start of zoom range
+ * @zoom_end: (in): end of zoom range
+ *
+ * Keeps the tiles over the supplied zoom range in the rectangular region
+ * specified by pt1 (north west corner) to pt2 (south east corner) decoded
+ * in memory, so that they can always be shown instantly. Tiles which are
+ * not cached yet are loaded from disk or downloaded now.
+ *
+ * Pinned tiles are never evicted from the tile cache, and do not count
+ * against #OsmGpsMap:tile-cache-bytes; their size is reported as
+ * "pinned-bytes" in the #OsmGpsMap:statistics. Instead they are limited
+ * by #OsmGpsMap:tile-pin-bytes: a region whose tiles would not fit is not
+ * pinned at all. Regions can be pinned repeatedly and add up. The pins
+ * apply to the current map source.
+ *
+ * Returns: %TRUE if the region was pinned, %FALSE if it exceeds the
+ * #OsmGpsMap:tile-pin-bytes limit
+ *
+ * Since: 1.2.2
+ **/
+gboolean
+osm_gps_map_pin_region (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *pt2, int zoom_start, int zoom_end)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    cairo_surface_t *surface;
+    GArray *keys;
+    guint64 key, pinned_bytes;
+    guint k;
+    int i,j,zoom;
+
+    g_return_val_if_fail (OSM_GPS_MAP_IS_MAP (map), FALSE);
+    g_return_val_if_fail (pt1 && pt2, FALSE);
+
+    zoom_end = CLAMP(zoom_end, priv->min_zoom, priv->max_zoom);
+    zoom_start = CLAMP(zoom_start, priv->min_zoom, priv->max_zoom);
+
+    /* the tiles to pin, checked against the limit before pinning any */
+    keys = g_array_new (FALSE, FALSE, sizeof (guint64));
+    for(zoom=zoom_start; zoom<=zoom_end; zoom++) {
+        int x1,y1,x2,y2;
+
+        x1 = (int)floorf((float)lon2pixel(zoom, pt1->rlon) / (float)TILESIZE);
+        y1 = (int)floorf((float)lat2pixel(zoom, pt1->rlat) / (float)TILESIZE);
+
+        x2 = (int)floorf((float)lon2pixel(zoom, pt2->rlon) / (float)TILESIZE);
+        y2 = (int)floorf((float)lat2pixel(zoom, pt2->rlat) / (float)TILESIZE);
+
+        x1 = MAX (x1, 0);
+        y1 = MAX (y1, 0);
+        x2 = MIN (x2, (1 << zoom) - 1);
+        y2 = MIN (y2, (1 << zoom) - 1);
+
+        /* check for insane ranges */
+        if ( (x2-x1) * (y2-y1) > MAX_DOWNLOAD_TILES ) {
+            g_warning("Not pinning zoom level %d and up, because "
+                      "number of tiles would exceed %d", zoom, MAX_DOWNLOAD_TILES);
+            break;
+        }
+
+        for(i=x1; i<=x2; i++) {
+            for(j=y1; j<=y2; j++) {
+                key = OSM_TILE_KEY (priv->source_id, zoom, i, j);
+                if (!osm_tile_cache_is_pinned (priv->tile_cache, key))
+                    g_array_append_val (keys, key);
+            }
+        }
+    }
+
+    /* every pin counts as a decoded tile, loaded or not */
+    pinned_bytes = (guint64)(osm_tile_cache_get_pin_count (priv->tile_cache) + keys->len) *
+                   TILESIZE * TILESIZE * 4;
+    if (pinned_bytes > osm_tile_cache_get_max_pinned_bytes (priv->tile_cache)) {
+        g_array_free (keys, TRUE);
+        return FALSE;
+    }
+
+    for (k = 0; k < keys->len; k++) {
+        key = g_array_index (keys, guint64, k);
+        osm_tile_cache_pin (priv->tile_cache, key);
+
+        /* a tile rendered from another zoom level would keep the real
+         * one from being loaded from disk */
+        if (osm_tile_cache_contains_derived (priv->tile_cache, key))
+            osm_tile_cache_remove (priv->tile_cache, key);
+
+        /* once cached, the tile is pinned */
+        surface = osm_gps_map_load_cached_tile (map, OSM_TILE_KEY_ZOOM (key),
+                                                OSM_TILE_KEY_X (key), OSM_TILE_KEY_Y (key),
+                                                TRUE, FALSE);
+        if (surface)
+            cairo_surface_destroy (surface);
+    }
+    g_array_free (keys, TRUE);
+
+    return TRUE;
+}
+
+typedef struct {
+    guint64 tile_id;
+    int zoom;
+    int x;
+    int y;
+} OsmTilePackEntry;
+
+static int
+osm_gps_map_compare_pack_entries (gconstpointer a, gconstpointer b)
+{
+    const OsmTilePackEntry *ea = a;
+    const OsmTilePackEntry *eb = b;
+
+    return (ea->tile_id > eb->tile_id) - (ea->tile_id < eb->tile_id);
+}
+
+/* A tile pack export or import. It only uses the disk cache, so that the
+ * _async versions can run it in a thread while the map carries on */
+typedef struct {
+    OsmTileDisk *disk;
+    gchar *path;
+    /* the format of the tiles of the cache, if known */
+    gchar *format;
+    /* the exported region, in radians and degrees, and zoom levels */
+    float rlat1, rlon1, rlat2, rlon2;
+    float lat1, lon1, lat2, lon2;
+    int zoom_start;
+    int zoom_end;
+    GCancellable *cancellable;
+    GFileProgressCallback progress;
+    gpointer progress_data;
+    /* where progress is called from a thread, NULL if the job runs in the
+     * caller's thread */
+    GMainContext *context;
+    goffset done;
+    goffset total;
+} OsmTilePackJob;
+
+typedef struct {
+    GFileProgressCallback progress;
+    gpointer progress_data;
+    goffset done;
+    goffset total;
+} OsmTilePackProgress;
+
+static OsmTilePackJob *
+osm_gps_map_pack_job_new (OsmGpsMap *map, const gchar *path, GCancellable *cancellable,
+                          GFileProgressCallback progress, gpointer progress_data)
+{
+    OsmTilePackJob *job = g_new0 (OsmTilePackJob, 1);
+
+    job->disk = osm_tile_disk_ref (map->priv->tile_disk);
+    job->path = g_strdup (path);
+    job->format = g_strdup (osm_gps_map_get_tile_format (map));
+    if (cancellable)
+        job->cancellable = g_object_ref (cancellable);
+    job->progress = progress;
+    job->progress_data = progress_data;
+
+    return job;
+}
+
+static void
+osm_gps_map_pack_job_free (OsmTilePackJob *job)
+{
+    osm_tile_disk_unref (job->disk);
+    g_free (job->path);
+    g_free (job->format);
+    if (job->cancellable)
+        g_object_unref (job->cancellable);
+    if (job->context)
+        g_main_context_unref (job->context);
+    g_free (job);
+}
+
+static gboolean
+osm_gps_map_pack_progress_idle (gpointer data)
+{
+    OsmTilePackProgress *progress = data;
+
+    progress->progress (progress->done, progress->total, progress->progress_data);
+    return FALSE;
+}
+
+/* Calls the progress callback of the job, in the thread it was started
+ * from */
+static void
+osm_gps_map_pack_progress (OsmTilePackJob *job, goffset done, goffset total)
+{
+    OsmTilePackProgress *progress;
+
+    if (!job->progress)
+        return;
+    if (!job->context) {
+        job->progress (done, total, job->progress_data);
+        return;
+    }
+
+    progress = g_new (OsmTilePackProgress, 1);
+    progress->progress = job->progress;
+    progress->progress_data = job->progress_data;
+    progress->done = done;
+    progress->total = total;
+    g_main_context_invoke_full (job->context, G_PRIORITY_DEFAULT,
+                                osm_gps_map_pack_progress_idle, progress, g_free);
+}
+
+/* Sets up an export, or returns NULL with error set */
+static OsmTilePackJob *
+osm_gps_map_export_job_new (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *pt2,
+                            int zoom_start, int zoom_end, const gchar *path,
+                            GCancellable *cancellable,
+                            GFileProgressCallback progress, gpointer progress_data,
+                            GError **error)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    OsmTilePackJob *job;
+
+    if (!priv->tile_disk) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "The map has no tile cache");
+        return NULL;
+    }
+
+    job = osm_gps_map_pack_job_new (map, path, cancellable, progress, progress_data);
+    job->rlat1 = pt1->rlat;
+    job->rlon1 = pt1->rlon;
+    job->rlat2 = pt2->rlat;
+    job->rlon2 = pt2->rlon;
+    osm_gps_map_point_get_degrees (pt1, &job->lat1, &job->lon1);
+    osm_gps_map_point_get_degrees (pt2, &job->lat2, &job->lon2);
+    job->zoom_end = CLAMP(zoom_end, priv->min_zoom, priv->max_zoom);
+    job->zoom_start = CLAMP(zoom_start, priv->min_zoom, priv->max_zoom);
+
+    return job;
+}
+
+/* Writes the pack, in any thread */
+static gboolean
+osm_gps_map_export_run (OsmTilePackJob *job, GError **error)
+{
+    OsmTilePmtilesWriter *writer;
+    GArray *keys, *tiles;
+    gboolean ok = TRUE;
+    guint i, n;
+    int zoom;
+
+    /* the tiles the cache holds, from its index rather than by looking
+     * for every tile of the region */
+    keys = g_array_new (FALSE, FALSE, sizeof (guint64));
+    for (zoom = job->zoom_start; zoom <= job->zoom_end && ok; zoom++) {
+        int x1,y1,x2,y2;
+
+        x1 = (int)floorf((float)lon2pixel(zoom, job->rlon1) / (float)TILESIZE);
+        y1 = (int)floorf((float)lat2pixel(zoom, job->rlat1) / (float)TILESIZE);
+
+        x2 = (int)floorf((float)lon2pixel(zoom, job->rlon2) / (float)TILESIZE);
+        y2 = (int)floorf((float)lat2pixel(zoom, job->rlat2) / (float)TILESIZE);
+
+        ok = osm_tile_disk_list (job->disk, zoom,
+                                 MAX (x1, 0), MAX (y1, 0),
+                                 MIN (x2, (1 << zoom) - 1), MIN (y2, (1 << zoom) - 1),
+                                 job->cancellable, keys);
+    }
+    if (!ok) {
+        g_array_free (keys, TRUE);
+        g_cancellable_set_error_if_cancelled (job->cancellable, error);
+        return FALSE;
+    }
+
+    /* the tiles are written in the order of the pack */
+    tiles = g_array_sized_new (FALSE, FALSE, sizeof (OsmTilePackEntry), keys->len);
+    for (i = 0; i < keys->len; i++) {
+        guint64 key = g_array_index (keys, guint64, i);
+        OsmTilePackEntry entry = { 0,
+                                   OSM_TILE_KEY_ZOOM (key),
+                                   OSM_TILE_KEY_X (key),
+                                   OSM_TILE_KEY_Y (key) };
+
+        entry.tile_id = osm_tile_pmtiles_tile_id (entry.zoom, entry.x, entry.y);
+        g_array_append_val (tiles, entry);
+    }
+    g_array_free (keys, TRUE);
+    g_array_sort (tiles, osm_gps_map_compare_pack_entries);
+
+    writer = osm_tile_pmtiles_writer_new (job->path, job->format, error);
+    if (!writer) {
+        g_array_free (tiles, TRUE);
+        return FALSE;
+    }
+
+    for (n = 0; n < tiles->len && ok; n++) {
+        const OsmTilePackEntry *entry = &g_array_index (tiles, OsmTilePackEntry, n);
+        GBytes *bytes;
+
+        if (n % PACK_PROGRESS_INTERVAL == 0)
+            osm_gps_map_pack_progress (job, n, tiles->len);
+        if (g_cancellable_set_error_if_cancelled (job->cancellable, error)) {
+            ok = FALSE;
+            break;
+        }
+
+        /* unless evicted meanwhile */
+        bytes = osm_tile_disk_read (job->disk, entry->zoom, entry->x, entry->y);
+        if (bytes) {
+            ok = osm_tile_pmtiles_writer_add (writer, entry->zoom, entry->x, entry->y,
+                                              bytes, error);
+            g_bytes_unref (bytes);
+        }
+    }
+
+    if (ok)
+        ok = osm_tile_pmtiles_writer_finish (writer, job->lon1, job->lat2,
+                                             job->lon2, job->lat1, error);
+    if (ok)
+        osm_gps_map_pack_progress (job, tiles->len, tiles->len);
+
+    osm_tile_pmtiles_writer_free (writer);
+    g_array_free (tiles, TRUE);
+
+    return ok;
+}
+
+/**
+ * osm_gps_map_cache_export:
+ * @map: a #OsmGpsMap widget
+ * @pt1: (in): north west corner
+ * @pt2: (in): south east corner
+ * @zoom_start: (in): start of zoom range
+ * @zoom_end: (in): end of zoom range
+ * @path: (in): the pack file to write
+ * @cancellable: (allow-none): a #GCancellable, or %NULL
+ * @progress: (allow-none) (scope call) (closure progress_data): called with
+ * the number of tiles written so far and the number to write, or %NULL
+ * @progress_data: data for @progress
+ * @error: return location for a #GError, or %NULL
+ *
+ * Writes the tiles of the #OsmGpsMap:tile-cache over the supplied zoom
+ * range in the rectangular region specified by pt1 (north west corner) to
+ * pt2 (south east corner) to a single pack file, to be moved to another
+ * device and added to its cache with osm_gps_map_cache_import(). Tiles
+ * not in the cache are skipped, they are not downloaded.
+ *
+ * The pack is a
+ * <ulink url="https://github.com/protomaps/PMTiles">PMTiles</ulink>
+ * archive, which can also be used as is as a read-only
+ * #OsmGpsMap:tile-cache. Identical tiles are stored once.
+ *
+ * The cache is only read, its index telling which tiles exist, so the
+ * tiles on disk are not walked. This blocks until the pack is written,
+ * see osm_gps_map_cache_export_async() for the main loop.
+ *
+ * Returns: %TRUE if the pack was written
+ *
+ * Since: 1.2.2
+ **/
+gboolean
+osm_gps_map_cache_export (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *pt2,
+                          int zoom_start, int zoom_end, const gchar *path,
+                          GCancellable *cancellable,
+                          GFileProgressCallback progress, gpointer progress_data,
+                          GError **error)
+{
+    OsmTilePackJob *job;
+    gboolean ok;
+
+    g_return_val_if_fail (OSM_GPS_MAP_IS_MAP (map), FALSE);
+    g_return_val_if_fail (pt1 && pt2 && path, FALSE);
+
+    job = osm_gps_map_export_job_new (map, pt1, pt2, zoom_start, zoom_end, path,
+                                      cancellable, progress, progress_data, error);
+    if (!job)
+        return FALSE;
+    ok = osm_gps_map_export_run (job, error);
+    osm_gps_map_pack_job_free (job);
+
+    return ok;
+}
+
+static void
+osm_gps_map_export_thread (GTask *task, gpointer source, gpointer data,
+                           GCancellable *cancellable)
+{
+    GError *error = NULL;
+
+    if (osm_gps_map_export_run (data, &error))
+        g_task_return_boolean (task, TRUE);
+    else
+        g_task_return_error (task, error);
+}
+
+/**
+ * osm_gps_map_cache_export_async:
+ * @map: a #OsmGpsMap widget
+ * @pt1: (in): north west corner
+ * @pt2: (in): south east corner
+ * @zoom_start: (in): start of zoom range
+ * @zoom_end: (in): end of zoom range
+ * @path: (in): the pack file to write
+ * @cancellable: (allow-none): a #GCancellable, or %NULL
+ * @progress: (allow-none) (scope notified) (closure progress_data): called
+ * in the thread-default main context of the caller with the number of
+ * tiles written so far and the number to write, or %NULL
+ * @progress_data: data for @progress, which must stay valid until
+ * @callback is called
+ * @callback: (scope async): called when the pack is written
+ * @user_data: (closure): data for @callback
+ *
+ * Like osm_gps_map_cache_export(), but writes the pack in a thread. Call
+ * osm_gps_map_cache_export_finish() from @callback for the result.
+ *
+ * Since: 1.2.2
+ **/
+void
+osm_gps_map_cache_export_async (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *pt2,
+                                int zoom_start, int zoom_end, const gchar *path,
+                                GCancellable *cancellable,
+                                GFileProgressCallback progress, gpointer progress_data,
+                                GAsyncReadyCallback callback, gpointer user_data)
+{
+    OsmTilePackJob *job;
+    GError *error = NULL;
+    GTask *task;
+
+    g_return_if_fail (OSM_GPS_MAP_IS_MAP (map));
+    g_return_if_fail (pt1 && pt2 && path);
+
+    task = g_task_new (map, cancellable, callback, user_data);
+    job = osm_gps_map_export_job_new (map, pt1, pt2, zoom_start, zoom_end, path,
+                                      cancellable, progress, progress_data, &error);
+    if (!job) {
+        g_task_return_error (task, error);
+    } else {
+        job->context = g_main_context_ref_thread_default ();
+        g_task_set_task_data (task, job, (GDestroyNotify)osm_gps_map_pack_job_free);
+        g_task_run_in_thread (task, osm_gps_map_export_thread);
+    }
+    g_object_unref (task);
+}
+
+/**
+ * osm_gps_map_cache_export_finish:
+ * @map: a #OsmGpsMap widget
+ * @result: the #GAsyncResult given to the callback
+ * @error: return location for a #GError, or %NULL
+ *
+ * Returns: %TRUE if the pack was written by
+ * osm_gps_map_cache_export_async()
+ *
+ * Since: 1.2.2
+ **/
+gboolean
+osm_gps_map_cache_export_finish (OsmGpsMap *map, GAsyncResult *result, GError **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, map), FALSE);
+
+    return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static gboolean
+osm_gps_map_import_tile (int zoom, int x, int y, GBytes *data, gpointer user_data)
+{
+    OsmTilePackJob *job = user_data;
+
+    if (g_cancellable_is_cancelled (job->cancellable))
+        return FALSE;
+
+    if (job->done % PACK_PROGRESS_INTERVAL == 0)
+        osm_gps_map_pack_progress (job, job->done, job->total);
+
+    /* waits for the writer rather than dropping tiles */
+    osm_tile_disk_write_wait (job->disk, zoom, x, y, data);
+    job->done++;
+
+    return TRUE;
+}
+
+/* Sets up an import, or returns NULL with error set */
+static OsmTilePackJob *
+osm_gps_map_import_job_new (OsmGpsMap *map, const gchar *path, GCancellable *cancellable,
+                            GFileProgressCallback progress, gpointer progress_data,
+                            GError **error)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+
+    if (!priv->tile_disk || osm_tile_disk_is_read_only (priv->tile_disk)) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                     "The map has no tile cache to import to");
+        return NULL;
+    }
+
+    return osm_gps_map_pack_job_new (map, path, cancellable, progress, progress_data);
+}
+
+/* Hands the tiles of the pack to the writer of the cache, in any thread
+ * but the writer's */
+static gboolean
+osm_gps_map_import_run (OsmTilePackJob *job, GError **error)
+{
+    OsmTilePmtiles *pmtiles;
+    const gchar *pack_format;
+
+    pmtiles = osm_tile_pmtiles_open (job->path);
+    if (!pmtiles) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                     "Could not read the tile pack %s", job->path);
+        return FALSE;
+    }
+
+    /* the tiles are stored as they are */
+    pack_format = osm_tile_pmtiles_get_format (pmtiles);
+    if (pack_format && job->format && g_strcmp0 (pack_format, job->format) != 0 &&
+        !(g_str_has_prefix (job->format, "jp") && g_str_has_prefix (pack_format, "jp"))) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                     "The tile pack %s holds %s tiles, the cache %s tiles",
+                     job->path, pack_format, job->format);
+        osm_tile_pmtiles_free (pmtiles);
+        return FALSE;
+    }
+
+    job->total = osm_tile_pmtiles_get_n_tiles (pmtiles);
+    osm_tile_pmtiles_foreach (pmtiles, osm_gps_map_import_tile, job);
+    osm_tile_pmtiles_free (pmtiles);
+
+    if (g_cancellable_set_error_if_cancelled (job->cancellable, error))
+        return FALSE;
+    osm_gps_map_pack_progress (job, job->done, MAX (job->total, job->done));
+    g_debug ("Imported %" G_GINT64_FORMAT " tiles from %s", (gint64)job->done, job->path);
+
+    return TRUE;
+}
+
+/* Shows the imported tiles, in the main loop */
+static void
+osm_gps_map_import_done (OsmGpsMap *map)
+{
+    /* destroyed while the import ran */
+    if (map->priv->is_disposed)
+        return;
+
+    /* tiles painted from other zoom levels may have arrived */
+    osm_tile_cache_remove_derived (map->priv->tile_cache);
+    osm_gps_map_map_redraw_idle (map);
+}
+
+/**
+ * osm_gps_map_cache_import:
+ * @map: a #OsmGpsMap widget
+ * @path: (in): the pack file to read
+ * @cancellable: (allow-none): a #GCancellable, or %NULL
+ * @progress: (allow-none) (scope call) (closure progress_data): called with
+ * the number of tiles added so far and the number to add (0 if the pack
+ * does not say), or %NULL
+ * @progress_data: data for @progress
+ * @error: return location for a #GError, or %NULL
+ *
+ * Adds the tiles of a pack written by osm_gps_map_cache_export(), or of
+ * any PMTiles archive of raster tiles, to the #OsmGpsMap:tile-cache,
+ * replacing those already there.
+ *
+ * This blocks until all tiles are handed to the background writer of the
+ * cache, which keeps writing the last ones afterwards, even if the map is
+ * destroyed meanwhile. Waiting for the writer, it holds up the main loop
+ * when called from it: see osm_gps_map_cache_import_async().
+ *
+ * Returns: %TRUE if the tiles were added
+ *
+ * Since: 1.2.2
+ **/
+gboolean
+osm_gps_map_cache_import (OsmGpsMap *map, const gchar *path,
+                          GCancellable *cancellable,
+                          GFileProgressCallback progress, gpointer progress_data,
+                          GError **error)
+{
+    OsmTilePackJob *job;
+    gboolean ok;
+
+    g_return_val_if_fail (OSM_GPS_MAP_IS_MAP (map), FALSE);
+    g_return_val_if_fail (path, FALSE);
+
+    job = osm_gps_map_import_job_new (map, path, cancellable, progress, progress_data, error);
+    if (!job)
+        return FALSE;
+    ok = osm_gps_map_import_run (job, error);
+    osm_gps_map_pack_job_free (job);
+    if (ok)
+        osm_gps_map_import_done (map);
+
+    return ok;
+}
+
+static void
+osm_gps_map_import_thread (GTask *task, gpointer source, gpointer data,
+                           GCancellable *cancellable)
+{
+    GError *error = NULL;
+
+    if (osm_gps_map_import_run (data, &error))
+        g_task_return_boolean (task, TRUE);
+    else
+        g_task_return_error (task, error);
+}
+
+/* Back in the main loop, shows the tiles before completing the caller's
+ * task */
+static void
+osm_gps_map_import_ready (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    GTask *task = user_data;
+    GError *error = NULL;
+
+    if (g_task_propagate_boolean (G_TASK (result), &error)) {
+        osm_gps_map_import_done (OSM_GPS_MAP (source));
+        g_task_return_boolean (task, TRUE);
+    } else {
+        g_task_return_error (task, error);
+    }
+    g_object_unref (task);
+}
+
+/**
+ * osm_gps_map_cache_import_async:
+ * @map: a #OsmGpsMap widget
+ * @path: (in): the pack file to read
+ * @cancellable: (allow-none): a #GCancellable, or %NULL
+ * @progress: (allow-none) (scope notified) (closure progress_data): called
+ * in the thread-default main context of the caller with the number of
+ * tiles added so far and the number to add (0 if the pack does not say),
+ * or %NULL
+ * @progress_data: data for @progress, which must stay valid until
+ * @callback is called
+ * @callback: (scope async): called when the tiles are added
+ * @user_data: (closure): data for @callback
+ *
+ * Like osm_gps_map_cache_import(), but reads the pack and waits for the
+ * writer of the cache in a thread. Call osm_gps_map_cache_import_finish()
+ * from @callback for the result.
+ *
+ * Since: 1.2.2
+ **/
+void
+osm_gps_map_cache_import_async (OsmGpsMap *map, const gchar *path,
+                                GCancellable *cancellable,
+                                GFileProgressCallback progress, gpointer progress_data,
+                                GAsyncReadyCallback callback, gpointer user_data)
+{
+    OsmTilePackJob *job;
+    GError *error = NULL;
+    GTask *task, *thread_task;
+
+    g_return_if_fail (OSM_GPS_MAP_IS_MAP (map));
+    g_return_if_fail (path);
+
+    task = g_task_new (map, cancellable, callback, user_data);
+    job = osm_gps_map_import_job_new (map, path, cancellable, progress, progress_data, &error);
+    if (!job) {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+    }
+
+    job->context = g_main_context_ref_thread_default ();
+    thread_task = g_task_new (map, cancellable, osm_gps_map_import_ready, task);
+    g_task_set_task_data (thread_task, job, (GDestroyNotify)osm_gps_map_pack_job_free);
+    g_task_run_in_thread (thread_task, osm_gps_map_import_thread);
+    g_object_unref (thread_task);
+}
+
+/**
+ * osm_gps_map_cache_import_finish:
+ * @map: a #OsmGpsMap widget
+ * @result: the #GAsyncResult given to the callback
+ * @error: return location for a #GError, or %NULL
+ *
+ * Returns: %TRUE if the tiles were added by
+ * osm_gps_map_cache_import_async()
+ *
+ * Since: 1.2.2
+ **/
+gboolean
+osm_gps_map_cache_import_finish (OsmGpsMap *map, GAsyncResult *result, GError **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, map), FALSE);
+
+    return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * osm_gps_map_unpin_all:
+ * @map: a #OsmGpsMap widget
+ *
+ * Releases the regions pinned with osm_gps_map_pin_region(). Their tiles
+ * are then evicted from the tile cache like any other.
+ *
+ * Since: 1.2.2
+ **/
+void
+osm_gps_map_unpin_all (OsmGpsMap *map)
+{
+    g_return_if_fail (OSM_GPS_MAP_IS_MAP (map));
+
+    osm_tile_cache_unpin_all (map->priv->tile_cache);
+    osm_gps_map_purge_cache (map);
+}
+
+/**
+ * osm_gps_map_trim_memory:
+ * @map: a #OsmGpsMap widget
+ * @level: (in): how much memory to give back
+ *
+ * Frees memory held by the tile cache, typically when the system is low
+ * on memory. The map does this by itself when GLib's #GMemoryMonitor
+ * warns about low memory (with GLib 2.64 or later).
+ *
+ * With %OSM_GPS_MAP_TRIM_LOW, tiles rendered from other zoom levels are
+ * dropped and the cache is shrunk to half of #OsmGpsMap:tile-cache-bytes;
+ * %OSM_GPS_MAP_TRIM_MEDIUM shrinks it to a quarter. Both keep the tiles
+ * currently on screen. %OSM_GPS_MAP_TRIM_CRITICAL drops every tile except
+ * the pinned ones, the map being already painted they are only needed
+ * again when it changes.
+ *
+ * The cache then grows back to its full budget gradually, doubling every
+ * 30 seconds. With #OsmGpsMap:shared-tile-cache the trim applies to all
+ * the maps sharing the cache.
+ *
+ * Returns: the number of bytes freed
+ *
+ * Since: 1.2.2
+ **/
+gsize
+osm_gps_map_trim_memory (OsmGpsMap *map, OsmGpsMapTrimLevel_t level)
+{
+    OsmGpsMapPrivate *priv;
+    gsize max_bytes, limit, freed;
+
+    g_return_val_if_fail (OSM_GPS_MAP_IS_MAP (map), 0);
+    priv = map->priv;
+
+    max_bytes = osm_tile_cache_get_max_bytes (priv->tile_cache);
+    switch (level) {
+        case OSM_GPS_MAP_TRIM_LOW:
+            limit = max_bytes / 2;
+            break;
+        case OSM_GPS_MAP_TRIM_MEDIUM:
+            limit = max_bytes / 4;
+            break;
+        case OSM_GPS_MAP_TRIM_CRITICAL:
+        default:
+            limit = 0;
+            break;
+    }
+    /* the maps sharing the cache share the limit */
+    osm_tile_store_trim (priv->tile_store, limit);
+
+    freed = osm_tile_cache_remove_derived (priv->tile_cache);
+    if (level >= OSM_GPS_MAP_TRIM_CRITICAL) {
+        /* spare nothing, not even the tiles on screen */
+        freed += osm_tile_cache_purge (priv->tile_cache, G_MAXUINT64);
+    } else {
+        freed += osm_tile_store_purge (priv->tile_store);
+    }
+
+    g_debug ("Trimmed %" G_GSIZE_FORMAT " bytes of tiles", freed);
+    priv->stats.trimmed_bytes += freed;
+
+    return freed;
+}
+
 static void
 cancel_message (char *key, SoupMessage *value, SoupSession *user_data)
 {
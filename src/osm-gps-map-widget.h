@@ -71,6 +71,12 @@ typedef enum {
     OSM_GPS_MAP_KEY_MAX
 } OsmGpsMapKey_t;
 
+typedef enum {
+    OSM_GPS_MAP_TRIM_LOW,
+    OSM_GPS_MAP_TRIM_MEDIUM,
+    OSM_GPS_MAP_TRIM_CRITICAL
+} OsmGpsMapTrimLevel_t;
+
 #define OSM_GPS_MAP_INVALID         (0.0/0.0)
 #define OSM_GPS_MAP_CACHE_DISABLED  "none://"
 #define OSM_GPS_MAP_CACHE_AUTO      "auto://"
@@ -84,6 +90,16 @@ gchar*          osm_gps_map_get_default_cache_directory (void);
 
 void            osm_gps_map_download_maps               (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *pt2, int zoom_start, int zoom_end);
 void            osm_gps_map_download_cancel_all         (OsmGpsMap *map);
+guint           osm_gps_map_estimate_download           (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *pt2, int zoom_start, int zoom_end, guint64 *bytes);
+gboolean        osm_gps_map_pin_region                  (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *pt2, int zoom_start, int zoom_end);
+void            osm_gps_map_unpin_all                   (OsmGpsMap *map);
+gboolean        osm_gps_map_cache_export                (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *pt2, int zoom_start, int zoom_end, const gchar *path, GCancellable *cancellable, GFileProgressCallback progress, gpointer progress_data, GError **error);
+void            osm_gps_map_cache_export_async          (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *pt2, int zoom_start, int zoom_end, const gchar *path, GCancellable *cancellable, GFileProgressCallback progress, gpointer progress_data, GAsyncReadyCallback callback, gpointer user_data);
+gboolean        osm_gps_map_cache_export_finish         (OsmGpsMap *map, GAsyncResult *result, GError **error);
+gboolean        osm_gps_map_cache_import                (OsmGpsMap *map, const gchar *path, GCancellable *cancellable, GFileProgressCallback progress, gpointer progress_data, GError **error);
+void            osm_gps_map_cache_import_async          (OsmGpsMap *map, const gchar *path, GCancellable *cancellable, GFileProgressCallback progress, gpointer progress_data, GAsyncReadyCallback callback, gpointer user_data);
+gboolean        osm_gps_map_cache_import_finish         (OsmGpsMap *map, GAsyncResult *result, GError **error);
+gsize           osm_gps_map_trim_memory                 (OsmGpsMap *map, OsmGpsMapTrimLevel_t level);
 void            osm_gps_map_get_bbox                    (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *pt2);
 void            osm_gps_map_zoom_fit_bbox               (OsmGpsMap *map, float latitude1, float latitude2, float longitude1, float longitude2);
 void            osm_gps_map_set_center_and_zoom         (OsmGpsMap *map, float latitude, float longitude, int zoom);
@@ -0,0 +1,572 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * In-memory cache of decoded tiles.
+ *
+ * Tiles are kept in a hash table for lookup and, at the same time, in a
+ * doubly linked list ordered by last use (most recent at the head). The
+ * list node is embedded in the tile, so touching or evicting a tile is
+ * O(1). The cache is bounded by the number of decoded bytes it holds
+ * rather than by the number of tiles.
+ *
+ * Besides real tiles the cache holds derived entries for tiles which are
+ * missing. An upscaled entry is painted by magnifying a tile of a lower
+ * zoom level; it only records which tile it is derived from, so it costs
+ * next to no memory. A downscaled entry holds a surface composed from
+ * tiles of higher zoom levels. Either is replaced as soon as the real tile
+ * is inserted.
+ *
+ * Real tiles can be pinned, in which case they are taken out of the LRU
+ * list and never evicted. They are accounted separately, outside of the
+ * budget, and have a limit of their own: the cache does not enforce it,
+ * the caller checks the number of pins against it before pinning more.
+ *
+ * Identical tiles decoded once (see OsmTileDedup) share their surface,
+ * which is accounted once however many tiles hold it: to the pinned
+ * tiles if any of them is pinned, to the budget otherwise.
+ */
+
+#include <glib.h>
+
+#include "tile-cache.h"
+
+typedef enum {
+    OSM_TILE_REAL,
+    OSM_TILE_UPSCALED,
+    OSM_TILE_DOWNSCALED
+} OsmCachedTileKind;
+
+typedef struct
+{
+    OsmCachedTileKind kind;
+    /* premultiplied image surface, ready to paint, NULL for upscaled tiles */
+    cairo_surface_t *surface;
+    /* the hash table key points here */
+    guint64 key;
+    /* decoded size of the surface, accounted against max_bytes once for
+     * all the tiles sharing it */
+    gsize size;
+    /* value of the cache clock when this tile was last used, so that
+     * osm_tile_cache_purge() can spare the tiles of the current redraw */
+    guint64 stamp;
+    /* our position in the LRU list, link.data points back to us */
+    GList link;
+    /* for upscaled tiles, the tile they are magnified from */
+    guint64 source_key;
+    int source_zoom;
+    /* value of the cache generation when the upscaled tile was made */
+    guint generation;
+    /* pinned tiles are not in the LRU list */
+    gboolean pinned;
+} OsmCachedTile;
+
+struct _OsmTileCache
+{
+    GHashTable *tiles;
+    /* most recently used tile at the head, next victim at the tail */
+    GQueue lru;
+    gsize bytes;
+    gsize max_bytes;
+    /* temporary lower budget, after memory pressure */
+    gsize limit;
+    /* incremented every time a tile is used */
+    guint64 clock;
+    /* incremented every time a real tile is inserted, so that derived
+     * tiles know a better source might have become available */
+    guint generation;
+    /* keys of the tiles to pin, whether they are cached yet or not */
+    GHashTable *pins;
+    /* size of the pinned tiles, not included in bytes */
+    gsize pinned_bytes;
+    gsize max_pinned_bytes;
+    /* the surfaces of the tiles to their OsmSharedSurface */
+    GHashTable *surfaces;
+};
+
+/* The tiles holding a surface, and how many of them are pinned */
+typedef struct
+{
+    gint holders;
+    gint pinned;
+} OsmSharedSurface;
+
+/* Maps repo URIs to the small integer ids used in tile keys. Ids are never
+ * reused, so keys stay unique for the lifetime of the process */
+G_LOCK_DEFINE_STATIC (source_ids);
+static GHashTable *source_ids = NULL;
+
+guint16
+osm_tile_cache_source_id (const gchar *repo_uri)
+{
+    gpointer id;
+
+    if (!repo_uri)
+        return 0;
+
+    G_LOCK (source_ids);
+    if (!source_ids)
+        source_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    id = g_hash_table_lookup (source_ids, repo_uri);
+    if (!id) {
+        /* id 0 is reserved for "no source" */
+        id = GUINT_TO_POINTER (g_hash_table_size (source_ids) + 1);
+        if (GPOINTER_TO_UINT (id) > G_MAXUINT16)
+            g_warning ("Too many tile sources, tile keys will collide");
+        g_hash_table_insert (source_ids, g_strdup (repo_uri), id);
+    }
+    G_UNLOCK (source_ids);
+
+    return (guint16) GPOINTER_TO_UINT (id);
+}
+
+static void
+cached_tile_free (OsmCachedTile *tile)
+{
+    if (tile->surface)
+        cairo_surface_destroy (tile->surface);
+    g_slice_free (OsmCachedTile, tile);
+}
+
+/* Adds holders (possibly negative) to the tiles holding the surface of
+ * tile, and pinned to the pinned ones, moving the size of the surface
+ * between bytes and pinned_bytes as needed. A tile without a surface is
+ * only charged its own size */
+static void
+osm_tile_cache_account (OsmTileCache *cache, OsmCachedTile *tile, gint holders, gint pinned)
+{
+    OsmSharedSurface *shared;
+
+    if (!tile->surface) {
+        if (holders > 0)
+            cache->bytes += tile->size;
+        else if (holders < 0)
+            cache->bytes -= tile->size;
+        return;
+    }
+
+    shared = g_hash_table_lookup (cache->surfaces, tile->surface);
+    if (!shared) {
+        shared = g_slice_new0 (OsmSharedSurface);
+        g_hash_table_insert (cache->surfaces, tile->surface, shared);
+    }
+
+    if (shared->pinned > 0)
+        cache->pinned_bytes -= tile->size;
+    else if (shared->holders > 0)
+        cache->bytes -= tile->size;
+
+    shared->holders += holders;
+    shared->pinned += pinned;
+
+    if (shared->pinned > 0)
+        cache->pinned_bytes += tile->size;
+    else if (shared->holders > 0)
+        cache->bytes += tile->size;
+    else
+        g_hash_table_remove (cache->surfaces, tile->surface);
+}
+
+static void
+shared_surface_free (OsmSharedSurface *shared)
+{
+    g_slice_free (OsmSharedSurface, shared);
+}
+
+static void
+osm_tile_cache_touch (OsmTileCache *cache, OsmCachedTile *tile)
+{
+    tile->stamp = ++cache->clock;
+    if (!tile->pinned && cache->lru.head != &tile->link) {
+        g_queue_unlink (&cache->lru, &tile->link);
+        g_queue_push_head_link (&cache->lru, &tile->link);
+    }
+}
+
+static void
+osm_tile_cache_drop (OsmTileCache *cache, OsmCachedTile *tile)
+{
+    osm_tile_cache_account (cache, tile, -1, tile->pinned ? -1 : 0);
+    if (!tile->pinned)
+        g_queue_unlink (&cache->lru, &tile->link);
+    /* frees the tile, which owns the key */
+    g_hash_table_remove (cache->tiles, &tile->key);
+}
+
+OsmTileCache *
+osm_tile_cache_new (gsize max_bytes)
+{
+    OsmTileCache *cache = g_new0 (OsmTileCache, 1);
+
+    cache->tiles = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                          NULL, (GDestroyNotify)cached_tile_free);
+    g_queue_init (&cache->lru);
+    cache->max_bytes = max_bytes;
+    cache->limit = G_MAXSIZE;
+    cache->pins = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+    cache->max_pinned_bytes = TILE_PIN_DEFAULT_BYTES;
+    cache->surfaces = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                             NULL, (GDestroyNotify)shared_surface_free);
+
+    return cache;
+}
+
+void
+osm_tile_cache_free (OsmTileCache *cache)
+{
+    g_hash_table_destroy (cache->tiles);
+    g_hash_table_destroy (cache->pins);
+    g_hash_table_destroy (cache->surfaces);
+    g_free (cache);
+}
+
+static OsmCachedTile *
+osm_tile_cache_add (OsmTileCache *cache, guint64 key)
+{
+    OsmCachedTile *tile = g_hash_table_lookup (cache->tiles, &key);
+
+    if (tile)
+        osm_tile_cache_drop (cache, tile);
+
+    tile = g_slice_new0 (OsmCachedTile);
+    tile->key = key;
+    tile->link.data = tile;
+
+    g_hash_table_insert (cache->tiles, &tile->key, tile);
+    g_queue_push_head_link (&cache->lru, &tile->link);
+    return tile;
+}
+
+/* Takes a real tile out of the LRU list */
+static void
+osm_tile_cache_pin_tile (OsmTileCache *cache, OsmCachedTile *tile)
+{
+    if (tile->pinned)
+        return;
+
+    g_queue_unlink (&cache->lru, &tile->link);
+    osm_tile_cache_account (cache, tile, 0, 1);
+    tile->pinned = TRUE;
+}
+
+/* Returns the cached surface (owned by the cache) and marks it as the most
+ * recently used tile, or NULL */
+cairo_surface_t *
+osm_tile_cache_lookup (OsmTileCache *cache, guint64 key)
+{
+    OsmCachedTile *tile = g_hash_table_lookup (cache->tiles, &key);
+
+    if (!tile || tile->kind != OSM_TILE_REAL)
+        return NULL;
+
+    osm_tile_cache_touch (cache, tile);
+    return tile->surface;
+}
+
+/* Whether the real tile key is cached, without marking it as used */
+gboolean
+osm_tile_cache_contains (OsmTileCache *cache, guint64 key)
+{
+    OsmCachedTile *tile = g_hash_table_lookup (cache->tiles, &key);
+
+    return tile && tile->kind == OSM_TILE_REAL;
+}
+
+/* Adds a reference to surface, which must be an image surface. A tile
+ * already cached under the same key (for example one rendered from another
+ * zoom level) is replaced */
+void
+osm_tile_cache_insert (OsmTileCache *cache, guint64 key, cairo_surface_t *surface)
+{
+    OsmCachedTile *tile = osm_tile_cache_add (cache, key);
+
+    tile->surface = cairo_surface_reference (surface);
+    tile->size = cairo_image_surface_get_stride (surface) *
+                 cairo_image_surface_get_height (surface);
+
+    osm_tile_cache_account (cache, tile, 1, 0);
+    cache->generation++;
+    osm_tile_cache_touch (cache, tile);
+
+    if (g_hash_table_lookup_extended (cache->pins, &key, NULL, NULL))
+        osm_tile_cache_pin_tile (cache, tile);
+}
+
+/* Pins the tile key, now if it is cached, or as soon as it is inserted */
+void
+osm_tile_cache_pin (OsmTileCache *cache, guint64 key)
+{
+    OsmCachedTile *tile = g_hash_table_lookup (cache->tiles, &key);
+    guint64 *pin;
+
+    if (!g_hash_table_lookup_extended (cache->pins, &key, NULL, NULL)) {
+        pin = g_new (guint64, 1);
+        *pin = key;
+        g_hash_table_insert (cache->pins, pin, NULL);
+    }
+
+    if (tile && tile->kind == OSM_TILE_REAL)
+        osm_tile_cache_pin_tile (cache, tile);
+}
+
+gboolean
+osm_tile_cache_is_pinned (OsmTileCache *cache, guint64 key)
+{
+    return g_hash_table_lookup_extended (cache->pins, &key, NULL, NULL);
+}
+
+/* The number of tiles pinned, whether they are cached yet or not */
+guint
+osm_tile_cache_get_pin_count (OsmTileCache *cache)
+{
+    return g_hash_table_size (cache->pins);
+}
+
+/* Puts all pinned tiles back into the LRU list, as if just used. The next
+ * purge evicts them as needed */
+void
+osm_tile_cache_unpin_all (OsmTileCache *cache)
+{
+    GHashTableIter iter;
+    OsmCachedTile *tile;
+
+    g_hash_table_iter_init (&iter, cache->tiles);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&tile)) {
+        if (tile->pinned) {
+            tile->pinned = FALSE;
+            osm_tile_cache_account (cache, tile, 0, -1);
+            g_queue_push_head_link (&cache->lru, &tile->link);
+            tile->stamp = ++cache->clock;
+        }
+    }
+    g_hash_table_remove_all (cache->pins);
+}
+
+/* Records that the missing tile key is painted by magnifying the tile
+ * source_key of zoom level source_zoom, which must be in the cache */
+void
+osm_tile_cache_insert_upscaled (OsmTileCache *cache, guint64 key,
+                                guint64 source_key, int source_zoom)
+{
+    OsmCachedTile *tile = osm_tile_cache_add (cache, key);
+
+    tile->kind = OSM_TILE_UPSCALED;
+    tile->source_key = source_key;
+    tile->source_zoom = source_zoom;
+    tile->generation = cache->generation;
+    tile->size = sizeof (OsmCachedTile);
+
+    osm_tile_cache_account (cache, tile, 1, 0);
+    osm_tile_cache_touch (cache, tile);
+}
+
+/* For a missing tile recorded with osm_tile_cache_insert_upscaled(),
+ * returns the surface of its source tile (owned by the cache) and stores
+ * the source zoom level. stale is set if real tiles were inserted since
+ * the derived tile was recorded, so a closer source might be available.
+ * Returns NULL if there is no derived tile, or if its source has been
+ * evicted, in which case the derived tile is dropped too */
+cairo_surface_t *
+osm_tile_cache_lookup_upscaled (OsmTileCache *cache, guint64 key,
+                                int *source_zoom, gboolean *stale)
+{
+    OsmCachedTile *tile = g_hash_table_lookup (cache->tiles, &key);
+    cairo_surface_t *surface;
+
+    if (!tile || tile->kind != OSM_TILE_UPSCALED)
+        return NULL;
+
+    surface = osm_tile_cache_lookup (cache, tile->source_key);
+    if (!surface) {
+        osm_tile_cache_drop (cache, tile);
+        return NULL;
+    }
+
+    osm_tile_cache_touch (cache, tile);
+    *source_zoom = tile->source_zoom;
+    *stale = tile->generation != cache->generation;
+    return surface;
+}
+
+/* Adds a reference to surface, composed for the missing tile key from
+ * tiles of higher zoom levels */
+void
+osm_tile_cache_insert_downscaled (OsmTileCache *cache, guint64 key,
+                                  cairo_surface_t *surface)
+{
+    OsmCachedTile *tile = osm_tile_cache_add (cache, key);
+
+    tile->kind = OSM_TILE_DOWNSCALED;
+    tile->surface = cairo_surface_reference (surface);
+    tile->size = cairo_image_surface_get_stride (surface) *
+                 cairo_image_surface_get_height (surface);
+
+    osm_tile_cache_account (cache, tile, 1, 0);
+    osm_tile_cache_touch (cache, tile);
+}
+
+/* Returns the surface recorded with osm_tile_cache_insert_downscaled()
+ * (owned by the cache), or NULL */
+cairo_surface_t *
+osm_tile_cache_lookup_downscaled (OsmTileCache *cache, guint64 key)
+{
+    OsmCachedTile *tile = g_hash_table_lookup (cache->tiles, &key);
+
+    if (!tile || tile->kind != OSM_TILE_DOWNSCALED)
+        return NULL;
+
+    osm_tile_cache_touch (cache, tile);
+    return tile->surface;
+}
+
+/* Whether key is a derived tile, i.e. the real tile was not available
+ * when it was last looked for */
+gboolean
+osm_tile_cache_contains_derived (OsmTileCache *cache, guint64 key)
+{
+    OsmCachedTile *tile = g_hash_table_lookup (cache->tiles, &key);
+
+    return tile && tile->kind != OSM_TILE_REAL;
+}
+
+void
+osm_tile_cache_remove (OsmTileCache *cache, guint64 key)
+{
+    OsmCachedTile *tile = g_hash_table_lookup (cache->tiles, &key);
+
+    if (tile)
+        osm_tile_cache_drop (cache, tile);
+}
+
+/* Removes all upscaled and downscaled tiles, they will be rendered again
+ * if needed. Returns the number of bytes freed */
+gsize
+osm_tile_cache_remove_derived (OsmTileCache *cache)
+{
+    GList *link, *prev;
+    gsize bytes = cache->bytes;
+
+    /* derived tiles are never pinned, so they are all in the LRU list */
+    for (link = cache->lru.tail; link != NULL; link = prev) {
+        OsmCachedTile *tile = link->data;
+
+        prev = link->prev;
+        if (tile->kind != OSM_TILE_REAL)
+            osm_tile_cache_drop (cache, tile);
+    }
+    return bytes - cache->bytes;
+}
+
+/* Removes all tiles, pinned or not. The pins themselves are kept */
+void
+osm_tile_cache_remove_all (OsmTileCache *cache)
+{
+    g_hash_table_remove_all (cache->tiles);
+    g_hash_table_remove_all (cache->surfaces);
+    g_queue_init (&cache->lru);
+    cache->bytes = 0;
+    cache->pinned_bytes = 0;
+}
+
+/* Evicts least recently used tiles until the cache fits in its budget, or
+ * its limit if lower. Tiles used after keep_stamp (i.e. during the current
+ * redraw) are never evicted, so the cache may temporarily exceed its
+ * budget when the visible area alone needs more. Returns the number of
+ * bytes freed */
+gsize
+osm_tile_cache_purge (OsmTileCache *cache, guint64 keep_stamp)
+{
+    gsize budget = MIN (cache->max_bytes, cache->limit);
+    gsize bytes = cache->bytes;
+    gsize freed;
+
+    /* dropping a tile frees nothing while another holds its surface */
+    while (cache->bytes > budget && cache->lru.tail) {
+        OsmCachedTile *tile = cache->lru.tail->data;
+
+        /* the list is ordered by stamp, everything else is newer */
+        if (tile->stamp > keep_stamp)
+            break;
+
+        osm_tile_cache_drop (cache, tile);
+    }
+
+    freed = bytes - cache->bytes;
+
+    if (freed)
+        g_debug ("Purged %" G_GSIZE_FORMAT " bytes from tile cache", freed);
+
+    return freed;
+}
+
+guint64
+osm_tile_cache_get_clock (OsmTileCache *cache)
+{
+    return cache->clock;
+}
+
+gsize
+osm_tile_cache_get_bytes (OsmTileCache *cache)
+{
+    return cache->bytes;
+}
+
+gsize
+osm_tile_cache_get_pinned_bytes (OsmTileCache *cache)
+{
+    return cache->pinned_bytes;
+}
+
+gsize
+osm_tile_cache_get_max_pinned_bytes (OsmTileCache *cache)
+{
+    return cache->max_pinned_bytes;
+}
+
+void
+osm_tile_cache_set_max_pinned_bytes (OsmTileCache *cache, gsize max_bytes)
+{
+    cache->max_pinned_bytes = max_bytes;
+}
+
+gsize
+osm_tile_cache_get_max_bytes (OsmTileCache *cache)
+{
+    return cache->max_bytes;
+}
+
+void
+osm_tile_cache_set_max_bytes (OsmTileCache *cache, gsize max_bytes)
+{
+    cache->max_bytes = max_bytes;
+}
+
+gsize
+osm_tile_cache_get_limit (OsmTileCache *cache)
+{
+    return cache->limit;
+}
+
+/* Sets a temporary budget below max_bytes, G_MAXSIZE lifts it */
+void
+osm_tile_cache_set_limit (OsmTileCache *cache, gsize limit)
+{
+    cache->limit = limit;
+}
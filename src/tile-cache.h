@@ -0,0 +1,76 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TILE_CACHE_H__
+#define __TILE_CACHE_H__
+
+#include <glib.h>
+#include <cairo.h>
+
+/* default memory budget for decoded tiles, roughly 250 RGBA tiles */
+#define TILE_CACHE_DEFAULT_BYTES    (64 * 1024 * 1024)
+/* default limit of the pinned tiles, as many again */
+#define TILE_PIN_DEFAULT_BYTES      (64 * 1024 * 1024)
+
+/* Tiles are identified by a 64 bit key packing the source id (16 bits),
+ * zoom (6 bits) and the x and y tile numbers (21 bits each, enough up
+ * to zoom 21). Building a key does not allocate */
+#define OSM_TILE_KEY(source, zoom, x, y)                        \
+    (((guint64)(source) << 48) |                                \
+     ((guint64)((zoom) & 0x3f) << 42) |                         \
+     ((guint64)((x) & 0x1fffff) << 21) |                        \
+     ((guint64)((y) & 0x1fffff)))
+#define OSM_TILE_KEY_SOURCE(key) ((guint16)((key) >> 48))
+#define OSM_TILE_KEY_ZOOM(key)  ((int)(((key) >> 42) & 0x3f))
+#define OSM_TILE_KEY_X(key)     ((int)(((key) >> 21) & 0x1fffff))
+#define OSM_TILE_KEY_Y(key)     ((int)((key) & 0x1fffff))
+
+typedef struct _OsmTileCache OsmTileCache;
+
+guint16         osm_tile_cache_source_id        (const gchar *repo_uri);
+
+OsmTileCache   *osm_tile_cache_new              (gsize max_bytes);
+void            osm_tile_cache_free             (OsmTileCache *cache);
+cairo_surface_t *osm_tile_cache_lookup          (OsmTileCache *cache, guint64 key);
+void            osm_tile_cache_insert           (OsmTileCache *cache, guint64 key, cairo_surface_t *surface);
+void            osm_tile_cache_insert_upscaled  (OsmTileCache *cache, guint64 key, guint64 source_key, int source_zoom);
+cairo_surface_t *osm_tile_cache_lookup_upscaled (OsmTileCache *cache, guint64 key, int *source_zoom, gboolean *stale);
+void            osm_tile_cache_insert_downscaled (OsmTileCache *cache, guint64 key, cairo_surface_t *surface);
+cairo_surface_t *osm_tile_cache_lookup_downscaled (OsmTileCache *cache, guint64 key);
+gboolean        osm_tile_cache_contains         (OsmTileCache *cache, guint64 key);
+gboolean        osm_tile_cache_contains_derived (OsmTileCache *cache, guint64 key);
+void            osm_tile_cache_pin              (OsmTileCache *cache, guint64 key);
+gboolean        osm_tile_cache_is_pinned        (OsmTileCache *cache, guint64 key);
+void            osm_tile_cache_unpin_all        (OsmTileCache *cache);
+guint           osm_tile_cache_get_pin_count    (OsmTileCache *cache);
+void            osm_tile_cache_remove           (OsmTileCache *cache, guint64 key);
+gsize           osm_tile_cache_remove_derived   (OsmTileCache *cache);
+void            osm_tile_cache_remove_all       (OsmTileCache *cache);
+gsize           osm_tile_cache_purge            (OsmTileCache *cache, guint64 keep_stamp);
+guint64         osm_tile_cache_get_clock        (OsmTileCache *cache);
+gsize           osm_tile_cache_get_bytes        (OsmTileCache *cache);
+gsize           osm_tile_cache_get_pinned_bytes (OsmTileCache *cache);
+gsize           osm_tile_cache_get_max_pinned_bytes (OsmTileCache *cache);
+void            osm_tile_cache_set_max_pinned_bytes (OsmTileCache *cache, gsize max_bytes);
+gsize           osm_tile_cache_get_max_bytes    (OsmTileCache *cache);
+void            osm_tile_cache_set_max_bytes    (OsmTileCache *cache, gsize max_bytes);
+gsize           osm_tile_cache_get_limit        (OsmTileCache *cache);
+void            osm_tile_cache_set_limit        (OsmTileCache *cache, gsize limit);
+
+#endif /* __TILE_CACHE_H__ */
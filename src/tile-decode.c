@@ -0,0 +1,366 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Decoding of tile images into cairo image surfaces.
+ *
+ * Tiles are converted to premultiplied cairo surfaces once, when they are
+ * decoded, so that painting a cached tile is a plain cairo_paint() without
+ * any per-frame pixel conversion.
+ *
+ * With libpng, libjpeg-turbo or libwebp, PNG, JPEG and WebP tiles are
+ * decoded straight into the pixels of the surface, in the byte order of
+ * cairo. Other formats, and images these decoders refuse, go through
+ * gdk-pixbuf. The format is told by the content, not by the source.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <gdk/gdk.h>
+#include <gtk/gtk.h>
+
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+#ifdef HAVE_LIBJPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+#ifdef HAVE_LIBWEBP
+#include <webp/decode.h>
+#endif
+
+#include "tile-decode.h"
+
+/* cairo pixels are native endian 32 bit ARGB words */
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define PNG_FORMAT_CAIRO    PNG_FORMAT_BGRA
+#define JCS_CAIRO           JCS_EXT_BGRX
+#define WEBP_MODE_CAIRO     MODE_BGRA
+#define WEBP_MODE_CAIRO_PREMULTIPLIED MODE_bgrA
+#else
+#define PNG_FORMAT_CAIRO    PNG_FORMAT_ARGB
+#define JCS_CAIRO           JCS_EXT_XRGB
+#define WEBP_MODE_CAIRO     MODE_ARGB
+#define WEBP_MODE_CAIRO_PREMULTIPLIED MODE_Argb
+#endif
+
+/* the extended output color spaces are only in libjpeg-turbo */
+#if defined(HAVE_LIBJPEG) && defined(JCS_EXTENSIONS)
+#define DECODE_JPEG
+#endif
+
+#ifdef HAVE_LIBPNG
+/* libpng gives straight alpha, cairo wants the colors multiplied by it */
+static void
+osm_tile_premultiply (guchar *pixels, int width, int height, int stride)
+{
+    guint32 *row;
+    guint32 p, a, r, g, b;
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        row = (guint32 *)(pixels + y * stride);
+        for (x = 0; x < width; x++) {
+            p = row[x];
+            a = p >> 24;
+            if (a == 0xff)
+                continue;
+            if (a == 0) {
+                row[x] = 0;
+                continue;
+            }
+            /* x * a / 255, rounded */
+            r = ((p >> 16) & 0xff) * a + 0x80;
+            g = ((p >> 8) & 0xff) * a + 0x80;
+            b = (p & 0xff) * a + 0x80;
+            r = (r + (r >> 8)) >> 8;
+            g = (g + (g >> 8)) >> 8;
+            b = (b + (b >> 8)) >> 8;
+            row[x] = (a << 24) | (r << 16) | (g << 8) | b;
+        }
+    }
+}
+
+static cairo_surface_t *
+osm_tile_decode_png (const guchar *data, gsize len)
+{
+    cairo_surface_t *surface;
+    png_image image;
+    gboolean alpha;
+    guchar *pixels;
+    int stride;
+
+    memset (&image, 0, sizeof (image));
+    image.version = PNG_IMAGE_VERSION;
+    /* frees the image on failure */
+    if (!png_image_begin_read_from_memory (&image, data, len))
+        return NULL;
+
+    /* opaque images don't need the alpha channel premultiplied, libpng
+     * fills it with 0xff */
+    alpha = (image.format & PNG_FORMAT_FLAG_ALPHA) != 0;
+    image.format = PNG_FORMAT_CAIRO;
+
+    surface = cairo_image_surface_create (alpha ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24,
+                                          image.width, image.height);
+    if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS) {
+        png_image_free (&image);
+        cairo_surface_destroy (surface);
+        return NULL;
+    }
+
+    pixels = cairo_image_surface_get_data (surface);
+    stride = cairo_image_surface_get_stride (surface);
+    /* with 8 bit components the row stride counts bytes */
+    if (!png_image_finish_read (&image, NULL, pixels, stride, NULL)) {
+        g_debug ("Decoding of PNG failed: %s", image.message);
+        cairo_surface_destroy (surface);
+        return NULL;
+    }
+    if (alpha)
+        osm_tile_premultiply (pixels, image.width, image.height, stride);
+    cairo_surface_mark_dirty (surface);
+
+    return surface;
+}
+#endif
+
+#ifdef DECODE_JPEG
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+} OsmTileJpegError;
+
+static void
+osm_tile_jpeg_error_exit (j_common_ptr cinfo)
+{
+    OsmTileJpegError *error = (OsmTileJpegError *)cinfo->err;
+
+    (*cinfo->err->output_message) (cinfo);
+    longjmp (error->jump, 1);
+}
+
+static void
+osm_tile_jpeg_output_message (j_common_ptr cinfo)
+{
+    char buffer[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message) (cinfo, buffer);
+    g_debug ("Decoding of JPEG: %s", buffer);
+}
+
+static cairo_surface_t *
+osm_tile_decode_jpeg (const guchar *data, gsize len)
+{
+    struct jpeg_decompress_struct cinfo;
+    OsmTileJpegError error;
+    cairo_surface_t *volatile surface = NULL;
+    guchar *pixels;
+    JSAMPROW row;
+    int stride;
+
+    cinfo.err = jpeg_std_error (&error.pub);
+    error.pub.error_exit = osm_tile_jpeg_error_exit;
+    error.pub.output_message = osm_tile_jpeg_output_message;
+    if (setjmp (error.jump)) {
+        jpeg_destroy_decompress (&cinfo);
+        if (surface)
+            cairo_surface_destroy (surface);
+        return NULL;
+    }
+
+    jpeg_create_decompress (&cinfo);
+    jpeg_mem_src (&cinfo, (unsigned char *)data, len);
+    jpeg_read_header (&cinfo, TRUE);
+    /* libjpeg-turbo converts to the pixel layout of cairo while it
+     * decodes, with SIMD where the CPU has it. The padding byte is
+     * ignored in RGB24 */
+    cinfo.out_color_space = JCS_CAIRO;
+    jpeg_start_decompress (&cinfo);
+
+    surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24,
+                                          cinfo.output_width, cinfo.output_height);
+    if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS) {
+        jpeg_destroy_decompress (&cinfo);
+        cairo_surface_destroy (surface);
+        return NULL;
+    }
+
+    pixels = cairo_image_surface_get_data (surface);
+    stride = cairo_image_surface_get_stride (surface);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        row = pixels + (gsize)cinfo.output_scanline * stride;
+        jpeg_read_scanlines (&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress (&cinfo);
+    jpeg_destroy_decompress (&cinfo);
+    cairo_surface_mark_dirty (surface);
+
+    return surface;
+}
+#endif
+
+#ifdef HAVE_LIBWEBP
+static cairo_surface_t *
+osm_tile_decode_webp (const guchar *data, gsize len)
+{
+    WebPDecoderConfig config;
+    cairo_surface_t *surface;
+    gboolean alpha;
+    int width, height;
+
+    if (!WebPInitDecoderConfig (&config) ||
+        WebPGetFeatures (data, len, &config.input) != VP8_STATUS_OK)
+        return NULL;
+
+    width = config.input.width;
+    height = config.input.height;
+    alpha = config.input.has_alpha;
+    surface = cairo_image_surface_create (alpha ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24,
+                                          width, height);
+    if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy (surface);
+        return NULL;
+    }
+
+    /* libwebp premultiplies the alpha itself, and writes into the
+     * surface */
+    config.output.colorspace = alpha ? WEBP_MODE_CAIRO_PREMULTIPLIED : WEBP_MODE_CAIRO;
+    config.output.is_external_memory = 1;
+    config.output.u.RGBA.rgba = cairo_image_surface_get_data (surface);
+    config.output.u.RGBA.stride = cairo_image_surface_get_stride (surface);
+    config.output.u.RGBA.size = (size_t)config.output.u.RGBA.stride * height;
+
+    if (WebPDecode (data, len, &config) != VP8_STATUS_OK) {
+        g_debug ("Decoding of WebP failed");
+        WebPFreeDecBuffer (&config.output);
+        cairo_surface_destroy (surface);
+        return NULL;
+    }
+    WebPFreeDecBuffer (&config.output);
+    cairo_surface_mark_dirty (surface);
+
+    return surface;
+}
+#endif
+
+cairo_surface_t *
+osm_tile_surface_from_pixbuf (GdkPixbuf *pixbuf)
+{
+#if GTK_CHECK_VERSION(3, 10, 0)
+    /* without a window this gives an image surface, RGB24 or ARGB32
+     * depending on whether the pixbuf has an alpha channel */
+    return gdk_cairo_surface_create_from_pixbuf (pixbuf, 1, NULL);
+#else
+    cairo_surface_t *surface;
+    cairo_t *cr;
+
+    surface = cairo_image_surface_create (
+                    gdk_pixbuf_get_has_alpha (pixbuf) ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24,
+                    gdk_pixbuf_get_width (pixbuf),
+                    gdk_pixbuf_get_height (pixbuf));
+    cr = cairo_create (surface);
+    gdk_cairo_set_source_pixbuf (cr, pixbuf, 0, 0);
+    cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+    cairo_paint (cr);
+    cairo_destroy (cr);
+
+    return surface;
+#endif
+}
+
+/* Returns the format of an image from its first bytes, as a tile file
+ * extension ("png", "jpg", "webp", "gif" or "avif"), or NULL if it is
+ * none of these. The string is static */
+const gchar *
+osm_tile_detect_format (const guchar *data, gsize len)
+{
+    if (len >= 8 && memcmp (data, "\x89PNG\r\n\x1a\n", 8) == 0)
+        return "png";
+    if (len >= 3 && data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff)
+        return "jpg";
+    if (len >= 12 && memcmp (data, "RIFF", 4) == 0 && memcmp (data + 8, "WEBP", 4) == 0)
+        return "webp";
+    if (len >= 6 && (memcmp (data, "GIF87a", 6) == 0 || memcmp (data, "GIF89a", 6) == 0))
+        return "gif";
+    /* an ISO media file whose brand is AVIF */
+    if (len >= 12 && memcmp (data + 4, "ftypavi", 7) == 0 &&
+        (data[11] == 'f' || data[11] == 's'))
+        return "avif";
+    return NULL;
+}
+
+/* Decodes an in-memory image of the given format (the file extension of
+ * the tile, e.g. "png"). The format found in the data wins over the one
+ * given, if neither is known to gdk-pixbuf it detects the format itself.
+ * Returns a new surface, or NULL on failure */
+cairo_surface_t *
+osm_tile_decode_data (const guchar *data, gsize len, const gchar *format)
+{
+    cairo_surface_t *surface = NULL;
+    GdkPixbufLoader *loader = NULL;
+    GdkPixbuf *pixbuf;
+    const gchar *detected;
+
+    /* go by the content, servers don't always send what they say */
+    detected = osm_tile_detect_format (data, len);
+#ifdef HAVE_LIBPNG
+    if (g_strcmp0 (detected, "png") == 0)
+        surface = osm_tile_decode_png (data, len);
+#endif
+#ifdef DECODE_JPEG
+    if (g_strcmp0 (detected, "jpg") == 0)
+        surface = osm_tile_decode_jpeg (data, len);
+#endif
+#ifdef HAVE_LIBWEBP
+    if (g_strcmp0 (detected, "webp") == 0)
+        surface = osm_tile_decode_webp (data, len);
+#endif
+    if (surface)
+        return surface;
+
+    if (detected)
+        format = detected;
+    /* the gdk-pixbuf name of JPEG is not its file extension */
+    if (g_strcmp0 (format, "jpg") == 0)
+        format = "jpeg";
+    if (format)
+        loader = gdk_pixbuf_loader_new_with_type (format, NULL);
+    if (!loader)
+        loader = gdk_pixbuf_loader_new ();
+
+    if (!gdk_pixbuf_loader_write (loader, data, len, NULL))
+    {
+        g_warning("Error: Decoding of image failed");
+    }
+    gdk_pixbuf_loader_close(loader, NULL);
+
+    pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+    if (pixbuf)
+        surface = osm_tile_surface_from_pixbuf (pixbuf);
+
+    g_object_unref(loader);
+
+    return surface;
+}
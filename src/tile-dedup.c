@@ -0,0 +1,115 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Sharing of the decoded surfaces of identical tiles, e.g. open sea or
+ * empty land, which are then decoded and kept in memory once.
+ *
+ * Surfaces are found by the digest of their encoded image. The table
+ * holds a reference to each surface, and osm_tile_dedup_prune() drops
+ * those nobody else uses any more. Lookups may come from any thread.
+ */
+
+#include <glib.h>
+#include <cairo.h>
+
+#include "tile-dedup.h"
+
+struct _OsmTileDedup
+{
+    GMutex lock;
+    /* digest to surface */
+    GHashTable *surfaces;
+};
+
+/* Returns the digest identifying an encoded tile, also used to name
+ * the tiles stored by content on disk */
+gchar *
+osm_tile_dedup_digest (const guchar *data, gsize len)
+{
+    return g_compute_checksum_for_data (G_CHECKSUM_SHA256, data, len);
+}
+
+OsmTileDedup *
+osm_tile_dedup_new (void)
+{
+    OsmTileDedup *dedup = g_new0 (OsmTileDedup, 1);
+
+    g_mutex_init (&dedup->lock);
+    dedup->surfaces = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify)cairo_surface_destroy);
+    return dedup;
+}
+
+void
+osm_tile_dedup_free (OsmTileDedup *dedup)
+{
+    g_hash_table_destroy (dedup->surfaces);
+    g_mutex_clear (&dedup->lock);
+    g_free (dedup);
+}
+
+/* Returns a new reference to the surface of a tile with the same digest,
+ * or NULL */
+cairo_surface_t *
+osm_tile_dedup_lookup (OsmTileDedup *dedup, const gchar *digest)
+{
+    cairo_surface_t *surface;
+
+    g_mutex_lock (&dedup->lock);
+    surface = g_hash_table_lookup (dedup->surfaces, digest);
+    if (surface)
+        cairo_surface_reference (surface);
+    g_mutex_unlock (&dedup->lock);
+
+    return surface;
+}
+
+void
+osm_tile_dedup_insert (OsmTileDedup *dedup, const gchar *digest,
+                       cairo_surface_t *surface)
+{
+    g_mutex_lock (&dedup->lock);
+    g_hash_table_replace (dedup->surfaces, g_strdup (digest),
+                          cairo_surface_reference (surface));
+    g_mutex_unlock (&dedup->lock);
+}
+
+static gboolean
+osm_tile_dedup_is_unused (gpointer key, gpointer value, gpointer user_data)
+{
+    /* a reference can only be taken under the lock, from the table */
+    return cairo_surface_get_reference_count (value) == 1;
+}
+
+/* Drops the surfaces only the table still references. Returns how many
+ * are left */
+guint
+osm_tile_dedup_prune (OsmTileDedup *dedup)
+{
+    guint size;
+
+    g_mutex_lock (&dedup->lock);
+    g_hash_table_foreach_remove (dedup->surfaces, osm_tile_dedup_is_unused, NULL);
+    size = g_hash_table_size (dedup->surfaces);
+    g_mutex_unlock (&dedup->lock);
+
+    return size;
+}
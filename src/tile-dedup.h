@@ -0,0 +1,37 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __TILE_DEDUP_H__
+#define __TILE_DEDUP_H__
+
+#include <glib.h>
+#include <cairo.h>
+
+typedef struct _OsmTileDedup OsmTileDedup;
+
+gchar          *osm_tile_dedup_digest           (const guchar *data, gsize len);
+
+OsmTileDedup   *osm_tile_dedup_new              (void);
+void            osm_tile_dedup_free             (OsmTileDedup *dedup);
+cairo_surface_t *osm_tile_dedup_lookup          (OsmTileDedup *dedup, const gchar *digest);
+void            osm_tile_dedup_insert           (OsmTileDedup *dedup, const gchar *digest, cairo_surface_t *surface);
+guint           osm_tile_dedup_prune            (OsmTileDedup *dedup);
+
+#endif /* __TILE_DEDUP_H__ */
@@ -0,0 +1,1614 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Storage of downloaded (still encoded) tiles on disk.
+ *
+ * By default every tile is a file, cache_dir/zoom/x/y.format. If the cache
+ * path ends in .mbtiles the tiles are instead kept in a single MBTiles
+ * file, an SQLite database, which is much kinder to the filesystem for
+ * large offline regions and can be shipped as is. Writes to it are
+ * batched into transactions, which are committed every MBTILES_BATCH
+ * tiles or when osm_tile_disk_flush() is called.
+ *
+ * osm_tile_disk_write_async() leaves the writing to a writer thread, so
+ * that a downloaded tile can be shown without waiting for the disk. Until
+ * it is written the tile is kept in memory, where reads find it. The
+ * writer commits the MBTiles transaction whenever it runs out of work.
+ * At most MAX_QUEUED tiles wait for it, newer ones are dropped (they are
+ * simply downloaded again when next needed).
+ *
+ * Tile files are written to a temporary file which is then renamed, so a
+ * crash never leaves a truncated tile behind. The writer remembers the
+ * directories it has seen, so a tile in an existing directory costs no
+ * mkdir or stat calls.
+ *
+ * The size and last use of every tile is kept in an OsmTileIndex, saved
+ * beside the tiles. When the writer is idle, at most every
+ * JANITOR_INTERVAL seconds, it runs the janitor which saves the index and,
+ * if the tiles take more than the quota set with
+ * osm_tile_disk_set_max_bytes(), evicts the least recently used ones in
+ * batches between the writes. The writer notes every tile in the index
+ * file before writing it (see osm_tile_index_journal()), so the index of
+ * a cache that was not closed cleanly is repaired by looking only at the
+ * tiles written since it was last saved. The index of a cache made before
+ * it existed is built by walking the cache once. Both are done by the
+ * janitor JANITOR_BATCH tiles at a time between the writes, the disk
+ * being searched for the tiles the index does not know until it is done.
+ *
+ * Once loaded, the index also tells which tiles exist: a tile it does
+ * not know is not looked for on disk, sparing a failed open() or query
+ * for every missing tile. As nothing else may write to the cache, a path
+ * is only opened once in the process: osm_tile_disk_new() returns the
+ * disk cache already open there, if any.
+ *
+ * A path ending in .pmtiles is a PMTiles archive, read only: nothing is
+ * written to it and it has no index, quota or metadata.
+ *
+ * In deduplicating mode identical tiles, e.g. open sea, are stored once.
+ * An MBTiles file then uses the common map and images tables, with tiles
+ * as a view joining them, the images named by the digest of their
+ * content. In a directory each content is stored once below objects/,
+ * and the tile files are hard links to it (where the filesystem has
+ * them). The quota still counts every tile at its full size. Contents no
+ * tile uses any more are removed with the last tile using them; in an
+ * MBTiles file the janitor does so once an eviction is done, or when it
+ * finds tiles were replaced since its last run.
+ *
+ * All functions may be called from any thread, so that tiles can be
+ * read by worker threads holding a reference to the disk cache.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SQLITE
+#include <sqlite3.h>
+#endif
+
+#include "tile-cache.h"
+#include "tile-dedup.h"
+#include "tile-disk.h"
+#include "tile-index.h"
+#include "tile-pmtiles.h"
+
+/* tiles written per MBTiles transaction */
+#define MBTILES_BATCH   64
+/* tiles waiting for the writer, several MB of typical tiles */
+#define MAX_QUEUED      512
+/* saved beside the tiles */
+#define INDEX_FILENAME      "tile-index"
+/* seconds between runs of the janitor */
+#define JANITOR_INTERVAL    60
+/* tiles evicted or looked for on disk before letting queued writes through */
+#define JANITOR_BATCH       256
+/* the directory of the tiles stored by content */
+#define OBJECTS_DIRNAME     "objects"
+
+/* Where the janitor is in building or repairing the index. Either the
+ * tiles of unsure are looked at one by one, or the whole cache is walked:
+ * path/zoom/x/y.format, the directories being read, or the MBTiles tiles
+ * in order */
+typedef struct {
+    GArray *unsure;
+    guint next;
+    GDir *zoom_dir;
+    GDir *x_dir;
+    GDir *y_dir;
+    gchar *x_path;
+    gchar *y_path;
+    int zoom;
+    int x;
+    int row;
+} OsmTileScan;
+
+/* the disk caches open in the process, by path */
+static GHashTable *open_disks;
+static GMutex open_disks_lock;
+
+struct _OsmTileDisk
+{
+    gint ref_count;
+    /* the writer thread, and the tiles waiting for it. queued maps tile
+     * keys (with source 0) to the encoded tiles, queued_meta to their
+     * HTTP cache metadata if any, both protected by queue_lock */
+    GThreadPool *writer;
+    GHashTable *queued;
+    GHashTable *queued_meta;
+    GMutex queue_lock;
+    /* signalled when a tile leaves the queue */
+    GCond queue_cond;
+    OsmTileDiskStats stats;
+    /* the quota, 0 if there is none, protected by queue_lock */
+    guint64 max_bytes;
+    /* set when the disk cache is being freed */
+    gint closing;
+    /* directories known to exist, only used by the writer */
+    GHashTable *dirs;
+    OsmTileIndex *index;
+    /* set by the writer once the index holds all the tiles on disk, read
+     * atomically */
+    gint index_loaded;
+    /* the state of the janitor, only used by the writer. scan is set
+     * until the index is loaded, journal once the index file is to be
+     * kept. orphans is set when deduplicated MBTiles images may have lost
+     * their last tile */
+    OsmTileScan *scan;
+    gboolean journal;
+    gboolean evicting;
+    gboolean orphans;
+    gint64 last_janitor;
+    /* the cache directory, or the MBTiles file */
+    gchar *path;
+    /* extension of the tile files, or format of the MBTiles tiles (NULL
+     * if unknown) */
+    gchar *format;
+    /* store identical tiles once. Cleared by the writer if the directory
+     * does not support hard links */
+    gboolean dedup;
+    /* the archive, if the cache is a read-only PMTiles file */
+    OsmTilePmtiles *pmtiles;
+#ifdef HAVE_SQLITE
+    sqlite3 *db;
+    sqlite3_stmt *select_stmt;
+    sqlite3_stmt *insert_stmt;
+    sqlite3_stmt *insert_image_stmt;
+    sqlite3_stmt *exists_stmt;
+    sqlite3_stmt *delete_stmt;
+    /* tiles written in the current transaction, if any */
+    guint pending;
+    /* a connection must not be used by two threads at once */
+    GMutex lock;
+#endif
+};
+
+#ifdef HAVE_SQLITE
+/* MBTiles numbers rows from the south (TMS), we number them from the north */
+#define MBTILES_ROW(zoom, y)    ((1 << (zoom)) - 1 - (y))
+
+static gboolean
+mbtiles_exec (OsmTileDisk *disk, const char *sql)
+{
+    char *error = NULL;
+
+    if (sqlite3_exec (disk->db, sql, NULL, NULL, &error) != SQLITE_OK) {
+        g_warning ("Error in MBTiles cache %s: %s", disk->path, error);
+        sqlite3_free (error);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean
+mbtiles_prepare (OsmTileDisk *disk, const char *sql, sqlite3_stmt **stmt)
+{
+    if (sqlite3_prepare_v2 (disk->db, sql, -1, stmt, NULL) != SQLITE_OK) {
+        g_warning ("Error in MBTiles cache %s: %s", disk->path,
+                   sqlite3_errmsg (disk->db));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Returns the type of the schema object called name, "table" or "view",
+ * or NULL if there is none */
+static gchar *
+mbtiles_get_type (OsmTileDisk *disk, const char *name)
+{
+    sqlite3_stmt *stmt;
+    gchar *type = NULL;
+
+    if (mbtiles_prepare (disk, "SELECT type FROM sqlite_master WHERE name = ?", &stmt)) {
+        sqlite3_bind_text (stmt, 1, name, -1, SQLITE_STATIC);
+        if (sqlite3_step (stmt) == SQLITE_ROW)
+            type = g_strdup ((const char *)sqlite3_column_text (stmt, 0));
+        sqlite3_finalize (stmt);
+    }
+    return type;
+}
+
+static gboolean
+mbtiles_open (OsmTileDisk *disk, const gchar *image_format)
+{
+    sqlite3_stmt *stmt;
+    gchar *dir, *tiles;
+
+    dir = g_path_get_dirname (disk->path);
+    g_mkdir_with_parents (dir, 0700);
+    g_free (dir);
+
+    if (sqlite3_open_v2 (disk->path, &disk->db,
+                         SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                         NULL) != SQLITE_OK) {
+        g_warning ("Could not open MBTiles cache %s: %s", disk->path,
+                   sqlite3_errmsg (disk->db));
+        return FALSE;
+    }
+
+    /* WAL lets readers carry on while a batch is being written, and with
+     * it NORMAL synchronous is still safe against corruption */
+    mbtiles_exec (disk, "PRAGMA journal_mode=WAL");
+    mbtiles_exec (disk, "PRAGMA synchronous=NORMAL");
+
+    if (!mbtiles_exec (disk, "CREATE TABLE IF NOT EXISTS metadata (name text, value text);"))
+        return FALSE;
+
+    /* an existing file keeps its layout, whatever mode was asked for */
+    tiles = mbtiles_get_type (disk, "tiles");
+    if (tiles)
+        disk->dedup = strcmp (tiles, "view") == 0;
+    g_free (tiles);
+
+    if (disk->dedup) {
+        if (!mbtiles_exec (disk,
+                "CREATE TABLE IF NOT EXISTS map (zoom_level integer, tile_column integer,"
+                "                                tile_row integer, tile_id text);"
+                "CREATE UNIQUE INDEX IF NOT EXISTS map_index ON map"
+                "                                (zoom_level, tile_column, tile_row);"
+                "CREATE INDEX IF NOT EXISTS map_tile_id ON map (tile_id);"
+                "CREATE TABLE IF NOT EXISTS images (tile_data blob, tile_id text);"
+                "CREATE UNIQUE INDEX IF NOT EXISTS images_id ON images (tile_id);"
+                "CREATE VIEW IF NOT EXISTS tiles AS"
+                "  SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column,"
+                "         map.tile_row AS tile_row, images.tile_data AS tile_data"
+                "  FROM map JOIN images ON images.tile_id = map.tile_id;"))
+            return FALSE;
+    } else {
+        if (!mbtiles_exec (disk,
+                "CREATE TABLE IF NOT EXISTS tiles (zoom_level integer, tile_column integer,"
+                "                                  tile_row integer, tile_data blob);"
+                "CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles"
+                "                                  (zoom_level, tile_column, tile_row);"))
+            return FALSE;
+    }
+
+    if (!mbtiles_prepare (disk,
+            "SELECT tile_data FROM tiles"
+            " WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+            &disk->select_stmt))
+        return FALSE;
+
+    if (disk->dedup) {
+        if (!mbtiles_prepare (disk,
+                "INSERT OR REPLACE INTO map (zoom_level, tile_column, tile_row, tile_id)"
+                " VALUES (?, ?, ?, ?)",
+                &disk->insert_stmt) ||
+            !mbtiles_prepare (disk,
+                "INSERT OR IGNORE INTO images (tile_data, tile_id) VALUES (?, ?)",
+                &disk->insert_image_stmt) ||
+            !mbtiles_prepare (disk,
+                "SELECT 1 FROM map"
+                " WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+                &disk->exists_stmt) ||
+            !mbtiles_prepare (disk,
+                "DELETE FROM map"
+                " WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+                &disk->delete_stmt))
+            return FALSE;
+    } else {
+        if (!mbtiles_prepare (disk,
+                "INSERT OR REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data)"
+                " VALUES (?, ?, ?, ?)",
+                &disk->insert_stmt) ||
+            !mbtiles_prepare (disk,
+                "SELECT 1 FROM tiles"
+                " WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+                &disk->exists_stmt) ||
+            !mbtiles_prepare (disk,
+                "DELETE FROM tiles"
+                " WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+                &disk->delete_stmt))
+            return FALSE;
+    }
+
+    /* a file made elsewhere knows its format, a new one is given ours */
+    if (mbtiles_prepare (disk, "SELECT value FROM metadata WHERE name = 'format'", &stmt)) {
+        if (sqlite3_step (stmt) == SQLITE_ROW)
+            disk->format = g_strdup ((const char *)sqlite3_column_text (stmt, 0));
+        sqlite3_finalize (stmt);
+    }
+    if (!disk->format && image_format) {
+        disk->format = g_strdup (image_format);
+        if (mbtiles_prepare (disk, "INSERT INTO metadata (name, value) VALUES ('format', ?)", &stmt)) {
+            sqlite3_bind_text (stmt, 1, image_format, -1, SQLITE_STATIC);
+            sqlite3_step (stmt);
+            sqlite3_finalize (stmt);
+        }
+    }
+
+    return TRUE;
+}
+
+static void
+mbtiles_bind_tile (sqlite3_stmt *stmt, int zoom, int x, int y)
+{
+    sqlite3_reset (stmt);
+    sqlite3_bind_int (stmt, 1, zoom);
+    sqlite3_bind_int (stmt, 2, x);
+    sqlite3_bind_int (stmt, 3, MBTILES_ROW (zoom, y));
+}
+
+/* Must be called with the lock held */
+static void
+mbtiles_commit (OsmTileDisk *disk)
+{
+    if (disk->pending) {
+        mbtiles_exec (disk, "COMMIT");
+        g_debug ("Committed %u tiles to %s", disk->pending, disk->path);
+        disk->pending = 0;
+    }
+}
+#endif
+
+static gchar *
+osm_tile_disk_filename (OsmTileDisk *disk, int zoom, int x, int y)
+{
+    return g_strdup_printf("%s%c%d%c%d%c%d.%s",
+                disk->path, G_DIR_SEPARATOR,
+                zoom, G_DIR_SEPARATOR,
+                x, G_DIR_SEPARATOR,
+                y,
+                disk->format);
+}
+
+/* The file storing the tiles with the given digest, in deduplicating mode */
+static gchar *
+osm_tile_disk_object_filename (OsmTileDisk *disk, const gchar *digest)
+{
+    return g_strdup_printf("%s%c%s%c%.2s%c%s.%s",
+                disk->path, G_DIR_SEPARATOR,
+                OBJECTS_DIRNAME, G_DIR_SEPARATOR,
+                digest, G_DIR_SEPARATOR,
+                digest,
+                disk->format);
+}
+
+typedef struct {
+    guint64 key;
+    int zoom;
+    int x;
+    int y;
+    /* run the janitor instead of writing a tile */
+    gboolean janitor;
+} OsmTileWrite;
+
+static gboolean osm_tile_disk_write (OsmTileDisk *disk, int zoom, int x, int y,
+                                     const guchar *data, gsize len,
+                                     gboolean *duplicate);
+
+#ifdef G_OS_UNIX
+/* Returns the stored content the tile file filename is the last link to,
+ * besides its own name below objects/, or NULL. Only called by the writer */
+static gchar *
+osm_tile_disk_last_link (OsmTileDisk *disk, const gchar *filename)
+{
+    GStatBuf buf;
+    gchar *contents, *digest, *object = NULL;
+    gsize len;
+
+    if (g_stat (filename, &buf) == 0 && buf.st_nlink == 2 &&
+        g_file_get_contents (filename, &contents, &len, NULL)) {
+        digest = osm_tile_dedup_digest ((const guchar *)contents, len);
+        object = osm_tile_disk_object_filename (disk, digest);
+        g_free (digest);
+        g_free (contents);
+    }
+    return object;
+}
+#endif
+
+static void
+osm_tile_disk_queue_janitor (OsmTileDisk *disk)
+{
+    OsmTileWrite *job = g_new0 (OsmTileWrite, 1);
+
+    job->janitor = TRUE;
+    g_thread_pool_push (disk->writer, job, NULL);
+}
+
+/* Removes a tile, only called by the writer */
+static void
+osm_tile_disk_remove (OsmTileDisk *disk, int zoom, int x, int y)
+{
+    gchar *filename;
+
+#ifdef HAVE_SQLITE
+    if (disk->db) {
+        g_mutex_lock (&disk->lock);
+        if (disk->pending == 0)
+            mbtiles_exec (disk, "BEGIN");
+        mbtiles_bind_tile (disk->delete_stmt, zoom, x, y);
+        sqlite3_step (disk->delete_stmt);
+        sqlite3_reset (disk->delete_stmt);
+        disk->pending++;
+        g_mutex_unlock (&disk->lock);
+        if (disk->dedup)
+            disk->orphans = TRUE;
+        return;
+    }
+#endif
+
+    filename = osm_tile_disk_filename (disk, zoom, x, y);
+
+#ifdef G_OS_UNIX
+    /* the stored content goes with its last tile */
+    if (disk->dedup) {
+        gchar *object = osm_tile_disk_last_link (disk, filename);
+
+        if (object)
+            g_unlink (object);
+        g_free (object);
+    }
+#endif
+
+    g_unlink (filename);
+    g_free (filename);
+}
+
+/* Brings the entry of the tile in the index up to date with the disk.
+ * Only called by the writer */
+static void
+osm_tile_disk_check (OsmTileDisk *disk, guint64 key)
+{
+    int zoom = OSM_TILE_KEY_ZOOM (key);
+    gchar *filename;
+    GStatBuf buf;
+
+#ifdef HAVE_SQLITE
+    if (disk->db) {
+        sqlite3_stmt *stmt;
+        int size = -1;
+
+        g_mutex_lock (&disk->lock);
+        if (mbtiles_prepare (disk,
+                "SELECT length(tile_data) FROM tiles"
+                " WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+                &stmt)) {
+            mbtiles_bind_tile (stmt, zoom, OSM_TILE_KEY_X (key), OSM_TILE_KEY_Y (key));
+            if (sqlite3_step (stmt) == SQLITE_ROW)
+                size = sqlite3_column_int (stmt, 0);
+            sqlite3_finalize (stmt);
+        }
+        g_mutex_unlock (&disk->lock);
+
+        if (size >= 0)
+            osm_tile_index_add (disk->index, key, size, 0);
+        else
+            osm_tile_index_remove (disk->index, key);
+        return;
+    }
+#endif
+
+    filename = osm_tile_disk_filename (disk, zoom, OSM_TILE_KEY_X (key), OSM_TILE_KEY_Y (key));
+    if (g_stat (filename, &buf) == 0) {
+        OsmTileMeta meta = { buf.st_mtime, 0, 0, NULL };
+
+        osm_tile_index_add (disk->index, key, buf.st_size, buf.st_mtime);
+        /* the tile was downloaded when it was written */
+        osm_tile_index_set_meta (disk->index, key, &meta);
+    } else {
+        osm_tile_index_remove (disk->index, key);
+    }
+    g_free (filename);
+}
+
+static void
+osm_tile_disk_scan_free (OsmTileScan *scan)
+{
+    if (scan->unsure)
+        g_array_free (scan->unsure, TRUE);
+    if (scan->y_dir)
+        g_dir_close (scan->y_dir);
+    if (scan->x_dir)
+        g_dir_close (scan->x_dir);
+    if (scan->zoom_dir)
+        g_dir_close (scan->zoom_dir);
+    g_free (scan->y_path);
+    g_free (scan->x_path);
+    g_free (scan);
+}
+
+#ifdef HAVE_SQLITE
+/* Adds the next MBTiles tiles the index does not know. Returns TRUE once
+ * all are done. Only called by the writer */
+static gboolean
+osm_tile_disk_scan_mbtiles (OsmTileDisk *disk, OsmTileScan *scan)
+{
+    sqlite3_stmt *stmt;
+    guint n = 0;
+    int zoom;
+
+    g_mutex_lock (&disk->lock);
+    if (mbtiles_prepare (disk,
+            "SELECT zoom_level, tile_column, tile_row, length(tile_data) FROM tiles"
+            " WHERE (zoom_level, tile_column, tile_row) > (?, ?, ?)"
+            " ORDER BY zoom_level, tile_column, tile_row LIMIT ?",
+            &stmt)) {
+        sqlite3_bind_int (stmt, 1, scan->zoom);
+        sqlite3_bind_int (stmt, 2, scan->x);
+        sqlite3_bind_int (stmt, 3, scan->row);
+        sqlite3_bind_int (stmt, 4, JANITOR_BATCH);
+        while (sqlite3_step (stmt) == SQLITE_ROW) {
+            guint64 key;
+
+            zoom = sqlite3_column_int (stmt, 0);
+            scan->zoom = zoom;
+            scan->x = sqlite3_column_int (stmt, 1);
+            scan->row = sqlite3_column_int (stmt, 2);
+            key = OSM_TILE_KEY (0, zoom, scan->x, MBTILES_ROW (zoom, scan->row));
+            if (!osm_tile_index_contains (disk->index, key))
+                osm_tile_index_add (disk->index, key, sqlite3_column_int (stmt, 3), 0);
+            n++;
+        }
+        sqlite3_finalize (stmt);
+    }
+    g_mutex_unlock (&disk->lock);
+
+    return n < JANITOR_BATCH;
+}
+#endif
+
+/* Adds the next tile files the index does not know. Returns TRUE once
+ * all are done. Only called by the writer */
+static gboolean
+osm_tile_disk_scan_files (OsmTileDisk *disk, OsmTileScan *scan)
+{
+    const gchar *name;
+    gchar *suffix;
+    guint n;
+    int y;
+
+    suffix = g_strdup_printf (".%s", disk->format);
+    for (n = 0; n < JANITOR_BATCH; n++) {
+        if (scan->y_dir) {
+            name = g_dir_read_name (scan->y_dir);
+            if (!name) {
+                g_clear_pointer (&scan->y_dir, g_dir_close);
+                g_clear_pointer (&scan->y_path, g_free);
+            /* skips temporary files, y.format.XXXXXX */
+            } else if (sscanf (name, "%d", &y) == 1 && g_str_has_suffix (name, suffix)) {
+                guint64 key = OSM_TILE_KEY (0, scan->zoom, scan->x, y);
+
+                if (!osm_tile_index_contains (disk->index, key))
+                    osm_tile_disk_check (disk, key);
+            }
+        } else if (scan->x_dir) {
+            name = g_dir_read_name (scan->x_dir);
+            if (!name) {
+                g_clear_pointer (&scan->x_dir, g_dir_close);
+                g_clear_pointer (&scan->x_path, g_free);
+            } else if (sscanf (name, "%d", &scan->x) == 1) {
+                scan->y_path = g_build_filename (scan->x_path, name, NULL);
+                scan->y_dir = g_dir_open (scan->y_path, 0, NULL);
+                if (!scan->y_dir)
+                    g_clear_pointer (&scan->y_path, g_free);
+            }
+        } else {
+            name = scan->zoom_dir ? g_dir_read_name (scan->zoom_dir) : NULL;
+            if (!name)
+                break;
+            if (sscanf (name, "%d", &scan->zoom) == 1) {
+                scan->x_path = g_build_filename (disk->path, name, NULL);
+                scan->x_dir = g_dir_open (scan->x_path, 0, NULL);
+                if (!scan->x_dir)
+                    g_clear_pointer (&scan->x_path, g_free);
+            }
+        }
+    }
+    g_free (suffix);
+
+    return n < JANITOR_BATCH;
+}
+
+/* Loads the index, and starts repairing it if the cache was not closed
+ * cleanly or building it if there is none. Only called by the writer */
+static OsmTileScan *
+osm_tile_disk_start_scan (OsmTileDisk *disk)
+{
+    OsmTileScan *scan = g_new0 (OsmTileScan, 1);
+    gchar *filename = osm_tile_disk_get_sidecar (disk, INDEX_FILENAME);
+
+    if (osm_tile_index_load (disk->index, filename, &scan->unsure)) {
+        /* tiles may be written before the repair is done, the file
+         * keeps the tiles it is looking at */
+        disk->journal = TRUE;
+        if (scan->unsure->len > 0)
+            g_debug ("Checking %u tiles written to %s before a crash",
+                     scan->unsure->len, disk->path);
+    } else {
+        scan->zoom_dir = g_dir_open (disk->path, 0, NULL);
+        scan->zoom = -1;
+        scan->x = -1;
+        scan->row = -1;
+    }
+    g_free (filename);
+
+    return scan;
+}
+
+/* Takes the next steps in building or repairing the index. Returns TRUE
+ * once it is done. Only called by the writer */
+static gboolean
+osm_tile_disk_scan (OsmTileDisk *disk, OsmTileScan *scan)
+{
+    guint n;
+
+    if (scan->unsure) {
+        for (n = 0; n < JANITOR_BATCH && scan->next < scan->unsure->len; n++)
+            osm_tile_disk_check (disk, g_array_index (scan->unsure, guint64, scan->next++));
+        return scan->next == scan->unsure->len;
+    }
+
+#ifdef HAVE_SQLITE
+    if (disk->db)
+        return osm_tile_disk_scan_mbtiles (disk, scan);
+#endif
+    return osm_tile_disk_scan_files (disk, scan);
+}
+
+/* Saves the index, if the cache exists on disk. clean is set when the
+ * cache is closed */
+static void
+osm_tile_disk_save_index (OsmTileDisk *disk, gboolean clean)
+{
+    gchar *filename = osm_tile_disk_get_sidecar (disk, INDEX_FILENAME);
+    gchar *dir = g_path_get_dirname (filename);
+
+    if (g_file_test (dir, G_FILE_TEST_IS_DIR))
+        osm_tile_index_save (disk->index, filename, clean);
+    g_free (dir);
+    g_free (filename);
+}
+
+/* Only called by the writer */
+static void
+osm_tile_disk_janitor (OsmTileDisk *disk)
+{
+    guint64 max_bytes, bytes;
+    GArray *keys;
+    guint i;
+
+    if (g_atomic_int_get (&disk->closing) || disk->pmtiles)
+        return;
+
+    disk->last_janitor = g_get_monotonic_time ();
+
+    if (!disk->index_loaded) {
+        if (!disk->scan)
+            disk->scan = osm_tile_disk_start_scan (disk);
+        /* nothing is saved or evicted before the index is complete, the
+         * file is read again next time if the cache is closed meanwhile */
+        if (!osm_tile_disk_scan (disk, disk->scan)) {
+            /* continue after the writes queued meanwhile */
+            osm_tile_disk_queue_janitor (disk);
+            return;
+        }
+        g_clear_pointer (&disk->scan, osm_tile_disk_scan_free);
+        g_debug ("Found %u tiles in %s", osm_tile_index_get_size (disk->index), disk->path);
+        g_atomic_int_set (&disk->index_loaded, TRUE);
+        /* the file is no longer clean once tiles are written */
+        osm_tile_disk_save_index (disk, FALSE);
+        disk->journal = TRUE;
+    }
+
+    g_mutex_lock (&disk->queue_lock);
+    max_bytes = disk->max_bytes;
+    g_mutex_unlock (&disk->queue_lock);
+
+    /* once over the quota, evict down to 90% of it so that the janitor
+     * does not run again for every new tile */
+    bytes = osm_tile_index_get_bytes (disk->index);
+    if (max_bytes > 0 && bytes > max_bytes)
+        disk->evicting = TRUE;
+    /* the quota was lifted in the middle of an eviction */
+    else if (max_bytes == 0)
+        disk->evicting = FALSE;
+
+    if (disk->evicting) {
+        keys = osm_tile_index_pop_oldest (disk->index,
+                                          max_bytes - max_bytes / 10,
+                                          JANITOR_BATCH);
+        for (i = 0; i < keys->len; i++) {
+            guint64 key = g_array_index (keys, guint64, i);
+            osm_tile_disk_remove (disk, OSM_TILE_KEY_ZOOM (key),
+                                  OSM_TILE_KEY_X (key), OSM_TILE_KEY_Y (key));
+        }
+        g_debug ("Evicted %u tiles from %s", keys->len, disk->path);
+
+        g_mutex_lock (&disk->queue_lock);
+        disk->stats.evicted += keys->len;
+        g_mutex_unlock (&disk->queue_lock);
+
+        /* continue after the writes queued meanwhile */
+        if (keys->len == JANITOR_BATCH)
+            osm_tile_disk_queue_janitor (disk);
+        else
+            disk->evicting = FALSE;
+        g_array_free (keys, TRUE);
+    }
+
+#ifdef HAVE_SQLITE
+    /* drops the images of the tiles evicted or replaced, once for the
+     * whole eviction as it walks all the images */
+    if (disk->orphans && !disk->evicting) {
+        g_mutex_lock (&disk->lock);
+        mbtiles_commit (disk);
+        mbtiles_exec (disk, "DELETE FROM images WHERE tile_id NOT IN (SELECT tile_id FROM map)");
+        g_mutex_unlock (&disk->lock);
+        disk->orphans = FALSE;
+    }
+#endif
+
+    osm_tile_disk_save_index (disk, FALSE);
+}
+
+static void
+osm_tile_disk_meta_free (OsmTileMeta *meta)
+{
+    g_free (meta->etag);
+    g_free (meta);
+}
+
+/* Returns a new reference to the tile waiting to be written, if any */
+static GBytes *
+osm_tile_disk_lookup_queued (OsmTileDisk *disk, int zoom, int x, int y)
+{
+    guint64 key = OSM_TILE_KEY (0, zoom, x, y);
+    GBytes *bytes;
+
+    g_mutex_lock (&disk->queue_lock);
+    bytes = g_hash_table_lookup (disk->queued, &key);
+    if (bytes)
+        g_bytes_ref (bytes);
+    g_mutex_unlock (&disk->queue_lock);
+
+    return bytes;
+}
+
+/* Notes the tiles waiting for the writer in the index file, in one go,
+ * before the first of them is written. Only called by the writer */
+static void
+osm_tile_disk_journal (OsmTileDisk *disk)
+{
+    GHashTableIter iter;
+    GArray *keys;
+    guint64 *key;
+    gchar *filename;
+
+    g_mutex_lock (&disk->queue_lock);
+    keys = g_array_sized_new (FALSE, FALSE, sizeof (guint64), g_hash_table_size (disk->queued));
+    g_hash_table_iter_init (&iter, disk->queued);
+    while (g_hash_table_iter_next (&iter, (gpointer *)&key, NULL))
+        g_array_append_val (keys, *key);
+    g_mutex_unlock (&disk->queue_lock);
+
+    filename = osm_tile_disk_get_sidecar (disk, INDEX_FILENAME);
+    osm_tile_index_journal (disk->index, filename, (const guint64 *)keys->data, keys->len);
+    g_free (filename);
+    g_array_free (keys, TRUE);
+}
+
+/* Runs in the writer thread */
+static void
+osm_tile_disk_writer (gpointer data, gpointer user_data)
+{
+    OsmTileWrite *job = data;
+    OsmTileDisk *disk = user_data;
+    GBytes *bytes = NULL;
+    OsmTileMeta *meta = NULL;
+    guint64 *key = NULL;
+
+    /* a tile queued twice is written once, with the newest data */
+    if (job->janitor)
+        osm_tile_disk_janitor (disk);
+    else
+        bytes = osm_tile_disk_lookup_queued (disk, job->zoom, job->x, job->y);
+
+    if (bytes) {
+        gboolean duplicate = FALSE;
+        gboolean ok;
+
+        if (disk->journal && !osm_tile_index_is_journaled (disk->index, job->key))
+            osm_tile_disk_journal (disk);
+        ok = osm_tile_disk_write (disk, job->zoom, job->x, job->y,
+                                  g_bytes_get_data (bytes, NULL),
+                                  g_bytes_get_size (bytes),
+                                  &duplicate);
+
+        /* the metadata queued with these bytes, newer ones come with a
+         * newer write */
+        g_mutex_lock (&disk->queue_lock);
+        if (g_hash_table_lookup (disk->queued, &job->key) == bytes &&
+            g_hash_table_lookup_extended (disk->queued_meta, &job->key,
+                                          (gpointer *)&key, (gpointer *)&meta))
+            g_hash_table_steal (disk->queued_meta, &job->key);
+        g_mutex_unlock (&disk->queue_lock);
+
+        /* before it leaves the queue, so that reads always find it. The
+         * tile gets its size and the time it was written */
+        if (ok) {
+            osm_tile_index_add (disk->index, job->key, g_bytes_get_size (bytes), 0);
+            if (meta)
+                osm_tile_index_set_meta (disk->index, job->key, meta);
+        } else {
+            osm_tile_index_remove (disk->index, job->key);
+        }
+        g_free (key);
+        if (meta)
+            osm_tile_disk_meta_free (meta);
+
+        /* unless it was queued again meanwhile, reads find it on disk now */
+        g_mutex_lock (&disk->queue_lock);
+        if (g_hash_table_lookup (disk->queued, &job->key) == bytes) {
+            g_hash_table_remove (disk->queued, &job->key);
+            g_cond_broadcast (&disk->queue_cond);
+        }
+        if (ok)
+            disk->stats.written++;
+        else
+            disk->stats.write_failures++;
+        if (duplicate)
+            disk->stats.deduplicated++;
+        g_mutex_unlock (&disk->queue_lock);
+
+        g_bytes_unref (bytes);
+    }
+    g_free (job);
+
+    if (g_thread_pool_unprocessed (disk->writer) == 0) {
+        osm_tile_disk_flush (disk);
+        if (g_get_monotonic_time () - disk->last_janitor > JANITOR_INTERVAL * G_USEC_PER_SEC)
+            osm_tile_disk_janitor (disk);
+    }
+}
+
+static void osm_tile_disk_free (OsmTileDisk *disk);
+
+/* Opens the disk cache in path, a directory, an MBTiles file or a
+ * PMTiles archive. Must be called with open_disks_lock held */
+static OsmTileDisk *
+osm_tile_disk_open (const gchar *path, const gchar *image_format, gboolean dedup)
+{
+    OsmTileDisk *disk;
+
+    disk = g_new0 (OsmTileDisk, 1);
+    disk->ref_count = 1;
+    disk->path = g_strdup (path);
+    disk->dedup = dedup;
+    g_mutex_init (&disk->queue_lock);
+    g_cond_init (&disk->queue_cond);
+    disk->queued = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                          g_free, (GDestroyNotify)g_bytes_unref);
+    disk->queued_meta = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                               g_free, (GDestroyNotify)osm_tile_disk_meta_free);
+    disk->dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    disk->index = osm_tile_index_new ();
+    /* a single writer keeps the writes in order */
+    disk->writer = g_thread_pool_new (osm_tile_disk_writer, disk, 1, FALSE, NULL);
+
+    if (g_str_has_suffix (path, ".pmtiles")) {
+        disk->pmtiles = osm_tile_pmtiles_open (path);
+        if (!disk->pmtiles) {
+            osm_tile_disk_free (disk);
+            return NULL;
+        }
+        disk->format = g_strdup (osm_tile_pmtiles_get_format (disk->pmtiles));
+        return disk;
+    } else if (g_str_has_suffix (path, ".mbtiles")) {
+#ifdef HAVE_SQLITE
+        g_mutex_init (&disk->lock);
+        if (!mbtiles_open (disk, image_format)) {
+            osm_tile_disk_free (disk);
+            return NULL;
+        }
+#else
+        g_warning ("MBTiles cache %s not supported, built without SQLite", path);
+        osm_tile_disk_free (disk);
+        return NULL;
+#endif
+    } else {
+        disk->format = g_strdup (image_format);
+#ifndef G_OS_UNIX
+        /* tiles are stored by content with hard links */
+        disk->dedup = FALSE;
+#endif
+    }
+
+    /* load the index in the background */
+    osm_tile_disk_queue_janitor (disk);
+
+    return disk;
+}
+
+/* Returns the disk cache in path, a directory, an MBTiles file or a
+ * PMTiles archive, or NULL if it cannot be used. dedup asks for identical
+ * tiles to be stored once, an existing MBTiles file keeps its layout. If
+ * the path is already open, a new reference to that disk cache is
+ * returned instead, with the format and dedup it was opened with */
+OsmTileDisk *
+osm_tile_disk_new (const gchar *path, const gchar *image_format, gboolean dedup)
+{
+    OsmTileDisk *disk;
+
+    g_return_val_if_fail (path != NULL, NULL);
+
+    g_mutex_lock (&open_disks_lock);
+    if (!open_disks)
+        open_disks = g_hash_table_new (g_str_hash, g_str_equal);
+    disk = g_hash_table_lookup (open_disks, path);
+    if (disk) {
+        osm_tile_disk_ref (disk);
+    } else {
+        disk = osm_tile_disk_open (path, image_format, dedup);
+        if (disk)
+            g_hash_table_insert (open_disks, disk->path, disk);
+    }
+    g_mutex_unlock (&open_disks_lock);
+
+    return disk;
+}
+
+OsmTileDisk *
+osm_tile_disk_ref (OsmTileDisk *disk)
+{
+    g_atomic_int_inc (&disk->ref_count);
+    return disk;
+}
+
+/* Waits for the writer to be done with the queued writes, skipping the
+ * janitor */
+static void
+osm_tile_disk_stop_writer (OsmTileDisk *disk)
+{
+    if (!disk->writer)
+        return;
+    g_atomic_int_set (&disk->closing, TRUE);
+    g_thread_pool_free (disk->writer, FALSE, TRUE);
+    disk->writer = NULL;
+}
+
+/* Drops a reference. The last one writes the tiles still queued, however
+ * they were queued, before the cache is closed */
+void
+osm_tile_disk_unref (OsmTileDisk *disk)
+{
+    /* the lock keeps osm_tile_disk_new() from finding a disk cache being
+     * freed, or opening the path again before the writes are done */
+    g_mutex_lock (&open_disks_lock);
+    if (!g_atomic_int_dec_and_test (&disk->ref_count)) {
+        g_mutex_unlock (&open_disks_lock);
+        return;
+    }
+    osm_tile_disk_stop_writer (disk);
+    g_hash_table_remove (open_disks, disk->path);
+    g_mutex_unlock (&open_disks_lock);
+
+    osm_tile_disk_free (disk);
+}
+
+static void
+osm_tile_disk_free (OsmTileDisk *disk)
+{
+    osm_tile_disk_stop_writer (disk);
+    g_hash_table_destroy (disk->queued);
+    g_hash_table_destroy (disk->queued_meta);
+    g_hash_table_destroy (disk->dirs);
+    g_mutex_clear (&disk->queue_lock);
+    g_cond_clear (&disk->queue_cond);
+
+    if (g_atomic_int_get (&disk->index_loaded))
+        osm_tile_disk_save_index (disk, TRUE);
+    if (disk->scan)
+        osm_tile_disk_scan_free (disk->scan);
+    osm_tile_index_free (disk->index);
+
+    if (disk->pmtiles)
+        osm_tile_pmtiles_free (disk->pmtiles);
+
+#ifdef HAVE_SQLITE
+    if (disk->db) {
+        g_mutex_lock (&disk->lock);
+        mbtiles_commit (disk);
+        g_mutex_unlock (&disk->lock);
+
+        sqlite3_finalize (disk->select_stmt);
+        sqlite3_finalize (disk->insert_stmt);
+        sqlite3_finalize (disk->insert_image_stmt);
+        sqlite3_finalize (disk->exists_stmt);
+        sqlite3_finalize (disk->delete_stmt);
+        sqlite3_close (disk->db);
+        g_mutex_clear (&disk->lock);
+    }
+#endif
+    g_free (disk->path);
+    g_free (disk->format);
+    g_free (disk);
+}
+
+gboolean
+osm_tile_disk_is_mbtiles (OsmTileDisk *disk)
+{
+#ifdef HAVE_SQLITE
+    return disk->db != NULL;
+#else
+    return FALSE;
+#endif
+}
+
+/* Whether tiles cannot be written, the cache being a PMTiles archive */
+gboolean
+osm_tile_disk_is_read_only (OsmTileDisk *disk)
+{
+    return disk->pmtiles != NULL;
+}
+
+/* Returns the path of a file named name to be kept beside the tiles */
+gchar *
+osm_tile_disk_get_sidecar (OsmTileDisk *disk, const gchar *name)
+{
+    if (osm_tile_disk_is_mbtiles (disk) || disk->pmtiles)
+        return g_strdup_printf ("%s-%s", disk->path, name);
+    return g_build_filename (disk->path, name, NULL);
+}
+
+/* The format of the tiles, a file extension like "png", or NULL if it is
+ * not known */
+const gchar *
+osm_tile_disk_get_format (OsmTileDisk *disk)
+{
+    return disk->format;
+}
+
+/* Whether the index knows the tile is not on disk */
+static gboolean
+osm_tile_disk_is_missing (OsmTileDisk *disk, guint64 key)
+{
+    return g_atomic_int_get (&disk->index_loaded) &&
+           !osm_tile_index_contains (disk->index, key);
+}
+
+/* Returns the encoded tile, or NULL if it is not cached */
+GBytes *
+osm_tile_disk_read (OsmTileDisk *disk, int zoom, int x, int y)
+{
+    guint64 key = OSM_TILE_KEY (0, zoom, x, y);
+    GBytes *queued;
+    gchar *contents;
+    gsize len;
+
+    if (disk->pmtiles)
+        return osm_tile_pmtiles_read (disk->pmtiles, zoom, x, y);
+
+    queued = osm_tile_disk_lookup_queued (disk, zoom, x, y);
+    if (queued)
+        return queued;
+
+    if (osm_tile_disk_is_missing (disk, key))
+        return NULL;
+
+#ifdef HAVE_SQLITE
+    if (disk->db) {
+        GBytes *bytes = NULL;
+
+        g_mutex_lock (&disk->lock);
+        mbtiles_bind_tile (disk->select_stmt, zoom, x, y);
+        if (sqlite3_step (disk->select_stmt) == SQLITE_ROW) {
+            bytes = g_bytes_new (sqlite3_column_blob (disk->select_stmt, 0),
+                                 sqlite3_column_bytes (disk->select_stmt, 0));
+        }
+        sqlite3_reset (disk->select_stmt);
+        g_mutex_unlock (&disk->lock);
+
+        if (bytes)
+            osm_tile_index_touch (disk->index, key, g_bytes_get_size (bytes));
+        else if (g_atomic_int_get (&disk->index_loaded))
+            osm_tile_index_remove (disk->index, key);
+        return bytes;
+    }
+#endif
+
+    {
+        gchar *filename = osm_tile_disk_filename (disk, zoom, x, y);
+        gboolean ok = g_file_get_contents (filename, &contents, &len, NULL);
+
+        g_free (filename);
+        if (!ok) {
+            /* removed behind our back */
+            if (g_atomic_int_get (&disk->index_loaded))
+                osm_tile_index_remove (disk->index, key);
+            return NULL;
+        }
+
+        osm_tile_index_touch (disk->index, key, len);
+        return g_bytes_new_take (contents, len);
+    }
+}
+
+/* Creates dir and its missing parents, with a single mkdir call if the
+ * parent is known to exist. Only called by the writer */
+static gboolean
+osm_tile_disk_make_dir (OsmTileDisk *disk, const gchar *dir)
+{
+    gboolean ok;
+
+    if (g_hash_table_contains (disk->dirs, dir))
+        return TRUE;
+
+    ok = g_mkdir (dir, 0700) == 0 || errno == EEXIST;
+    if (!ok && errno == ENOENT) {
+        gchar *parent = g_path_get_dirname (dir);
+
+        ok = strcmp (parent, dir) != 0 &&
+             osm_tile_disk_make_dir (disk, parent) &&
+             (g_mkdir (dir, 0700) == 0 || errno == EEXIST);
+        g_free (parent);
+    }
+
+    if (ok)
+        g_hash_table_add (disk->dirs, g_strdup (dir));
+    return ok;
+}
+
+/* Writes the file atomically, creating its directory folder if needed.
+ * Only called by the writer */
+static gboolean
+osm_tile_disk_write_file (OsmTileDisk *disk, const gchar *folder,
+                          const gchar *filename, const guchar *data, gsize len)
+{
+    GError *error = NULL;
+    gboolean ok = FALSE;
+
+    if (osm_tile_disk_make_dir (disk, folder)) {
+        /* writes a temporary file and renames it */
+        ok = g_file_set_contents (filename, (const gchar *)data, len, &error);
+        if (!ok && g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            /* the directory was removed behind our back */
+            g_clear_error (&error);
+            g_hash_table_remove_all (disk->dirs);
+            ok = osm_tile_disk_make_dir (disk, folder) &&
+                 g_file_set_contents (filename, (const gchar *)data, len, &error);
+        }
+
+        if (ok) {
+            g_debug("Wrote %" G_GSIZE_FORMAT " bytes to %s", len, filename);
+        } else if (error) {
+            g_warning("Error writing tile: %s", error->message);
+            g_error_free (error);
+        }
+    } else {
+        g_warning("Error creating tile download directory: %s", folder);
+    }
+
+    return ok;
+}
+
+#ifdef G_OS_UNIX
+/* Stores the content once and makes the tile file a hard link to it.
+ * Returns FALSE if the tile is not written, and clears dedup if the
+ * filesystem cannot link. Only called by the writer */
+static gboolean
+osm_tile_disk_write_linked (OsmTileDisk *disk, const gchar *folder,
+                            const gchar *filename, const guchar *data, gsize len,
+                            gboolean *duplicate)
+{
+    gchar *digest, *object, *object_dir, *tmp, *replaced;
+    gboolean ok;
+
+    digest = osm_tile_dedup_digest (data, len);
+    object = osm_tile_disk_object_filename (disk, digest);
+    g_free (digest);
+
+    *duplicate = g_file_test (object, G_FILE_TEST_EXISTS);
+    ok = *duplicate;
+    if (!ok) {
+        object_dir = g_path_get_dirname (object);
+        ok = osm_tile_disk_write_file (disk, object_dir, object, data, len);
+        g_free (object_dir);
+    }
+    if (!ok) {
+        g_free (object);
+        return FALSE;
+    }
+
+    /* link beside the tile and rename over it, so that readers never see
+     * it missing */
+    tmp = g_strdup_printf ("%s.link", filename);
+    g_unlink (tmp);
+    ok = osm_tile_disk_make_dir (disk, folder) && link (object, tmp) == 0;
+    if (ok) {
+        /* the content of the tile replaced, if nothing else uses it */
+        replaced = osm_tile_disk_last_link (disk, filename);
+        ok = g_rename (tmp, filename) == 0;
+        /* left behind if the tile already was this link */
+        g_unlink (tmp);
+        if (ok && replaced && strcmp (replaced, object) != 0)
+            g_unlink (replaced);
+        g_free (replaced);
+    } else if (errno == EPERM || errno == EXDEV || errno == EMLINK || errno == ENOTSUP) {
+        g_warning ("Cannot link tiles in %s, storing them without deduplication: %s",
+                   disk->path, g_strerror (errno));
+        disk->dedup = FALSE;
+        /* an object nothing links to would never be removed */
+        if (!*duplicate)
+            g_unlink (object);
+        *duplicate = FALSE;
+    }
+    g_free (tmp);
+    g_free (object);
+
+    return ok;
+}
+#endif
+
+/* Writes a tile, only called by the writer. Sets duplicate if the same
+ * content was already stored */
+static gboolean
+osm_tile_disk_write (OsmTileDisk *disk, int zoom, int x, int y,
+                     const guchar *data, gsize len, gboolean *duplicate)
+{
+    gchar *folder, *filename;
+    gboolean ok = FALSE;
+
+#ifdef HAVE_SQLITE
+    if (disk->db) {
+        gchar *digest = NULL;
+
+        if (disk->dedup)
+            digest = osm_tile_dedup_digest (data, len);
+
+        g_mutex_lock (&disk->lock);
+        if (disk->pending == 0)
+            mbtiles_exec (disk, "BEGIN");
+
+        if (digest) {
+            /* the image of the tile replaced may be used by no other */
+            if (!g_atomic_int_get (&disk->index_loaded) ||
+                osm_tile_index_contains (disk->index, OSM_TILE_KEY (0, zoom, x, y)))
+                disk->orphans = TRUE;
+
+            sqlite3_reset (disk->insert_image_stmt);
+            sqlite3_bind_blob (disk->insert_image_stmt, 1, data, len, SQLITE_STATIC);
+            sqlite3_bind_text (disk->insert_image_stmt, 2, digest, -1, SQLITE_STATIC);
+            ok = sqlite3_step (disk->insert_image_stmt) == SQLITE_DONE;
+            *duplicate = ok && sqlite3_changes (disk->db) == 0;
+            sqlite3_reset (disk->insert_image_stmt);
+
+            mbtiles_bind_tile (disk->insert_stmt, zoom, x, y);
+            sqlite3_bind_text (disk->insert_stmt, 4, digest, -1, SQLITE_STATIC);
+        } else {
+            mbtiles_bind_tile (disk->insert_stmt, zoom, x, y);
+            sqlite3_bind_blob (disk->insert_stmt, 4, data, len, SQLITE_STATIC);
+            ok = TRUE;
+        }
+        ok = ok && sqlite3_step (disk->insert_stmt) == SQLITE_DONE;
+        if (!ok)
+            g_warning ("Error writing tile to %s: %s", disk->path,
+                       sqlite3_errmsg (disk->db));
+        sqlite3_reset (disk->insert_stmt);
+
+        if (++disk->pending >= MBTILES_BATCH)
+            mbtiles_commit (disk);
+        g_mutex_unlock (&disk->lock);
+        g_free (digest);
+
+        return ok;
+    }
+#endif
+
+    folder = g_strdup_printf("%s%c%d%c%d",
+                disk->path, G_DIR_SEPARATOR,
+                zoom, G_DIR_SEPARATOR,
+                x);
+    filename = osm_tile_disk_filename (disk, zoom, x, y);
+
+#ifdef G_OS_UNIX
+    if (disk->dedup)
+        ok = osm_tile_disk_write_linked (disk, folder, filename, data, len, duplicate);
+#endif
+    if (!ok && !disk->dedup)
+        ok = osm_tile_disk_write_file (disk, folder, filename, data, len);
+
+    g_free (filename);
+    g_free (folder);
+
+    return ok;
+}
+
+/* Keeps a copy of the metadata of a queued tile for the writer. Must be
+ * called with queue_lock held */
+static void
+osm_tile_disk_queue_meta (OsmTileDisk *disk, guint64 key, const OsmTileMeta *meta)
+{
+    OsmTileMeta *copy = g_new (OsmTileMeta, 1);
+    guint64 *copy_key = g_new (guint64, 1);
+
+    *copy = *meta;
+    copy->etag = g_strdup (meta->etag);
+    *copy_key = key;
+    g_hash_table_replace (disk->queued_meta, copy_key, copy);
+}
+
+static gboolean
+osm_tile_disk_queue (OsmTileDisk *disk, int zoom, int x, int y, GBytes *data,
+                     const OsmTileMeta *meta, gboolean wait)
+{
+    OsmTileWrite *job;
+    guint64 *key;
+    guint queued;
+
+    if (disk->pmtiles)
+        return FALSE;
+
+    key = g_new (guint64, 1);
+    *key = OSM_TILE_KEY (0, zoom, x, y);
+
+    g_mutex_lock (&disk->queue_lock);
+    while (wait && g_hash_table_size (disk->queued) >= MAX_QUEUED &&
+           !g_hash_table_contains (disk->queued, key))
+        g_cond_wait (&disk->queue_cond, &disk->queue_lock);
+    queued = g_hash_table_size (disk->queued);
+    if (queued >= MAX_QUEUED && !g_hash_table_contains (disk->queued, key)) {
+        disk->stats.dropped++;
+        g_mutex_unlock (&disk->queue_lock);
+        g_free (key);
+        return FALSE;
+    }
+    g_hash_table_replace (disk->queued, key, g_bytes_ref (data));
+    if (meta)
+        osm_tile_disk_queue_meta (disk, *key, meta);
+    else
+        g_hash_table_remove (disk->queued_meta, key);
+    queued = g_hash_table_size (disk->queued);
+    disk->stats.queued_peak = MAX (disk->stats.queued_peak, queued);
+    g_mutex_unlock (&disk->queue_lock);
+
+    job = g_new (OsmTileWrite, 1);
+    job->key = *key;
+    job->zoom = zoom;
+    job->x = x;
+    job->y = y;
+    g_thread_pool_push (disk->writer, job, NULL);
+
+    return TRUE;
+}
+
+/* Queues the tile for the writer thread, which takes a reference to
+ * data. The HTTP cache metadata, if not NULL, is recorded once the tile
+ * is written. Returns FALSE if the queue is full and the tile is not
+ * written */
+gboolean
+osm_tile_disk_write_async (OsmTileDisk *disk, int zoom, int x, int y, GBytes *data,
+                           const OsmTileMeta *meta)
+{
+    return osm_tile_disk_queue (disk, zoom, x, y, data, meta, FALSE);
+}
+
+/* Like osm_tile_disk_write_async(), but waits for room in the queue
+ * rather than dropping the tile, for bulk writes. Must not be called by
+ * the writer. Returns FALSE only if the cache is read only */
+gboolean
+osm_tile_disk_write_wait (OsmTileDisk *disk, int zoom, int x, int y, GBytes *data)
+{
+    return osm_tile_disk_queue (disk, zoom, x, y, data, NULL, TRUE);
+}
+
+/* The writer counters, the current length of its queue and the size of
+ * the tiles on disk */
+void
+osm_tile_disk_get_stats (OsmTileDisk *disk, OsmTileDiskStats *stats)
+{
+    g_mutex_lock (&disk->queue_lock);
+    *stats = disk->stats;
+    stats->queued = g_hash_table_size (disk->queued);
+    g_mutex_unlock (&disk->queue_lock);
+
+    stats->tiles = osm_tile_index_get_size (disk->index);
+    stats->bytes = osm_tile_index_get_bytes (disk->index);
+}
+
+/* Records the HTTP cache metadata of a tile, with the write still queued
+ * if there is one */
+void
+osm_tile_disk_set_meta (OsmTileDisk *disk, int zoom, int x, int y,
+                        const OsmTileMeta *meta)
+{
+    guint64 key = OSM_TILE_KEY (0, zoom, x, y);
+    gboolean queued;
+
+    g_mutex_lock (&disk->queue_lock);
+    queued = g_hash_table_contains (disk->queued, &key);
+    if (queued)
+        osm_tile_disk_queue_meta (disk, key, meta);
+    g_mutex_unlock (&disk->queue_lock);
+
+    if (!queued)
+        osm_tile_index_set_meta (disk->index, key, meta);
+}
+
+/* Returns FALSE if the metadata of the tile is not known (yet). Otherwise
+ * the etag of meta must be freed */
+gboolean
+osm_tile_disk_get_meta (OsmTileDisk *disk, int zoom, int x, int y,
+                        OsmTileMeta *meta)
+{
+    guint64 key = OSM_TILE_KEY (0, zoom, x, y);
+    OsmTileMeta *queued;
+
+    g_mutex_lock (&disk->queue_lock);
+    queued = g_hash_table_lookup (disk->queued_meta, &key);
+    if (queued) {
+        *meta = *queued;
+        meta->etag = g_strdup (queued->etag);
+    }
+    g_mutex_unlock (&disk->queue_lock);
+
+    return queued || osm_tile_index_get_meta (disk->index, key, meta);
+}
+
+/* Sets the quota of the tiles on disk, 0 for none. The janitor evicts
+ * tiles in the background */
+void
+osm_tile_disk_set_max_bytes (OsmTileDisk *disk, guint64 max_bytes)
+{
+    g_mutex_lock (&disk->queue_lock);
+    disk->max_bytes = max_bytes;
+    g_mutex_unlock (&disk->queue_lock);
+
+    osm_tile_disk_queue_janitor (disk);
+}
+
+gboolean
+osm_tile_disk_contains (OsmTileDisk *disk, int zoom, int x, int y)
+{
+    GBytes *queued;
+    gchar *filename;
+    gboolean found;
+
+    if (disk->pmtiles)
+        return osm_tile_pmtiles_contains (disk->pmtiles, zoom, x, y);
+
+    queued = osm_tile_disk_lookup_queued (disk, zoom, x, y);
+    if (queued) {
+        g_bytes_unref (queued);
+        return TRUE;
+    }
+
+    if (g_atomic_int_get (&disk->index_loaded))
+        return osm_tile_index_contains (disk->index, OSM_TILE_KEY (0, zoom, x, y));
+
+#ifdef HAVE_SQLITE
+    if (disk->db) {
+        g_mutex_lock (&disk->lock);
+        mbtiles_bind_tile (disk->exists_stmt, zoom, x, y);
+        found = sqlite3_step (disk->exists_stmt) == SQLITE_ROW;
+        sqlite3_reset (disk->exists_stmt);
+        g_mutex_unlock (&disk->lock);
+
+        return found;
+    }
+#endif
+
+    filename = osm_tile_disk_filename (disk, zoom, x, y);
+    found = g_file_test (filename, G_FILE_TEST_EXISTS);
+    g_free (filename);
+
+    return found;
+}
+
+/* Returns the number of tiles of zoom in the region x1..x2, y1..y2 the
+ * cache holds, without touching the disk once the index is loaded */
+guint
+osm_tile_disk_count (OsmTileDisk *disk, int zoom, int x1, int y1, int x2, int y2)
+{
+    GHashTableIter iter;
+    guint64 *key;
+    guint count = 0;
+    int x, y;
+
+    if (disk->pmtiles || !g_atomic_int_get (&disk->index_loaded)) {
+        for (x = x1; x <= x2; x++)
+            for (y = y1; y <= y2; y++)
+                if (osm_tile_disk_contains (disk, zoom, x, y))
+                    count++;
+        return count;
+    }
+
+    count = osm_tile_index_count (disk->index, zoom, x1, y1, x2, y2);
+
+    /* and the tiles not written yet */
+    g_mutex_lock (&disk->queue_lock);
+    g_hash_table_iter_init (&iter, disk->queued);
+    while (g_hash_table_iter_next (&iter, (gpointer *)&key, NULL)) {
+        x = OSM_TILE_KEY_X (*key);
+        y = OSM_TILE_KEY_Y (*key);
+        if (OSM_TILE_KEY_ZOOM (*key) == zoom &&
+            x >= x1 && x <= x2 && y >= y1 && y <= y2 &&
+            !osm_tile_index_contains (disk->index, *key))
+            count++;
+    }
+    g_mutex_unlock (&disk->queue_lock);
+
+    return count;
+}
+
+/* Appends the keys (guint64, with source 0) of the tiles of zoom in the
+ * region x1..x2, y1..y2 the cache holds to keys, in no particular order.
+ * Once the index is loaded only the tiles it holds are visited, otherwise
+ * every tile of the region is looked for. Returns FALSE if cancelled */
+gboolean
+osm_tile_disk_list (OsmTileDisk *disk, int zoom, int x1, int y1, int x2, int y2,
+                    GCancellable *cancellable, GArray *keys)
+{
+    GHashTableIter iter;
+    guint64 *queued, key;
+    int x, y;
+
+    if (disk->pmtiles || !g_atomic_int_get (&disk->index_loaded)) {
+        for (x = x1; x <= x2; x++) {
+            if (g_cancellable_is_cancelled (cancellable))
+                return FALSE;
+            for (y = y1; y <= y2; y++) {
+                if (osm_tile_disk_contains (disk, zoom, x, y)) {
+                    key = OSM_TILE_KEY (0, zoom, x, y);
+                    g_array_append_val (keys, key);
+                }
+            }
+        }
+        return TRUE;
+    }
+
+    osm_tile_index_list (disk->index, zoom, x1, y1, x2, y2, keys);
+
+    /* and the tiles not written yet */
+    g_mutex_lock (&disk->queue_lock);
+    g_hash_table_iter_init (&iter, disk->queued);
+    while (g_hash_table_iter_next (&iter, (gpointer *)&queued, NULL)) {
+        x = OSM_TILE_KEY_X (*queued);
+        y = OSM_TILE_KEY_Y (*queued);
+        if (OSM_TILE_KEY_ZOOM (*queued) == zoom &&
+            x >= x1 && x <= x2 && y >= y1 && y <= y2 &&
+            !osm_tile_index_contains (disk->index, *queued))
+            g_array_append_val (keys, *queued);
+    }
+    g_mutex_unlock (&disk->queue_lock);
+
+    return !g_cancellable_is_cancelled (cancellable);
+}
+
+/* Commits the tiles written so far */
+void
+osm_tile_disk_flush (OsmTileDisk *disk)
+{
+#ifdef HAVE_SQLITE
+    if (disk->db) {
+        g_mutex_lock (&disk->lock);
+        mbtiles_commit (disk);
+        g_mutex_unlock (&disk->lock);
+    }
+#endif
+}
@@ -0,0 +1,67 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TILE_DISK_H__
+#define __TILE_DISK_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "tile-index.h"
+
+typedef struct _OsmTileDisk OsmTileDisk;
+
+typedef struct {
+    /* tiles written, and failed to */
+    guint64 written;
+    guint64 write_failures;
+    /* tiles not written because the queue was full */
+    guint64 dropped;
+    /* tiles waiting to be written, now and at most */
+    guint queued;
+    guint queued_peak;
+    /* number and size of the tiles on disk, as far as known yet */
+    guint tiles;
+    guint64 bytes;
+    /* tiles removed to stay within the quota */
+    guint64 evicted;
+    /* tiles whose content was already stored, in deduplicating mode */
+    guint64 deduplicated;
+} OsmTileDiskStats;
+
+OsmTileDisk    *osm_tile_disk_new               (const gchar *path, const gchar *image_format, gboolean dedup);
+OsmTileDisk    *osm_tile_disk_ref               (OsmTileDisk *disk);
+void            osm_tile_disk_unref             (OsmTileDisk *disk);
+gboolean        osm_tile_disk_is_mbtiles        (OsmTileDisk *disk);
+gboolean        osm_tile_disk_is_read_only      (OsmTileDisk *disk);
+gchar          *osm_tile_disk_get_sidecar       (OsmTileDisk *disk, const gchar *name);
+const gchar    *osm_tile_disk_get_format        (OsmTileDisk *disk);
+GBytes         *osm_tile_disk_read              (OsmTileDisk *disk, int zoom, int x, int y);
+gboolean        osm_tile_disk_write_async       (OsmTileDisk *disk, int zoom, int x, int y, GBytes *data, const OsmTileMeta *meta);
+gboolean        osm_tile_disk_write_wait        (OsmTileDisk *disk, int zoom, int x, int y, GBytes *data);
+void            osm_tile_disk_get_stats         (OsmTileDisk *disk, OsmTileDiskStats *stats);
+void            osm_tile_disk_set_max_bytes     (OsmTileDisk *disk, guint64 max_bytes);
+void            osm_tile_disk_set_meta          (OsmTileDisk *disk, int zoom, int x, int y, const OsmTileMeta *meta);
+gboolean        osm_tile_disk_get_meta          (OsmTileDisk *disk, int zoom, int x, int y, OsmTileMeta *meta);
+gboolean        osm_tile_disk_contains          (OsmTileDisk *disk, int zoom, int x, int y);
+guint           osm_tile_disk_count             (OsmTileDisk *disk, int zoom, int x1, int y1, int x2, int y2);
+gboolean        osm_tile_disk_list              (OsmTileDisk *disk, int zoom, int x1, int y1, int x2, int y2, GCancellable *cancellable, GArray *keys);
+void            osm_tile_disk_flush             (OsmTileDisk *disk);
+
+#endif /* __TILE_DISK_H__ */
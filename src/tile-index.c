@@ -0,0 +1,857 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Index of the tiles in a disk cache, with their size and the time they
+ * were last used, so that the least recently used ones can be evicted
+ * without walking the cache. Tiles are identified by OSM_TILE_KEY() keys
+ * with source 0. The index also keeps the HTTP cache metadata of the
+ * tiles (OsmTileMeta), to revalidate them when they expire.
+ *
+ * Which tiles exist is also kept in a sparse bitmap per zoom level, a bit
+ * per tile in blocks of 8x8 tiles, which answers osm_tile_index_contains()
+ * and counts the tiles of a region without visiting them one by one.
+ *
+ * The index is kept in memory, with the tiles in a binary heap ordered by
+ * the time they were last used, so that touching, adding or evicting a
+ * tile costs O(log n) whatever the size of the cache.
+ *
+ * It is saved to a sidecar file, one "zoom/x/y size atime fetched expires
+ * last-modified etag" line per tile, times in seconds since the epoch, 0
+ * if unknown, and the ETag the rest of the line. A "-zoom/x/y" line
+ * records a removed tile. Saving only appends the lines of the tiles
+ * changed since the last save, later lines win when the file is loaded;
+ * the file is rewritten once it holds twice as many lines as there are
+ * tiles. A "#clean" line ends a file saved when the cache was closed; it
+ * is followed by an "#open" line as soon as the index is saved again.
+ *
+ * Before a tile is written, a "?zoom/x/y" line is appended for it with
+ * osm_tile_index_journal(), so that after a crash the tiles written since
+ * the last save are known without walking the cache: they are the tiles
+ * of the "?" lines not followed by a line of their own (see
+ * osm_tile_index_load()).
+ *
+ * It is updated by the threads reading and writing tiles, so all
+ * functions take a lock, but never for longer than INDEX_CHUNK tiles.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "tile-cache.h"
+#include "tile-index.h"
+
+/* tiles handled at a time with the lock held when saving or loading */
+#define INDEX_CHUNK         1024
+/* lines the file may hold beyond twice the number of tiles before it is
+ * rewritten */
+#define INDEX_SLACK         4096
+
+/* the bit of a tile in the block of 8x8 tiles holding it */
+#define BLOCK_KEY(key)      OSM_TILE_KEY (0, OSM_TILE_KEY_ZOOM (key), \
+                                          OSM_TILE_KEY_X (key) >> 3, OSM_TILE_KEY_Y (key) >> 3)
+#define BLOCK_BIT(key)      (G_GUINT64_CONSTANT (1) << \
+                             ((OSM_TILE_KEY_Y (key) & 7) * 8 + (OSM_TILE_KEY_X (key) & 7)))
+
+typedef struct {
+    guint64 key;
+    /* a bit per tile, row by row */
+    guint64 bits;
+} OsmTileIndexBlock;
+
+typedef struct {
+    guint64 key;
+    guint64 size;
+    gint64 atime;
+    OsmTileMeta meta;
+    /* the position of the entry in the heap */
+    guint pos;
+} OsmTileIndexEntry;
+
+struct _OsmTileIndex
+{
+    GMutex lock;
+    /* the key of the entry to the entry */
+    GHashTable *entries;
+    /* the entries, the least recently used first */
+    GPtrArray *heap;
+    /* the block key to the OsmTileIndexBlock of the existing tiles */
+    GHashTable *blocks;
+    guint64 bytes;
+    /* keys (allocated) of the tiles changed or removed since the last
+     * save */
+    GHashTable *changed;
+    /* keys (allocated) of the tiles with a "?" line since the last save */
+    GHashTable *journaled;
+    /* the lines in the file when it was last loaded or saved */
+    guint lines;
+    /* whether the file ends with a "#clean" line */
+    gboolean clean;
+};
+
+static void
+osm_tile_index_entry_free (OsmTileIndexEntry *entry)
+{
+    g_free (entry->meta.etag);
+    g_free (entry);
+}
+
+OsmTileIndex *
+osm_tile_index_new (void)
+{
+    OsmTileIndex *index = g_new0 (OsmTileIndex, 1);
+
+    g_mutex_init (&index->lock);
+    index->entries = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                            NULL, (GDestroyNotify)osm_tile_index_entry_free);
+    index->heap = g_ptr_array_new ();
+    index->blocks = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL, g_free);
+    index->changed = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+    index->journaled = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+    return index;
+}
+
+void
+osm_tile_index_free (OsmTileIndex *index)
+{
+    g_ptr_array_free (index->heap, TRUE);
+    g_hash_table_destroy (index->entries);
+    g_hash_table_destroy (index->blocks);
+    g_hash_table_destroy (index->changed);
+    g_hash_table_destroy (index->journaled);
+    g_mutex_clear (&index->lock);
+    g_free (index);
+}
+
+#define HEAP_ENTRY(index, i) ((OsmTileIndexEntry *)(index)->heap->pdata[i])
+
+/* The heap functions must be called with the lock held */
+static void
+osm_tile_index_heap_set (OsmTileIndex *index, guint pos, OsmTileIndexEntry *entry)
+{
+    index->heap->pdata[pos] = entry;
+    entry->pos = pos;
+}
+
+static void
+osm_tile_index_heap_up (OsmTileIndex *index, OsmTileIndexEntry *entry)
+{
+    guint pos = entry->pos;
+
+    while (pos > 0 && HEAP_ENTRY (index, (pos - 1) / 2)->atime > entry->atime) {
+        osm_tile_index_heap_set (index, pos, HEAP_ENTRY (index, (pos - 1) / 2));
+        pos = (pos - 1) / 2;
+    }
+    osm_tile_index_heap_set (index, pos, entry);
+}
+
+static void
+osm_tile_index_heap_down (OsmTileIndex *index, OsmTileIndexEntry *entry)
+{
+    guint pos = entry->pos;
+    guint child;
+
+    while ((child = 2 * pos + 1) < index->heap->len) {
+        if (child + 1 < index->heap->len &&
+            HEAP_ENTRY (index, child + 1)->atime < HEAP_ENTRY (index, child)->atime)
+            child++;
+        if (HEAP_ENTRY (index, child)->atime >= entry->atime)
+            break;
+        osm_tile_index_heap_set (index, pos, HEAP_ENTRY (index, child));
+        pos = child;
+    }
+    osm_tile_index_heap_set (index, pos, entry);
+}
+
+static void
+osm_tile_index_heap_remove (OsmTileIndex *index, OsmTileIndexEntry *entry)
+{
+    OsmTileIndexEntry *last = g_ptr_array_remove_index (index->heap, index->heap->len - 1);
+
+    if (last != entry) {
+        osm_tile_index_heap_set (index, entry->pos, last);
+        osm_tile_index_heap_up (index, last);
+        osm_tile_index_heap_down (index, last);
+    }
+}
+
+/* The block functions must be called with the lock held */
+static void
+osm_tile_index_block_add (OsmTileIndex *index, guint64 key)
+{
+    guint64 block_key = BLOCK_KEY (key);
+    OsmTileIndexBlock *block = g_hash_table_lookup (index->blocks, &block_key);
+
+    if (!block) {
+        block = g_new0 (OsmTileIndexBlock, 1);
+        block->key = block_key;
+        g_hash_table_insert (index->blocks, &block->key, block);
+    }
+    block->bits |= BLOCK_BIT (key);
+}
+
+static void
+osm_tile_index_block_remove (OsmTileIndex *index, guint64 key)
+{
+    guint64 block_key = BLOCK_KEY (key);
+    OsmTileIndexBlock *block = g_hash_table_lookup (index->blocks, &block_key);
+
+    if (block) {
+        block->bits &= ~BLOCK_BIT (key);
+        if (block->bits == 0)
+            g_hash_table_remove (index->blocks, &block_key);
+    }
+}
+
+/* Must be called with the lock held */
+static void
+osm_tile_index_mark_changed (OsmTileIndex *index, guint64 key)
+{
+    guint64 *changed;
+
+    if (!g_hash_table_contains (index->changed, &key)) {
+        changed = g_new (guint64, 1);
+        *changed = key;
+        g_hash_table_add (index->changed, changed);
+    }
+}
+
+/* Must be called with the lock held. A new entry is used now, so that it
+ * is not the first one evicted */
+static OsmTileIndexEntry *
+osm_tile_index_ensure (OsmTileIndex *index, guint64 key)
+{
+    OsmTileIndexEntry *entry = g_hash_table_lookup (index->entries, &key);
+
+    if (!entry) {
+        entry = g_new0 (OsmTileIndexEntry, 1);
+        entry->key = key;
+        entry->atime = g_get_real_time () / G_USEC_PER_SEC;
+        g_hash_table_insert (index->entries, &entry->key, entry);
+        g_ptr_array_add (index->heap, entry);
+        entry->pos = index->heap->len - 1;
+        osm_tile_index_heap_up (index, entry);
+        osm_tile_index_block_add (index, key);
+    }
+    return entry;
+}
+
+/* Must be called with the lock held */
+static OsmTileIndexEntry *
+osm_tile_index_set (OsmTileIndex *index, guint64 key, guint64 size, gint64 atime)
+{
+    OsmTileIndexEntry *entry = osm_tile_index_ensure (index, key);
+
+    index->bytes += size - entry->size;
+    entry->size = size;
+    if (entry->atime != atime) {
+        entry->atime = atime;
+        osm_tile_index_heap_up (index, entry);
+        osm_tile_index_heap_down (index, entry);
+    }
+
+    return entry;
+}
+
+/* Records a tile written at atime, or now if atime is 0 */
+void
+osm_tile_index_add (OsmTileIndex *index, guint64 key, gsize size, gint64 atime)
+{
+    if (atime == 0)
+        atime = g_get_real_time () / G_USEC_PER_SEC;
+
+    g_mutex_lock (&index->lock);
+    osm_tile_index_set (index, key, size, atime);
+    osm_tile_index_mark_changed (index, key);
+    g_mutex_unlock (&index->lock);
+}
+
+/* Records that a tile of the given size was read */
+void
+osm_tile_index_touch (OsmTileIndex *index, guint64 key, gsize size)
+{
+    gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+    OsmTileIndexEntry *entry;
+
+    g_mutex_lock (&index->lock);
+    entry = g_hash_table_lookup (index->entries, &key);
+    /* a tile read many times a minute is not worth saving every time */
+    if (!entry || entry->size != size || entry->atime < now - 60) {
+        osm_tile_index_set (index, key, size, now);
+        osm_tile_index_mark_changed (index, key);
+    }
+    g_mutex_unlock (&index->lock);
+}
+
+/* Must be called with the lock held */
+static void
+osm_tile_index_remove_entry (OsmTileIndex *index, OsmTileIndexEntry *entry)
+{
+    guint64 key = entry->key;
+
+    index->bytes -= entry->size;
+    osm_tile_index_heap_remove (index, entry);
+    osm_tile_index_block_remove (index, key);
+    g_hash_table_remove (index->entries, &key);
+    osm_tile_index_mark_changed (index, key);
+}
+
+void
+osm_tile_index_remove (OsmTileIndex *index, guint64 key)
+{
+    OsmTileIndexEntry *entry;
+
+    g_mutex_lock (&index->lock);
+    entry = g_hash_table_lookup (index->entries, &key);
+    if (entry)
+        osm_tile_index_remove_entry (index, entry);
+    g_mutex_unlock (&index->lock);
+}
+
+/* Removes the least recently used tiles until the rest take at most
+ * max_bytes, but no more than max_count of them, and returns their keys
+ * (guint64) */
+GArray *
+osm_tile_index_pop_oldest (OsmTileIndex *index, guint64 max_bytes, guint max_count)
+{
+    GArray *keys = g_array_new (FALSE, FALSE, sizeof (guint64));
+    OsmTileIndexEntry *oldest;
+
+    g_mutex_lock (&index->lock);
+    while (keys->len < max_count && index->bytes > max_bytes && index->heap->len > 0) {
+        oldest = HEAP_ENTRY (index, 0);
+        g_array_append_val (keys, oldest->key);
+        osm_tile_index_remove_entry (index, oldest);
+    }
+    g_mutex_unlock (&index->lock);
+
+    return keys;
+}
+
+/* Records the cache metadata of a tile */
+void
+osm_tile_index_set_meta (OsmTileIndex *index, guint64 key, const OsmTileMeta *meta)
+{
+    OsmTileIndexEntry *entry;
+
+    g_mutex_lock (&index->lock);
+    entry = osm_tile_index_ensure (index, key);
+    g_free (entry->meta.etag);
+    entry->meta = *meta;
+    entry->meta.etag = g_strdup (meta->etag);
+    osm_tile_index_mark_changed (index, key);
+    g_mutex_unlock (&index->lock);
+}
+
+/* Returns FALSE if the time the tile was fetched is not known. Otherwise
+ * the metadata is copied to meta, whose etag must be freed */
+gboolean
+osm_tile_index_get_meta (OsmTileIndex *index, guint64 key, OsmTileMeta *meta)
+{
+    OsmTileIndexEntry *entry;
+    gboolean found = FALSE;
+
+    g_mutex_lock (&index->lock);
+    entry = g_hash_table_lookup (index->entries, &key);
+    if (entry && entry->meta.fetched != 0) {
+        *meta = entry->meta;
+        meta->etag = g_strdup (entry->meta.etag);
+        found = TRUE;
+    }
+    g_mutex_unlock (&index->lock);
+
+    return found;
+}
+
+gboolean
+osm_tile_index_contains (OsmTileIndex *index, guint64 key)
+{
+    guint64 block_key = BLOCK_KEY (key);
+    OsmTileIndexBlock *block;
+    gboolean found;
+
+    g_mutex_lock (&index->lock);
+    block = g_hash_table_lookup (index->blocks, &block_key);
+    found = block && (block->bits & BLOCK_BIT (key));
+    g_mutex_unlock (&index->lock);
+
+    return found;
+}
+
+/* The bits of the tiles of the block bx,by in the region x1..x2, y1..y2 */
+static guint64
+osm_tile_index_block_mask (int bx, int by, int x1, int y1, int x2, int y2)
+{
+    guint64 mask = 0, row = 0;
+    int x, y;
+
+    for (x = MAX (x1, bx << 3); x <= MIN (x2, (bx << 3) + 7); x++)
+        row |= G_GUINT64_CONSTANT (1) << (x & 7);
+    for (y = MAX (y1, by << 3); y <= MIN (y2, (by << 3) + 7); y++)
+        mask |= row << ((y & 7) * 8);
+    return mask;
+}
+
+/* Calls func with the bits of the tiles of zoom in the region x1..x2,
+ * y1..y2 of every block holding some. Visits the blocks of the region, or
+ * all the blocks of the index if there are fewer, so that a large region
+ * costs no more than the tiles the index holds. Must be called with the
+ * lock held */
+static void
+osm_tile_index_foreach_block (OsmTileIndex *index, int zoom, int x1, int y1, int x2, int y2,
+                              void (*func) (guint64 block_key, guint64 bits, gpointer data),
+                              gpointer data)
+{
+    OsmTileIndexBlock *block;
+    GHashTableIter iter;
+    guint64 block_key, bits;
+    int bx, by;
+
+    if (x1 > x2 || y1 > y2)
+        return;
+    x1 = MAX (x1, 0);
+    y1 = MAX (y1, 0);
+
+    if ((guint64)((x2 >> 3) - (x1 >> 3) + 1) * (guint64)((y2 >> 3) - (y1 >> 3) + 1) >
+        g_hash_table_size (index->blocks)) {
+        g_hash_table_iter_init (&iter, index->blocks);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&block)) {
+            bx = OSM_TILE_KEY_X (block->key);
+            by = OSM_TILE_KEY_Y (block->key);
+            if (OSM_TILE_KEY_ZOOM (block->key) != zoom ||
+                bx < x1 >> 3 || bx > x2 >> 3 || by < y1 >> 3 || by > y2 >> 3)
+                continue;
+            bits = block->bits & osm_tile_index_block_mask (bx, by, x1, y1, x2, y2);
+            if (bits)
+                func (block->key, bits, data);
+        }
+        return;
+    }
+
+    for (bx = x1 >> 3; bx <= x2 >> 3; bx++) {
+        for (by = y1 >> 3; by <= y2 >> 3; by++) {
+            block_key = OSM_TILE_KEY (0, zoom, bx, by);
+            block = g_hash_table_lookup (index->blocks, &block_key);
+            if (!block)
+                continue;
+            bits = block->bits & osm_tile_index_block_mask (bx, by, x1, y1, x2, y2);
+            if (bits)
+                func (block->key, bits, data);
+        }
+    }
+}
+
+static void
+osm_tile_index_count_block (guint64 block_key, guint64 bits, gpointer data)
+{
+    guint *count = data;
+
+    for (; bits != 0; bits &= bits - 1)
+        (*count)++;
+}
+
+/* Returns the number of tiles of zoom in the region x1..x2, y1..y2 */
+guint
+osm_tile_index_count (OsmTileIndex *index, int zoom, int x1, int y1, int x2, int y2)
+{
+    guint count = 0;
+
+    g_mutex_lock (&index->lock);
+    osm_tile_index_foreach_block (index, zoom, x1, y1, x2, y2,
+                                  osm_tile_index_count_block, &count);
+    g_mutex_unlock (&index->lock);
+
+    return count;
+}
+
+static void
+osm_tile_index_list_block (guint64 block_key, guint64 bits, gpointer data)
+{
+    GArray *keys = data;
+    guint64 key;
+    int bit;
+
+    for (bit = 0; bit < 64; bit++) {
+        if (!(bits & (G_GUINT64_CONSTANT (1) << bit)))
+            continue;
+        key = OSM_TILE_KEY (0, OSM_TILE_KEY_ZOOM (block_key),
+                            (OSM_TILE_KEY_X (block_key) << 3) + (bit & 7),
+                            (OSM_TILE_KEY_Y (block_key) << 3) + (bit >> 3));
+        g_array_append_val (keys, key);
+    }
+}
+
+/* Appends the keys (guint64) of the tiles of zoom in the region x1..x2,
+ * y1..y2 to keys, in no particular order */
+void
+osm_tile_index_list (OsmTileIndex *index, int zoom, int x1, int y1, int x2, int y2,
+                     GArray *keys)
+{
+    g_mutex_lock (&index->lock);
+    osm_tile_index_foreach_block (index, zoom, x1, y1, x2, y2,
+                                  osm_tile_index_list_block, keys);
+    g_mutex_unlock (&index->lock);
+}
+
+guint64
+osm_tile_index_get_bytes (OsmTileIndex *index)
+{
+    guint64 bytes;
+
+    g_mutex_lock (&index->lock);
+    bytes = index->bytes;
+    g_mutex_unlock (&index->lock);
+
+    return bytes;
+}
+
+guint
+osm_tile_index_get_size (OsmTileIndex *index)
+{
+    guint size;
+
+    g_mutex_lock (&index->lock);
+    size = g_hash_table_size (index->entries);
+    g_mutex_unlock (&index->lock);
+
+    return size;
+}
+
+/* Adds the line of a tile to the index. Must be called with the lock
+ * held */
+static void
+osm_tile_index_load_line (OsmTileIndex *index, guint64 key, const gchar *line)
+{
+    OsmTileIndexEntry *entry;
+    guint64 size;
+    gint64 atime;
+    OsmTileMeta meta;
+    int n = 0;
+
+    if (sscanf (line, "%*s %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT, &size, &atime) != 2)
+        return;
+
+    entry = osm_tile_index_set (index, key, size, atime);
+    if (sscanf (line, "%*s %*s %*s %" G_GINT64_FORMAT " %" G_GINT64_FORMAT
+                " %" G_GINT64_FORMAT " %n",
+                &meta.fetched, &meta.expires, &meta.last_modified, &n) == 3) {
+        entry->meta.fetched = meta.fetched;
+        entry->meta.expires = meta.expires;
+        entry->meta.last_modified = meta.last_modified;
+        if (n > 0 && line[n] != '\0')
+            entry->meta.etag = g_strdup (line + n);
+    }
+}
+
+/* Adds the tiles saved in filename, except those already known. Returns
+ * FALSE if there is no such file. Otherwise unsure is set to the keys
+ * (guint64) of the tiles which may have been written or removed since the
+ * file was last saved, if the cache was not closed cleanly: whether they
+ * are on disk is not known */
+gboolean
+osm_tile_index_load (OsmTileIndex *index, const gchar *filename, GArray **unsure)
+{
+    GHashTable *latest, *journaled;
+    GHashTableIter iter;
+    gchar *contents;
+    gchar **lines;
+    const gchar *line;
+    guint64 *key;
+    guint n_lines = 0, n = 0;
+    gboolean ends_clean = FALSE;
+    int i, zoom, x, y;
+
+    *unsure = NULL;
+    if (!g_file_get_contents (filename, &contents, NULL, NULL))
+        return FALSE;
+
+    lines = g_strsplit (contents, "\n", -1);
+    g_free (contents);
+
+    /* the last line of each tile, without the lock, and the tiles whose
+     * last line is a "?" one */
+    latest = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+    journaled = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+    for (i = 0; lines[i] != NULL; i++) {
+        line = lines[i];
+        if (line[0] == '\0')
+            continue;
+        n_lines++;
+        ends_clean = strcmp (line, "#clean") == 0;
+        /* everything written before was saved */
+        if (ends_clean)
+            g_hash_table_remove_all (journaled);
+        if (sscanf (line[0] == '-' || line[0] == '?' ? line + 1 : line,
+                    "%d/%d/%d", &zoom, &x, &y) != 3)
+            continue;
+        key = g_new (guint64, 1);
+        *key = OSM_TILE_KEY (0, zoom, x, y);
+        if (line[0] == '?') {
+            g_hash_table_add (journaled, key);
+            continue;
+        }
+        g_hash_table_remove (journaled, key);
+        if (line[0] == '-') {
+            g_hash_table_remove (latest, key);
+            g_free (key);
+        } else {
+            g_hash_table_insert (latest, key, (gpointer)line);
+        }
+    }
+
+    *unsure = g_array_sized_new (FALSE, FALSE, sizeof (guint64),
+                                 g_hash_table_size (journaled));
+    g_hash_table_iter_init (&iter, journaled);
+    while (g_hash_table_iter_next (&iter, (gpointer *)&key, NULL))
+        g_array_append_val (*unsure, *key);
+    g_hash_table_destroy (journaled);
+
+    g_mutex_lock (&index->lock);
+    g_hash_table_iter_init (&iter, latest);
+    while (g_hash_table_iter_next (&iter, (gpointer *)&key, (gpointer *)&line)) {
+        if (!g_hash_table_contains (index->entries, key))
+            osm_tile_index_load_line (index, *key, line);
+        /* let the readers in */
+        if (++n % INDEX_CHUNK == 0) {
+            g_mutex_unlock (&index->lock);
+            g_mutex_lock (&index->lock);
+        }
+    }
+    index->lines = n_lines;
+    index->clean = ends_clean;
+    g_debug ("Loaded %u tiles, %" G_GUINT64_FORMAT " bytes from %s",
+             g_hash_table_size (index->entries), index->bytes, filename);
+    g_mutex_unlock (&index->lock);
+
+    g_hash_table_destroy (latest);
+    g_strfreev (lines);
+
+    return TRUE;
+}
+
+/* Whether the tile has a "?" line since the index was last saved */
+gboolean
+osm_tile_index_is_journaled (OsmTileIndex *index, guint64 key)
+{
+    gboolean journaled;
+
+    g_mutex_lock (&index->lock);
+    journaled = g_hash_table_contains (index->journaled, &key);
+    g_mutex_unlock (&index->lock);
+
+    return journaled;
+}
+
+static gboolean osm_tile_index_append (const gchar *filename, const GString *contents,
+                                       GError **error);
+
+/* Appends a "?" line to filename for each of the tiles of keys about to
+ * be written, unless it already has one since the last save */
+gboolean
+osm_tile_index_journal (OsmTileIndex *index, const gchar *filename,
+                        const guint64 *keys, guint n_keys)
+{
+    GString *contents = g_string_new (NULL);
+    GError *error = NULL;
+    guint64 *journaled;
+    guint i, lines = 0;
+    gboolean ok = TRUE;
+
+    g_mutex_lock (&index->lock);
+    for (i = 0; i < n_keys; i++) {
+        if (g_hash_table_contains (index->journaled, &keys[i]))
+            continue;
+        journaled = g_new (guint64, 1);
+        *journaled = keys[i];
+        g_hash_table_add (index->journaled, journaled);
+        g_string_append_printf (contents, "?%d/%d/%d\n",
+                                OSM_TILE_KEY_ZOOM (keys[i]),
+                                OSM_TILE_KEY_X (keys[i]),
+                                OSM_TILE_KEY_Y (keys[i]));
+        lines++;
+    }
+    g_mutex_unlock (&index->lock);
+
+    if (lines > 0)
+        ok = osm_tile_index_append (filename, contents, &error);
+
+    g_mutex_lock (&index->lock);
+    if (ok) {
+        index->lines += lines;
+        /* the file no longer ends with "#clean" */
+        index->clean = index->clean && lines == 0;
+    }
+    g_mutex_unlock (&index->lock);
+
+    if (!ok) {
+        g_warning ("Error saving tile index: %s", error->message);
+        g_error_free (error);
+    }
+    g_string_free (contents, TRUE);
+
+    return ok;
+}
+
+/* Appends the lines of the tiles of keys to contents, taking the lock for
+ * INDEX_CHUNK tiles at a time. Removed tiles get a removal line if
+ * removals is set. Returns the number of lines */
+static guint
+osm_tile_index_format (OsmTileIndex *index, const guint64 *keys, guint n_keys,
+                       gboolean removals, GString *contents)
+{
+    OsmTileIndexEntry *entry;
+    guint i, lines = 0;
+
+    for (i = 0; i < n_keys; i++) {
+        if (i % INDEX_CHUNK == 0)
+            g_mutex_lock (&index->lock);
+
+        entry = g_hash_table_lookup (index->entries, &keys[i]);
+        if (entry) {
+            g_string_append_printf (contents, "%d/%d/%d %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT
+                                    " %" G_GINT64_FORMAT " %" G_GINT64_FORMAT " %" G_GINT64_FORMAT
+                                    " %s\n",
+                                    OSM_TILE_KEY_ZOOM (entry->key),
+                                    OSM_TILE_KEY_X (entry->key),
+                                    OSM_TILE_KEY_Y (entry->key),
+                                    entry->size,
+                                    entry->atime,
+                                    entry->meta.fetched,
+                                    entry->meta.expires,
+                                    entry->meta.last_modified,
+                                    entry->meta.etag ? entry->meta.etag : "");
+            lines++;
+        } else if (removals) {
+            g_string_append_printf (contents, "-%d/%d/%d\n",
+                                    OSM_TILE_KEY_ZOOM (keys[i]),
+                                    OSM_TILE_KEY_X (keys[i]),
+                                    OSM_TILE_KEY_Y (keys[i]));
+            lines++;
+        }
+
+        if (i % INDEX_CHUNK == INDEX_CHUNK - 1 || i == n_keys - 1)
+            g_mutex_unlock (&index->lock);
+    }
+
+    return lines;
+}
+
+static gboolean
+osm_tile_index_append (const gchar *filename, const GString *contents, GError **error)
+{
+    FILE *file;
+    gboolean ok;
+
+    file = g_fopen (filename, "ab");
+    if (!file) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "Could not open %s", filename);
+        return FALSE;
+    }
+    ok = fwrite (contents->str, 1, contents->len, file) == contents->len;
+    if (fclose (file) != 0)
+        ok = FALSE;
+    if (!ok)
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_IO, "Could not write %s", filename);
+    return ok;
+}
+
+/* Saves the changes to the index since it was loaded or last saved to
+ * filename, appending them or, if the file has grown too much, writing
+ * it again. clean is set when the cache is closed, nothing being written
+ * to it afterwards */
+gboolean
+osm_tile_index_save (OsmTileIndex *index, const gchar *filename, gboolean clean)
+{
+    GHashTable *changed;
+    GHashTableIter iter;
+    GArray *keys;
+    GString *contents;
+    GError *error = NULL;
+    guint64 *key;
+    gboolean rewrite, was_clean, ok;
+    guint i, lines;
+
+    g_mutex_lock (&index->lock);
+    was_clean = index->clean;
+    changed = index->changed;
+    index->changed = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+    /* the tiles written from now on get a "?" line again, which a
+     * rewrite drops and the lines saved here resolve */
+    g_hash_table_remove_all (index->journaled);
+    rewrite = index->lines + g_hash_table_size (changed) >
+        2 * g_hash_table_size (index->entries) + INDEX_SLACK;
+    keys = g_array_sized_new (FALSE, FALSE, sizeof (guint64),
+                              rewrite ? g_hash_table_size (index->entries) :
+                                        g_hash_table_size (changed));
+    if (rewrite) {
+        /* a copy of the keys, the only pass over the whole index with
+         * the lock held; the tiles are formatted without it */
+        for (i = 0; i < index->heap->len; i++)
+            g_array_append_val (keys, HEAP_ENTRY (index, i)->key);
+    }
+    g_mutex_unlock (&index->lock);
+
+    if (!rewrite) {
+        if (g_hash_table_size (changed) == 0 && clean == was_clean) {
+            g_hash_table_destroy (changed);
+            g_array_free (keys, TRUE);
+            return TRUE;
+        }
+        g_hash_table_iter_init (&iter, changed);
+        while (g_hash_table_iter_next (&iter, (gpointer *)&key, NULL))
+            g_array_append_val (keys, *key);
+    }
+
+    contents = g_string_sized_new (keys->len * 48);
+    lines = osm_tile_index_format (index, (const guint64 *)keys->data, keys->len,
+                                   !rewrite, contents);
+    if (clean || (was_clean && !rewrite)) {
+        g_string_append (contents, clean ? "#clean\n" : "#open\n");
+        lines++;
+    }
+    if (rewrite)
+        ok = g_file_set_contents (filename, contents->str, contents->len, &error);
+    else
+        ok = osm_tile_index_append (filename, contents, &error);
+
+    g_mutex_lock (&index->lock);
+    if (ok) {
+        index->lines = rewrite ? lines : index->lines + lines;
+        index->clean = clean;
+    } else {
+        /* saved again the next time */
+        g_hash_table_iter_init (&iter, changed);
+        while (g_hash_table_iter_next (&iter, (gpointer *)&key, NULL))
+            osm_tile_index_mark_changed (index, *key);
+    }
+    g_mutex_unlock (&index->lock);
+
+    if (!ok) {
+        g_warning ("Error saving tile index: %s", error->message);
+        g_error_free (error);
+    }
+    g_string_free (contents, TRUE);
+    g_array_free (keys, TRUE);
+    g_hash_table_destroy (changed);
+
+    return ok;
+}
@@ -0,0 +1,57 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __TILE_INDEX_H__
+#define __TILE_INDEX_H__
+
+#include <glib.h>
+
+typedef struct _OsmTileIndex OsmTileIndex;
+
+/* HTTP cache metadata of a tile, times in seconds since the epoch */
+typedef struct {
+    /* when the tile was downloaded or last revalidated */
+    gint64 fetched;
+    /* when it becomes stale, 0 if the server did not say */
+    gint64 expires;
+    /* the validators, 0 and NULL if there are none */
+    gint64 last_modified;
+    gchar *etag;
+} OsmTileMeta;
+
+OsmTileIndex   *osm_tile_index_new              (void);
+void            osm_tile_index_free             (OsmTileIndex *index);
+void            osm_tile_index_add              (OsmTileIndex *index, guint64 key, gsize size, gint64 atime);
+void            osm_tile_index_touch            (OsmTileIndex *index, guint64 key, gsize size);
+void            osm_tile_index_remove           (OsmTileIndex *index, guint64 key);
+void            osm_tile_index_set_meta         (OsmTileIndex *index, guint64 key, const OsmTileMeta *meta);
+gboolean        osm_tile_index_get_meta         (OsmTileIndex *index, guint64 key, OsmTileMeta *meta);
+GArray         *osm_tile_index_pop_oldest       (OsmTileIndex *index, guint64 max_bytes, guint max_count);
+gboolean        osm_tile_index_contains         (OsmTileIndex *index, guint64 key);
+guint           osm_tile_index_count            (OsmTileIndex *index, int zoom, int x1, int y1, int x2, int y2);
+void            osm_tile_index_list             (OsmTileIndex *index, int zoom, int x1, int y1, int x2, int y2, GArray *keys);
+guint64         osm_tile_index_get_bytes        (OsmTileIndex *index);
+guint           osm_tile_index_get_size         (OsmTileIndex *index);
+gboolean        osm_tile_index_load             (OsmTileIndex *index, const gchar *filename, GArray **unsure);
+gboolean        osm_tile_index_save             (OsmTileIndex *index, const gchar *filename, gboolean clean);
+gboolean        osm_tile_index_is_journaled     (OsmTileIndex *index, guint64 key);
+gboolean        osm_tile_index_journal          (OsmTileIndex *index, const gchar *filename, const guint64 *keys, guint n_keys);
+
+#endif /* __TILE_INDEX_H__ */
@@ -0,0 +1,870 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Read-only access to the tiles of a PMTiles (version 3) archive, a
+ * single file holding a whole tileset, see
+ * https://github.com/protomaps/PMTiles/blob/main/spec/v3/spec.md
+ *
+ * The archive is memory mapped, and uncompressed tiles are returned
+ * without copying them. Tiles are numbered along a Hilbert curve, zoom
+ * level after zoom level, and found by a binary search in the root
+ * directory, read when the archive is opened, then in at most a few leaf
+ * directories. The last DIR_CACHE_SIZE leaf directories used are kept
+ * decoded, so a lookup takes O(log n) without reading the directories
+ * again.
+ *
+ * Lookups may come from any thread.
+ *
+ * OsmTilePmtilesWriter writes such archives. The tile data is written as
+ * it comes, from DATA_OFFSET, and the directories when all tiles are
+ * known: the root right after the header, split into leaf directories
+ * (after the tile data) if it would not fit in the space left before
+ * DATA_OFFSET. Identical tiles are stored once, and consecutive ones
+ * share a single directory entry.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "tile-dedup.h"
+#include "tile-pmtiles.h"
+
+#define HEADER_SIZE     127
+/* leaf directories kept decoded */
+#define DIR_CACHE_SIZE  64
+/* the spec allows a root and three levels of leaves */
+#define MAX_DEPTH       4
+/* where written archives start the tile data, the root directory must
+ * be within the first 16 KiB */
+#define DATA_OFFSET     16384
+/* entries per leaf directory written, at least */
+#define LEAF_SIZE       4096
+
+enum {
+    COMPRESSION_UNKNOWN = 0,
+    COMPRESSION_NONE = 1,
+    COMPRESSION_GZIP = 2
+};
+
+typedef struct {
+    guint64 tile_id;
+    guint64 offset;
+    guint32 length;
+    /* tiles sharing the data, 0 for a leaf directory */
+    guint32 run_length;
+} OsmPmtilesEntry;
+
+typedef struct {
+    OsmPmtilesEntry *entries;
+    guint n_entries;
+    /* for evicting the least recently used leaf directories */
+    guint64 used;
+} OsmPmtilesDir;
+
+struct _OsmTilePmtiles
+{
+    GMappedFile *file;
+    const guchar *data;
+    gsize size;
+    gchar *path;
+    /* the file extension of the tile type, NULL for vector tiles */
+    const gchar *format;
+    guint8 internal_compression;
+    guint8 tile_compression;
+    guint64 leaf_offset;
+    guint64 tile_data_offset;
+    /* 0 if unknown */
+    guint64 n_tiles;
+    OsmPmtilesDir *root;
+    /* offset of the leaf directory to the decoded directory, protected
+     * by lock */
+    GHashTable *leaves;
+    guint64 clock;
+    GMutex lock;
+};
+
+static void
+osm_pmtiles_dir_free (OsmPmtilesDir *dir)
+{
+    g_free (dir->entries);
+    g_free (dir);
+}
+
+static guint64
+osm_pmtiles_read_uint64 (const guchar *p)
+{
+    guint64 value = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+/* Reads a varint, returns FALSE if it does not end before end */
+static gboolean
+osm_pmtiles_read_varint (const guchar **p, const guchar *end, guint64 *value)
+{
+    int shift;
+
+    *value = 0;
+    for (shift = 0; *p < end && shift < 64; shift += 7) {
+        guchar byte = *(*p)++;
+
+        *value |= (guint64)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Returns whether the range lies within the archive */
+static gboolean
+osm_pmtiles_in_range (OsmTilePmtiles *pmtiles, guint64 offset, guint64 length)
+{
+    return offset <= pmtiles->size && length <= pmtiles->size - offset;
+}
+
+/* Returns the bytes at offset, decompressed, or NULL if they cannot be */
+static GBytes *
+osm_pmtiles_get_bytes (OsmTilePmtiles *pmtiles, guint64 offset, guint64 length,
+                       guint8 compression)
+{
+    GConverter *converter;
+    GByteArray *out;
+    const guchar *in;
+    gsize in_len, bytes_read, bytes_written;
+    guchar buf[16384];
+    GConverterResult result;
+    GError *error = NULL;
+
+    if (!osm_pmtiles_in_range (pmtiles, offset, length))
+        return NULL;
+
+    if (compression == COMPRESSION_NONE || compression == COMPRESSION_UNKNOWN)
+        return g_bytes_new_with_free_func (pmtiles->data + offset, length,
+                                           (GDestroyNotify)g_mapped_file_unref,
+                                           g_mapped_file_ref (pmtiles->file));
+    if (compression != COMPRESSION_GZIP)
+        return NULL;
+
+    converter = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+    out = g_byte_array_new ();
+    in = pmtiles->data + offset;
+    in_len = length;
+    do {
+        result = g_converter_convert (converter, in, in_len, buf, sizeof (buf),
+                                      G_CONVERTER_INPUT_AT_END,
+                                      &bytes_read, &bytes_written, &error);
+        if (result == G_CONVERTER_ERROR || (bytes_read == 0 && bytes_written == 0 &&
+                                            result != G_CONVERTER_FINISHED)) {
+            g_warning ("Error decompressing %s at %" G_GUINT64_FORMAT ": %s",
+                       pmtiles->path, offset, error ? error->message : "no progress");
+            g_clear_error (&error);
+            g_byte_array_free (out, TRUE);
+            g_object_unref (converter);
+            return NULL;
+        }
+        g_byte_array_append (out, buf, bytes_written);
+        in += bytes_read;
+        in_len -= bytes_read;
+    } while (result != G_CONVERTER_FINISHED);
+    g_object_unref (converter);
+
+    return g_byte_array_free_to_bytes (out);
+}
+
+/* Decodes the directory at offset, or returns NULL if it is invalid */
+static OsmPmtilesDir *
+osm_pmtiles_dir_new (OsmTilePmtiles *pmtiles, guint64 offset, guint64 length)
+{
+    OsmPmtilesDir *dir;
+    GBytes *bytes;
+    const guchar *p, *end;
+    guint64 n, value, tile_id = 0;
+    gsize len;
+    guint i;
+
+    bytes = osm_pmtiles_get_bytes (pmtiles, offset, length,
+                                   pmtiles->internal_compression);
+    if (!bytes)
+        return NULL;
+    p = g_bytes_get_data (bytes, &len);
+    end = p + len;
+
+    /* every entry takes at least four bytes */
+    if (!osm_pmtiles_read_varint (&p, end, &n) || n > (guint64)(end - p) / 4) {
+        g_bytes_unref (bytes);
+        return NULL;
+    }
+
+    dir = g_new0 (OsmPmtilesDir, 1);
+    dir->n_entries = n;
+    dir->entries = g_new0 (OsmPmtilesEntry, n);
+
+    /* the columns of the entries follow each other */
+    for (i = 0; i < n; i++) {
+        if (!osm_pmtiles_read_varint (&p, end, &value))
+            goto invalid;
+        tile_id += value;
+        dir->entries[i].tile_id = tile_id;
+    }
+    for (i = 0; i < n; i++) {
+        if (!osm_pmtiles_read_varint (&p, end, &value))
+            goto invalid;
+        dir->entries[i].run_length = value;
+    }
+    for (i = 0; i < n; i++) {
+        if (!osm_pmtiles_read_varint (&p, end, &value))
+            goto invalid;
+        dir->entries[i].length = value;
+    }
+    for (i = 0; i < n; i++) {
+        if (!osm_pmtiles_read_varint (&p, end, &value))
+            goto invalid;
+        /* 0 means right after the previous entry */
+        if (value == 0 && i > 0)
+            dir->entries[i].offset = dir->entries[i - 1].offset + dir->entries[i - 1].length;
+        else
+            dir->entries[i].offset = value - 1;
+    }
+    g_bytes_unref (bytes);
+
+    return dir;
+
+invalid:
+    g_warning ("Invalid directory in %s at %" G_GUINT64_FORMAT, pmtiles->path, offset);
+    osm_pmtiles_dir_free (dir);
+    g_bytes_unref (bytes);
+    return NULL;
+}
+
+/* Returns the leaf directory at offset (relative to the leaf directories),
+ * decoding it if it is not cached. Must be called with the lock held */
+static OsmPmtilesDir *
+osm_pmtiles_get_leaf (OsmTilePmtiles *pmtiles, guint64 offset, guint64 length)
+{
+    OsmPmtilesDir *dir;
+    guint64 *key;
+
+    dir = g_hash_table_lookup (pmtiles->leaves, &offset);
+    if (!dir) {
+        dir = osm_pmtiles_dir_new (pmtiles, pmtiles->leaf_offset + offset, length);
+        if (!dir)
+            return NULL;
+
+        if (g_hash_table_size (pmtiles->leaves) >= DIR_CACHE_SIZE) {
+            GHashTableIter iter;
+            gpointer oldest_key = NULL, k;
+            OsmPmtilesDir *d;
+            guint64 oldest = G_MAXUINT64;
+
+            g_hash_table_iter_init (&iter, pmtiles->leaves);
+            while (g_hash_table_iter_next (&iter, &k, (gpointer *)&d)) {
+                if (d->used < oldest) {
+                    oldest = d->used;
+                    oldest_key = k;
+                }
+            }
+            g_hash_table_remove (pmtiles->leaves, oldest_key);
+        }
+
+        key = g_new (guint64, 1);
+        *key = offset;
+        g_hash_table_insert (pmtiles->leaves, key, dir);
+    }
+    dir->used = ++pmtiles->clock;
+
+    return dir;
+}
+
+/* Returns the entry with the greatest tile id not above tile_id, or NULL */
+static const OsmPmtilesEntry *
+osm_pmtiles_dir_find (const OsmPmtilesDir *dir, guint64 tile_id)
+{
+    guint low = 0, high = dir->n_entries;
+
+    /* the first entry above tile_id is at high */
+    while (low < high) {
+        guint mid = low + (high - low) / 2;
+
+        if (dir->entries[mid].tile_id <= tile_id)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return high > 0 ? &dir->entries[high - 1] : NULL;
+}
+
+/* The position of the tile along the Hilbert curves of the zoom levels */
+guint64
+osm_tile_pmtiles_tile_id (int zoom, guint64 x, guint64 y)
+{
+    guint64 n = (guint64)1 << zoom;
+    guint64 id = (((guint64)1 << (2 * zoom)) - 1) / 3;
+    guint64 s, rx, ry, t;
+
+    for (s = n / 2; s > 0; s /= 2) {
+        rx = (x & s) != 0;
+        ry = (y & s) != 0;
+        id += s * s * ((3 * rx) ^ ry);
+        /* rotates the quadrant */
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return id;
+}
+
+/* The tile at a position, the reverse of osm_tile_pmtiles_tile_id() */
+static void
+osm_pmtiles_tile_zxy (guint64 tile_id, int *zoom, guint64 *x, guint64 *y)
+{
+    guint64 first = 0, n, d, s, rx, ry, t;
+    int z;
+
+    for (z = 0; z < 31; z++) {
+        n = (guint64)1 << (2 * z);
+        if (tile_id < first + n)
+            break;
+        first += n;
+    }
+
+    d = tile_id - first;
+    n = (guint64)1 << z;
+    *x = *y = 0;
+    for (s = 1; s < n; s *= 2) {
+        rx = 1 & (d / 2);
+        ry = 1 & (d ^ rx);
+        if (ry == 0) {
+            if (rx == 1) {
+                *x = s - 1 - *x;
+                *y = s - 1 - *y;
+            }
+            t = *x;
+            *x = *y;
+            *y = t;
+        }
+        *x += s * rx;
+        *y += s * ry;
+        d /= 4;
+    }
+    *zoom = z;
+}
+
+/* Finds the data of a tile, returns FALSE if it is not in the archive */
+static gboolean
+osm_pmtiles_lookup (OsmTilePmtiles *pmtiles, int zoom, int x, int y,
+                    guint64 *offset, guint32 *length)
+{
+    const OsmPmtilesEntry *entry;
+    OsmPmtilesDir *dir;
+    guint64 tile_id;
+    gboolean found = FALSE;
+    int depth;
+
+    if (zoom < 0 || zoom > 26 || x < 0 || y < 0 || x >= (1 << zoom) || y >= (1 << zoom))
+        return FALSE;
+    tile_id = osm_tile_pmtiles_tile_id (zoom, x, y);
+
+    g_mutex_lock (&pmtiles->lock);
+    dir = pmtiles->root;
+    for (depth = 0; dir && depth < MAX_DEPTH; depth++) {
+        entry = osm_pmtiles_dir_find (dir, tile_id);
+        if (!entry)
+            break;
+        if (entry->run_length > 0) {
+            if (tile_id - entry->tile_id < entry->run_length) {
+                *offset = pmtiles->tile_data_offset + entry->offset;
+                *length = entry->length;
+                found = TRUE;
+            }
+            break;
+        }
+        dir = osm_pmtiles_get_leaf (pmtiles, entry->offset, entry->length);
+    }
+    g_mutex_unlock (&pmtiles->lock);
+
+    return found;
+}
+
+/* Opens the archive, returns NULL if it cannot be read */
+OsmTilePmtiles *
+osm_tile_pmtiles_open (const gchar *path)
+{
+    OsmTilePmtiles *pmtiles;
+    GMappedFile *file;
+    const guchar *header;
+    GError *error = NULL;
+
+    g_return_val_if_fail (path != NULL, NULL);
+
+    file = g_mapped_file_new (path, FALSE, &error);
+    if (!file) {
+        g_warning ("Could not open PMTiles archive %s: %s", path, error->message);
+        g_error_free (error);
+        return NULL;
+    }
+
+    header = (const guchar *)g_mapped_file_get_contents (file);
+    if (g_mapped_file_get_length (file) < HEADER_SIZE ||
+        memcmp (header, "PMTiles", 7) != 0 || header[7] != 3) {
+        g_warning ("%s is not a PMTiles version 3 archive", path);
+        g_mapped_file_unref (file);
+        return NULL;
+    }
+
+    pmtiles = g_new0 (OsmTilePmtiles, 1);
+    pmtiles->file = file;
+    pmtiles->data = header;
+    pmtiles->size = g_mapped_file_get_length (file);
+    pmtiles->path = g_strdup (path);
+    pmtiles->leaf_offset = osm_pmtiles_read_uint64 (header + 40);
+    pmtiles->tile_data_offset = osm_pmtiles_read_uint64 (header + 56);
+    pmtiles->n_tiles = osm_pmtiles_read_uint64 (header + 72);
+    pmtiles->internal_compression = header[97];
+    pmtiles->tile_compression = header[98];
+    pmtiles->leaves = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free,
+                                             (GDestroyNotify)osm_pmtiles_dir_free);
+    g_mutex_init (&pmtiles->lock);
+
+    switch (header[99]) {
+        case 2: pmtiles->format = "png"; break;
+        case 3: pmtiles->format = "jpg"; break;
+        case 4: pmtiles->format = "webp"; break;
+        case 5: pmtiles->format = "avif"; break;
+        default:
+            g_warning ("PMTiles archive %s does not hold raster tiles", path);
+            break;
+    }
+
+    pmtiles->root = osm_pmtiles_dir_new (pmtiles,
+                                         osm_pmtiles_read_uint64 (header + 8),
+                                         osm_pmtiles_read_uint64 (header + 16));
+    if (!pmtiles->root) {
+        g_warning ("Could not read the root directory of %s", path);
+        osm_tile_pmtiles_free (pmtiles);
+        return NULL;
+    }
+    g_debug ("Opened PMTiles archive %s, %u root entries", path, pmtiles->root->n_entries);
+
+    return pmtiles;
+}
+
+void
+osm_tile_pmtiles_free (OsmTilePmtiles *pmtiles)
+{
+    if (pmtiles->root)
+        osm_pmtiles_dir_free (pmtiles->root);
+    g_hash_table_destroy (pmtiles->leaves);
+    g_mutex_clear (&pmtiles->lock);
+    g_mapped_file_unref (pmtiles->file);
+    g_free (pmtiles->path);
+    g_free (pmtiles);
+}
+
+/* The file extension of the tile type, or NULL if it is not an image */
+const gchar *
+osm_tile_pmtiles_get_format (OsmTilePmtiles *pmtiles)
+{
+    return pmtiles->format;
+}
+
+/* Returns the encoded tile, or NULL if it is not in the archive */
+GBytes *
+osm_tile_pmtiles_read (OsmTilePmtiles *pmtiles, int zoom, int x, int y)
+{
+    guint64 offset;
+    guint32 length;
+
+    if (!osm_pmtiles_lookup (pmtiles, zoom, x, y, &offset, &length))
+        return NULL;
+    return osm_pmtiles_get_bytes (pmtiles, offset, length, pmtiles->tile_compression);
+}
+
+gboolean
+osm_tile_pmtiles_contains (OsmTilePmtiles *pmtiles, int zoom, int x, int y)
+{
+    guint64 offset;
+    guint32 length;
+
+    return osm_pmtiles_lookup (pmtiles, zoom, x, y, &offset, &length);
+}
+
+/* The number of tiles in the archive, 0 if it does not say */
+guint64
+osm_tile_pmtiles_get_n_tiles (OsmTilePmtiles *pmtiles)
+{
+    return pmtiles->n_tiles;
+}
+
+/* Calls func for the tiles of dir and its leaves, returns FALSE if func
+ * did */
+static gboolean
+osm_pmtiles_foreach_dir (OsmTilePmtiles *pmtiles, OsmPmtilesDir *dir, int depth,
+                         OsmTilePmtilesFunc func, gpointer user_data)
+{
+    gboolean go_on = TRUE;
+    guint i, j;
+
+    for (i = 0; i < dir->n_entries && go_on; i++) {
+        const OsmPmtilesEntry *entry = &dir->entries[i];
+
+        if (entry->run_length == 0) {
+            OsmPmtilesDir *leaf;
+
+            if (depth + 1 >= MAX_DEPTH)
+                continue;
+            /* not cached, every leaf is read once */
+            leaf = osm_pmtiles_dir_new (pmtiles, pmtiles->leaf_offset + entry->offset,
+                                        entry->length);
+            if (leaf) {
+                go_on = osm_pmtiles_foreach_dir (pmtiles, leaf, depth + 1, func, user_data);
+                osm_pmtiles_dir_free (leaf);
+            }
+        } else {
+            GBytes *bytes = osm_pmtiles_get_bytes (pmtiles,
+                                                   pmtiles->tile_data_offset + entry->offset,
+                                                   entry->length, pmtiles->tile_compression);
+            if (!bytes)
+                continue;
+            for (j = 0; j < entry->run_length && go_on; j++) {
+                guint64 x, y;
+                int zoom;
+
+                osm_pmtiles_tile_zxy (entry->tile_id + j, &zoom, &x, &y);
+                go_on = func (zoom, x, y, bytes, user_data);
+            }
+            g_bytes_unref (bytes);
+        }
+    }
+    return go_on;
+}
+
+/* Calls func for every tile of the archive, in the order of their tile
+ * ids, until it returns FALSE */
+void
+osm_tile_pmtiles_foreach (OsmTilePmtiles *pmtiles, OsmTilePmtilesFunc func,
+                          gpointer user_data)
+{
+    osm_pmtiles_foreach_dir (pmtiles, pmtiles->root, 0, func, user_data);
+}
+
+typedef struct {
+    guint64 offset;
+    guint32 length;
+} OsmPmtilesContent;
+
+struct _OsmTilePmtilesWriter
+{
+    FILE *file;
+    gchar *path;
+    /* written first, renamed to path when finished */
+    gchar *tmp_path;
+    guint8 tile_type;
+    /* OsmPmtilesEntry, in tile id order */
+    GArray *entries;
+    /* the digest of the tiles written to their OsmPmtilesContent */
+    GHashTable *contents;
+    guint64 data_length;
+    guint64 n_tiles;
+    int min_zoom;
+    int max_zoom;
+};
+
+static void
+osm_pmtiles_set_error (GError **error, const gchar *path)
+{
+    int saved_errno = errno;
+
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                 "Error writing %s: %s", path, g_strerror (saved_errno));
+}
+
+/* Starts writing an archive of tiles in format, a file extension like
+ * "png". Returns NULL if the file cannot be created */
+OsmTilePmtilesWriter *
+osm_tile_pmtiles_writer_new (const gchar *path, const gchar *format, GError **error)
+{
+    OsmTilePmtilesWriter *writer;
+    gchar *tmp_path;
+    FILE *file;
+
+    g_return_val_if_fail (path != NULL, NULL);
+
+    tmp_path = g_strdup_printf ("%s.part", path);
+    file = g_fopen (tmp_path, "wb");
+    if (!file || fseek (file, DATA_OFFSET, SEEK_SET) != 0) {
+        osm_pmtiles_set_error (error, tmp_path);
+        if (file) {
+            fclose (file);
+            g_unlink (tmp_path);
+        }
+        g_free (tmp_path);
+        return NULL;
+    }
+
+    writer = g_new0 (OsmTilePmtilesWriter, 1);
+    writer->file = file;
+    writer->path = g_strdup (path);
+    writer->tmp_path = tmp_path;
+    writer->entries = g_array_new (FALSE, FALSE, sizeof (OsmPmtilesEntry));
+    writer->contents = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    writer->min_zoom = G_MAXINT;
+    writer->max_zoom = 0;
+
+    if (g_strcmp0 (format, "png") == 0)
+        writer->tile_type = 2;
+    else if (g_strcmp0 (format, "jpg") == 0 || g_strcmp0 (format, "jpeg") == 0)
+        writer->tile_type = 3;
+    else if (g_strcmp0 (format, "webp") == 0)
+        writer->tile_type = 4;
+    else if (g_strcmp0 (format, "avif") == 0)
+        writer->tile_type = 5;
+
+    return writer;
+}
+
+/* Adds a tile, tiles must be added in increasing tile id order */
+gboolean
+osm_tile_pmtiles_writer_add (OsmTilePmtilesWriter *writer, int zoom, int x, int y,
+                             GBytes *data, GError **error)
+{
+    guint64 tile_id = osm_tile_pmtiles_tile_id (zoom, x, y);
+    OsmPmtilesContent *content;
+    OsmPmtilesEntry *last = NULL;
+    const guchar *bytes;
+    gchar *digest;
+    gsize len;
+
+    bytes = g_bytes_get_data (data, &len);
+    digest = osm_tile_dedup_digest (bytes, len);
+    content = g_hash_table_lookup (writer->contents, digest);
+    if (content) {
+        g_free (digest);
+    } else {
+        if (fwrite (bytes, 1, len, writer->file) != len) {
+            osm_pmtiles_set_error (error, writer->tmp_path);
+            g_free (digest);
+            return FALSE;
+        }
+        content = g_new (OsmPmtilesContent, 1);
+        content->offset = writer->data_length;
+        content->length = len;
+        g_hash_table_insert (writer->contents, digest, content);
+        writer->data_length += len;
+    }
+
+    if (writer->entries->len > 0)
+        last = &g_array_index (writer->entries, OsmPmtilesEntry, writer->entries->len - 1);
+    if (last && last->tile_id + last->run_length == tile_id &&
+        last->offset == content->offset && last->run_length < G_MAXUINT32) {
+        last->run_length++;
+    } else {
+        OsmPmtilesEntry entry = { tile_id, content->offset, content->length, 1 };
+
+        g_array_append_val (writer->entries, entry);
+    }
+
+    writer->n_tiles++;
+    writer->min_zoom = MIN (writer->min_zoom, zoom);
+    writer->max_zoom = MAX (writer->max_zoom, zoom);
+
+    return TRUE;
+}
+
+static void
+osm_pmtiles_append_varint (GByteArray *out, guint64 value)
+{
+    guint8 byte;
+
+    while (value >= 0x80) {
+        byte = (value & 0x7f) | 0x80;
+        g_byte_array_append (out, &byte, 1);
+        value >>= 7;
+    }
+    byte = value;
+    g_byte_array_append (out, &byte, 1);
+}
+
+static GByteArray *
+osm_pmtiles_serialize_dir (const OsmPmtilesEntry *entries, guint n)
+{
+    GByteArray *out = g_byte_array_new ();
+    guint i;
+
+    osm_pmtiles_append_varint (out, n);
+    for (i = 0; i < n; i++)
+        osm_pmtiles_append_varint (out, entries[i].tile_id - (i > 0 ? entries[i - 1].tile_id : 0));
+    for (i = 0; i < n; i++)
+        osm_pmtiles_append_varint (out, entries[i].run_length);
+    for (i = 0; i < n; i++)
+        osm_pmtiles_append_varint (out, entries[i].length);
+    for (i = 0; i < n; i++) {
+        if (i > 0 && entries[i].offset == entries[i - 1].offset + entries[i - 1].length)
+            osm_pmtiles_append_varint (out, 0);
+        else
+            osm_pmtiles_append_varint (out, entries[i].offset + 1);
+    }
+    return out;
+}
+
+static void
+osm_pmtiles_put_uint64 (guchar *p, guint64 value)
+{
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        p[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static void
+osm_pmtiles_put_int32 (guchar *p, gint32 value)
+{
+    guint32 u = value;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        p[i] = u & 0xff;
+        u >>= 8;
+    }
+}
+
+/* Writes the directories and the header, and moves the archive in place.
+ * The bounds are in degrees */
+gboolean
+osm_tile_pmtiles_writer_finish (OsmTilePmtilesWriter *writer,
+                                double min_lon, double min_lat,
+                                double max_lon, double max_lat,
+                                GError **error)
+{
+    const OsmPmtilesEntry *entries = (const OsmPmtilesEntry *)writer->entries->data;
+    guint n = writer->entries->len;
+    GByteArray *root, *leaves = NULL;
+    guchar header[HEADER_SIZE];
+    static const char metadata[] = "{}";
+    guint64 leaf_offset, metadata_offset;
+    guint leaf_size, i;
+    gboolean ok;
+
+    /* split into more and more leaves until the root fits */
+    root = osm_pmtiles_serialize_dir (entries, n);
+    for (leaf_size = LEAF_SIZE; root->len > DATA_OFFSET - HEADER_SIZE; leaf_size *= 2) {
+        GArray *root_entries = g_array_new (FALSE, FALSE, sizeof (OsmPmtilesEntry));
+
+        g_byte_array_free (root, TRUE);
+        if (leaves)
+            g_byte_array_free (leaves, TRUE);
+        leaves = g_byte_array_new ();
+        for (i = 0; i < n; i += leaf_size) {
+            GByteArray *leaf = osm_pmtiles_serialize_dir (entries + i, MIN (leaf_size, n - i));
+            OsmPmtilesEntry entry = { entries[i].tile_id, leaves->len, leaf->len, 0 };
+
+            g_array_append_val (root_entries, entry);
+            g_byte_array_append (leaves, leaf->data, leaf->len);
+            g_byte_array_free (leaf, TRUE);
+        }
+        root = osm_pmtiles_serialize_dir ((const OsmPmtilesEntry *)root_entries->data,
+                                          root_entries->len);
+        g_array_free (root_entries, TRUE);
+    }
+
+    leaf_offset = DATA_OFFSET + writer->data_length;
+    metadata_offset = leaf_offset + (leaves ? leaves->len : 0);
+
+    memset (header, 0, sizeof (header));
+    memcpy (header, "PMTiles", 7);
+    header[7] = 3;
+    osm_pmtiles_put_uint64 (header + 8, HEADER_SIZE);
+    osm_pmtiles_put_uint64 (header + 16, root->len);
+    osm_pmtiles_put_uint64 (header + 24, metadata_offset);
+    osm_pmtiles_put_uint64 (header + 32, strlen (metadata));
+    osm_pmtiles_put_uint64 (header + 40, leaf_offset);
+    osm_pmtiles_put_uint64 (header + 48, leaves ? leaves->len : 0);
+    osm_pmtiles_put_uint64 (header + 56, DATA_OFFSET);
+    osm_pmtiles_put_uint64 (header + 64, writer->data_length);
+    osm_pmtiles_put_uint64 (header + 72, writer->n_tiles);
+    osm_pmtiles_put_uint64 (header + 80, n);
+    osm_pmtiles_put_uint64 (header + 88, g_hash_table_size (writer->contents));
+    /* the data was written in tile id order */
+    header[96] = 1;
+    header[97] = COMPRESSION_NONE;
+    header[98] = COMPRESSION_NONE;
+    header[99] = writer->tile_type;
+    header[100] = writer->n_tiles ? writer->min_zoom : 0;
+    header[101] = writer->max_zoom;
+    osm_pmtiles_put_int32 (header + 102, min_lon * 1e7);
+    osm_pmtiles_put_int32 (header + 106, min_lat * 1e7);
+    osm_pmtiles_put_int32 (header + 110, max_lon * 1e7);
+    osm_pmtiles_put_int32 (header + 114, max_lat * 1e7);
+    header[118] = header[100];
+    osm_pmtiles_put_int32 (header + 119, (min_lon + max_lon) / 2 * 1e7);
+    osm_pmtiles_put_int32 (header + 123, (min_lat + max_lat) / 2 * 1e7);
+
+    ok = (!leaves || fwrite (leaves->data, 1, leaves->len, writer->file) == leaves->len) &&
+         fwrite (metadata, 1, strlen (metadata), writer->file) == strlen (metadata) &&
+         fseek (writer->file, 0, SEEK_SET) == 0 &&
+         fwrite (header, 1, HEADER_SIZE, writer->file) == HEADER_SIZE &&
+         fwrite (root->data, 1, root->len, writer->file) == root->len;
+    if (fclose (writer->file) != 0)
+        ok = FALSE;
+    writer->file = NULL;
+
+    if (!ok) {
+        osm_pmtiles_set_error (error, writer->tmp_path);
+    } else if (g_rename (writer->tmp_path, writer->path) != 0) {
+        osm_pmtiles_set_error (error, writer->path);
+        ok = FALSE;
+    } else {
+        g_debug ("Wrote %" G_GUINT64_FORMAT " tiles to %s", writer->n_tiles, writer->path);
+    }
+
+    g_byte_array_free (root, TRUE);
+    if (leaves)
+        g_byte_array_free (leaves, TRUE);
+
+    return ok;
+}
+
+/* Frees the writer, removing the archive if it was not finished */
+void
+osm_tile_pmtiles_writer_free (OsmTilePmtilesWriter *writer)
+{
+    if (writer->file)
+        fclose (writer->file);
+    g_unlink (writer->tmp_path);
+    g_array_free (writer->entries, TRUE);
+    g_hash_table_destroy (writer->contents);
+    g_free (writer->tmp_path);
+    g_free (writer->path);
+    g_free (writer);
+}
@@ -0,0 +1,46 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TILE_PMTILES_H__
+#define __TILE_PMTILES_H__
+
+#include <glib.h>
+
+typedef struct _OsmTilePmtiles OsmTilePmtiles;
+typedef struct _OsmTilePmtilesWriter OsmTilePmtilesWriter;
+
+/* Called for each tile by osm_tile_pmtiles_foreach(), returns FALSE to stop */
+typedef gboolean (*OsmTilePmtilesFunc) (int zoom, int x, int y, GBytes *data, gpointer user_data);
+
+guint64         osm_tile_pmtiles_tile_id        (int zoom, guint64 x, guint64 y);
+
+OsmTilePmtiles *osm_tile_pmtiles_open           (const gchar *path);
+void            osm_tile_pmtiles_free           (OsmTilePmtiles *pmtiles);
+const gchar    *osm_tile_pmtiles_get_format     (OsmTilePmtiles *pmtiles);
+GBytes         *osm_tile_pmtiles_read           (OsmTilePmtiles *pmtiles, int zoom, int x, int y);
+gboolean        osm_tile_pmtiles_contains       (OsmTilePmtiles *pmtiles, int zoom, int x, int y);
+guint64         osm_tile_pmtiles_get_n_tiles    (OsmTilePmtiles *pmtiles);
+void            osm_tile_pmtiles_foreach        (OsmTilePmtiles *pmtiles, OsmTilePmtilesFunc func, gpointer user_data);
+
+OsmTilePmtilesWriter *osm_tile_pmtiles_writer_new (const gchar *path, const gchar *format, GError **error);
+gboolean        osm_tile_pmtiles_writer_add     (OsmTilePmtilesWriter *writer, int zoom, int x, int y, GBytes *data, GError **error);
+gboolean        osm_tile_pmtiles_writer_finish  (OsmTilePmtilesWriter *writer, double min_lon, double min_lat, double max_lon, double max_lat, GError **error);
+void            osm_tile_pmtiles_writer_free    (OsmTilePmtilesWriter *writer);
+
+#endif /* __TILE_PMTILES_H__ */
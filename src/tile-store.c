@@ -0,0 +1,290 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The tiles of a map, together with the downloads in progress for them.
+ *
+ * Every map owns a private store, unless it is created with the
+ * shared-tile-cache property, in which case it uses the one store shared
+ * by the whole process. Maps showing the same source then share decoded
+ * surfaces (cairo keeps them reference counted), a single memory budget,
+ * and each tile is downloaded once however many maps are waiting for it.
+ *
+ * Like the rest of the widget, a store must only be used from the main
+ * thread.
+ */
+
+#include <glib.h>
+
+#include "tile-store.h"
+
+/* seconds between steps of growing the tile cache back after a trim */
+#define CACHE_REGROW_INTERVAL       30
+
+typedef struct
+{
+    gpointer client;
+    /* tiles used after this stamp are on the client's screen */
+    const guint64 *redraw_cycle;
+} OsmTileStoreClient;
+
+typedef struct
+{
+    /* the client which started the download */
+    gpointer owner;
+    /* other clients to tell when it completes */
+    GSList *waiters;
+} OsmTileStoreDownload;
+
+struct _OsmTileStore
+{
+    gint ref_count;
+    gboolean shared;
+    OsmTileCache *cache;
+    GSList *clients;
+    /* maps uris being downloaded to an OsmTileStoreDownload */
+    GHashTable *downloads;
+    /* ID of the timeout growing the cache back after a trim, one for all
+     * the clients */
+    guint regrow_source;
+};
+
+static OsmTileStore *shared_store = NULL;
+
+static void
+tile_store_download_free (OsmTileStoreDownload *dl)
+{
+    g_slist_free (dl->waiters);
+    g_slice_free (OsmTileStoreDownload, dl);
+}
+
+OsmTileStore *
+osm_tile_store_new (void)
+{
+    OsmTileStore *store = g_new0 (OsmTileStore, 1);
+
+    store->ref_count = 1;
+    store->cache = osm_tile_cache_new (TILE_CACHE_DEFAULT_BYTES);
+    store->downloads = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify)tile_store_download_free);
+
+    return store;
+}
+
+/* Returns a new reference to the store shared by the whole process. It is
+ * freed when the last map using it goes away, and created again if another
+ * one asks for it later */
+OsmTileStore *
+osm_tile_store_get_shared (void)
+{
+    if (shared_store)
+        return osm_tile_store_ref (shared_store);
+
+    shared_store = osm_tile_store_new ();
+    shared_store->shared = TRUE;
+    return shared_store;
+}
+
+OsmTileStore *
+osm_tile_store_ref (OsmTileStore *store)
+{
+    store->ref_count++;
+    return store;
+}
+
+void
+osm_tile_store_unref (OsmTileStore *store)
+{
+    if (--store->ref_count > 0)
+        return;
+
+    if (store == shared_store)
+        shared_store = NULL;
+
+    if (store->regrow_source != 0)
+        g_source_remove (store->regrow_source);
+    g_hash_table_destroy (store->downloads);
+    g_slist_free_full (store->clients, g_free);
+    osm_tile_cache_free (store->cache);
+    g_free (store);
+}
+
+OsmTileCache *
+osm_tile_store_get_cache (OsmTileStore *store)
+{
+    return store->cache;
+}
+
+gboolean
+osm_tile_store_is_shared (OsmTileStore *store)
+{
+    return store->shared;
+}
+
+/* Registers a client (a map) of the store. redraw_cycle must stay valid
+ * until the client is removed; tiles used after it are never purged */
+void
+osm_tile_store_add_client (OsmTileStore *store, gpointer client,
+                           const guint64 *redraw_cycle)
+{
+    OsmTileStoreClient *c = g_new0 (OsmTileStoreClient, 1);
+
+    c->client = client;
+    c->redraw_cycle = redraw_cycle;
+    store->clients = g_slist_prepend (store->clients, c);
+}
+
+/* Forgets client, including the downloads it is waiting for. The
+ * network part of the downloads it started must have been cancelled
+ * already; those still open (being decoded) are ended, and the clients
+ * waiting for them are returned, to be told like osm_tile_store_end_download() */
+GSList *
+osm_tile_store_remove_client (OsmTileStore *store, gpointer client)
+{
+    GHashTableIter iter;
+    OsmTileStoreDownload *dl;
+    GSList *list, *waiters = NULL;
+
+    g_hash_table_iter_init (&iter, store->downloads);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&dl)) {
+        if (dl->owner == client) {
+            waiters = g_slist_concat (waiters, dl->waiters);
+            dl->waiters = NULL;
+            g_hash_table_iter_remove (&iter);
+        } else {
+            dl->waiters = g_slist_remove (dl->waiters, client);
+        }
+    }
+
+    for (list = store->clients; list != NULL; list = list->next) {
+        OsmTileStoreClient *c = list->data;
+        if (c->client == client) {
+            store->clients = g_slist_delete_link (store->clients, list);
+            g_free (c);
+            break;
+        }
+    }
+
+    return waiters;
+}
+
+/* Evicts tiles until the cache fits in its budget, sparing the tiles on
+ * the screen of any client */
+gsize
+osm_tile_store_purge (OsmTileStore *store)
+{
+    guint64 keep_stamp = G_MAXUINT64;
+    GSList *list;
+
+    for (list = store->clients; list != NULL; list = list->next) {
+        OsmTileStoreClient *c = list->data;
+        keep_stamp = MIN (keep_stamp, *c->redraw_cycle);
+    }
+
+    return osm_tile_cache_purge (store->cache, keep_stamp);
+}
+
+/* Lifts the limit set on the cache by osm_tile_store_trim() step by
+ * step, doubling it every CACHE_REGROW_INTERVAL seconds */
+static gboolean
+tile_store_regrow (gpointer data)
+{
+    OsmTileStore *store = data;
+    gsize max_bytes = osm_tile_cache_get_max_bytes (store->cache);
+    gsize limit = osm_tile_cache_get_limit (store->cache);
+
+    if (limit < max_bytes / 8)
+        limit = max_bytes / 8;
+    else
+        limit *= 2;
+
+    if (limit >= max_bytes) {
+        g_debug ("Tile cache back to its full budget");
+        osm_tile_cache_set_limit (store->cache, G_MAXSIZE);
+        store->regrow_source = 0;
+        return FALSE;
+    }
+
+    g_debug ("Growing tile cache back to %" G_GSIZE_FORMAT " bytes", limit);
+    osm_tile_cache_set_limit (store->cache, limit);
+    return TRUE;
+}
+
+/* Lowers the budget of the cache to limit, unless a trim by any client
+ * lowered it further already, and grows it back gradually from there.
+ * The tiles over the limit are left for the caller to evict */
+void
+osm_tile_store_trim (OsmTileStore *store, gsize limit)
+{
+    limit = MIN (limit, osm_tile_cache_get_limit (store->cache));
+    osm_tile_cache_set_limit (store->cache, limit);
+
+    if (store->regrow_source != 0)
+        g_source_remove (store->regrow_source);
+    store->regrow_source = g_timeout_add_seconds (CACHE_REGROW_INTERVAL,
+                                                  tile_store_regrow, store);
+}
+
+/* Returns TRUE if client should download uri. If it is already being
+ * downloaded, returns FALSE and remembers that client is waiting for it */
+gboolean
+osm_tile_store_begin_download (OsmTileStore *store, const gchar *uri,
+                               gpointer client)
+{
+    OsmTileStoreDownload *dl = g_hash_table_lookup (store->downloads, uri);
+
+    if (dl) {
+        if (dl->owner != client && !g_slist_find (dl->waiters, client))
+            dl->waiters = g_slist_prepend (dl->waiters, client);
+        return FALSE;
+    }
+
+    dl = g_slice_new0 (OsmTileStoreDownload);
+    dl->owner = client;
+    g_hash_table_insert (store->downloads, g_strdup (uri), dl);
+    return TRUE;
+}
+
+/* Marks the download of uri as finished, successfully or not. Returns the
+ * clients other than its owner waiting for it, which the caller must free
+ * with g_slist_free() */
+GSList *
+osm_tile_store_end_download (OsmTileStore *store, const gchar *uri)
+{
+    OsmTileStoreDownload *dl = g_hash_table_lookup (store->downloads, uri);
+    GSList *waiters;
+
+    if (!dl)
+        return NULL;
+
+    waiters = dl->waiters;
+    dl->waiters = NULL;
+    g_hash_table_remove (store->downloads, uri);
+    return waiters;
+}
+
+/* Whether other clients than the owner are waiting for the download of
+ * uri */
+gboolean
+osm_tile_store_has_waiters (OsmTileStore *store, const gchar *uri)
+{
+    OsmTileStoreDownload *dl = g_hash_table_lookup (store->downloads, uri);
+
+    return dl && dl->waiters;
+}
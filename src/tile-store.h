@@ -0,0 +1,43 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TILE_STORE_H__
+#define __TILE_STORE_H__
+
+#include <glib.h>
+
+#include "tile-cache.h"
+
+typedef struct _OsmTileStore OsmTileStore;
+
+OsmTileStore   *osm_tile_store_new              (void);
+OsmTileStore   *osm_tile_store_get_shared       (void);
+OsmTileStore   *osm_tile_store_ref              (OsmTileStore *store);
+void            osm_tile_store_unref            (OsmTileStore *store);
+OsmTileCache   *osm_tile_store_get_cache        (OsmTileStore *store);
+gboolean        osm_tile_store_is_shared        (OsmTileStore *store);
+void            osm_tile_store_add_client       (OsmTileStore *store, gpointer client, const guint64 *redraw_cycle);
+GSList         *osm_tile_store_remove_client    (OsmTileStore *store, gpointer client);
+gsize           osm_tile_store_purge            (OsmTileStore *store);
+void            osm_tile_store_trim             (OsmTileStore *store, gsize limit);
+gboolean        osm_tile_store_begin_download   (OsmTileStore *store, const gchar *uri, gpointer client);
+GSList         *osm_tile_store_end_download     (OsmTileStore *store, const gchar *uri);
+gboolean        osm_tile_store_has_waiters      (OsmTileStore *store, const gchar *uri);
+
+#endif /* __TILE_STORE_H__ */
@@ -0,0 +1,214 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A pool of threads, one per core, decoding tiles off the main loop.
+ *
+ * The threads are shared by every worker in the process, so that several
+ * maps do not start a pool each. A job is tagged with the worker which
+ * pushed it, whose callbacks run it and take it back.
+ *
+ * Waiting jobs are run in the order of their priority, lowest first, and
+ * then in the order they were pushed. The jobs done are handed back to
+ * the main loop together, from a single idle callback per worker, so that
+ * many tiles arriving at once cost a single redraw.
+ */
+
+#include <glib.h>
+
+#include "tile-worker.h"
+
+typedef struct {
+    OsmTileWorker *worker;
+    /* NULL once the job was dropped by its worker */
+    gpointer job;
+    guint priority;
+    guint64 serial;
+} OsmTileWorkerItem;
+
+struct _OsmTileWorker
+{
+    OsmTileWorkerFunc run;
+    OsmTileWorkerDoneFunc done;
+    GDestroyNotify free_job;
+    gpointer user_data;
+    /* the items waiting for a thread, and the number of jobs being run */
+    GHashTable *waiting;
+    guint running;
+    /* the jobs done and the idle callback handing them back */
+    GPtrArray *results;
+    guint idle_source;
+};
+
+/* the threads, and the order of the jobs pushed by all the workers. The
+ * state of the workers is protected by pool_lock, pool_cond is signalled
+ * when a job is done */
+static GThreadPool *pool;
+static guint64 pool_serial;
+static GMutex pool_lock;
+static GCond pool_cond;
+
+static gint
+osm_tile_worker_compare_items (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const OsmTileWorkerItem *ia = a;
+    const OsmTileWorkerItem *ib = b;
+
+    if (ia->priority != ib->priority)
+        return ia->priority < ib->priority ? -1 : 1;
+    return (ia->serial > ib->serial) - (ia->serial < ib->serial);
+}
+
+static gboolean
+osm_tile_worker_idle (gpointer data)
+{
+    OsmTileWorker *worker = data;
+    GPtrArray *results;
+
+    g_mutex_lock (&pool_lock);
+    results = worker->results;
+    worker->results = g_ptr_array_new_with_free_func (worker->free_job);
+    worker->idle_source = 0;
+    g_mutex_unlock (&pool_lock);
+
+    worker->done (results, worker->user_data);
+    g_ptr_array_free (results, TRUE);
+
+    return FALSE;
+}
+
+/* Runs in a pool thread */
+static void
+osm_tile_worker_thread (gpointer data, gpointer user_data)
+{
+    OsmTileWorkerItem *item = data;
+    OsmTileWorker *worker;
+    gpointer job;
+
+    /* the worker is gone if the job was dropped */
+    g_mutex_lock (&pool_lock);
+    worker = item->worker;
+    job = item->job;
+    if (job) {
+        g_hash_table_remove (worker->waiting, item);
+        worker->running++;
+    }
+    g_mutex_unlock (&pool_lock);
+    g_free (item);
+
+    if (!job)
+        return;
+
+    worker->run (job, worker->user_data);
+
+    g_mutex_lock (&pool_lock);
+    g_ptr_array_add (worker->results, job);
+    if (worker->idle_source == 0)
+        worker->idle_source = g_idle_add (osm_tile_worker_idle, worker);
+    worker->running--;
+    g_cond_broadcast (&pool_cond);
+    g_mutex_unlock (&pool_lock);
+}
+
+OsmTileWorker *
+osm_tile_worker_new (OsmTileWorkerFunc run, OsmTileWorkerDoneFunc done,
+                     GDestroyNotify free_job, gpointer user_data)
+{
+    OsmTileWorker *worker = g_new0 (OsmTileWorker, 1);
+
+    worker->run = run;
+    worker->done = done;
+    worker->free_job = free_job;
+    worker->user_data = user_data;
+    worker->waiting = g_hash_table_new (NULL, NULL);
+    worker->results = g_ptr_array_new_with_free_func (free_job);
+
+    /* started with the first worker, kept for the life of the process */
+    g_mutex_lock (&pool_lock);
+    if (!pool) {
+        pool = g_thread_pool_new (osm_tile_worker_thread, NULL,
+                                  MAX (g_get_num_processors (), 1), FALSE, NULL);
+        g_thread_pool_set_sort_function (pool, osm_tile_worker_compare_items, NULL);
+    }
+    g_mutex_unlock (&pool_lock);
+
+    return worker;
+}
+
+/* Frees the worker, waiting for its jobs being run. Its jobs waiting or
+ * done are freed without being handed back, those of the other workers
+ * are left alone */
+void
+osm_tile_worker_free (OsmTileWorker *worker)
+{
+    GHashTableIter iter;
+    OsmTileWorkerItem *item;
+    GPtrArray *dropped;
+
+    /* the items stay in the pool queue, the threads skip them */
+    dropped = g_ptr_array_new_with_free_func (worker->free_job);
+    g_mutex_lock (&pool_lock);
+    g_hash_table_iter_init (&iter, worker->waiting);
+    while (g_hash_table_iter_next (&iter, (gpointer *)&item, NULL)) {
+        g_ptr_array_add (dropped, item->job);
+        item->job = NULL;
+    }
+    while (worker->running > 0)
+        g_cond_wait (&pool_cond, &pool_lock);
+    if (worker->idle_source != 0)
+        g_source_remove (worker->idle_source);
+    g_mutex_unlock (&pool_lock);
+
+    g_ptr_array_free (dropped, TRUE);
+    g_ptr_array_free (worker->results, TRUE);
+    g_hash_table_destroy (worker->waiting);
+    g_free (worker);
+}
+
+/* Queues a job, the lower the priority the sooner it is run, whichever
+ * worker pushed the jobs. Must be called from the main loop */
+void
+osm_tile_worker_push (OsmTileWorker *worker, gpointer job, guint priority)
+{
+    OsmTileWorkerItem *item = g_new (OsmTileWorkerItem, 1);
+
+    item->worker = worker;
+    item->job = job;
+    item->priority = priority;
+
+    g_mutex_lock (&pool_lock);
+    item->serial = pool_serial++;
+    g_hash_table_add (worker->waiting, item);
+    g_mutex_unlock (&pool_lock);
+
+    g_thread_pool_push (pool, item, NULL);
+}
+
+/* The number of jobs of the worker waiting for a thread */
+guint
+osm_tile_worker_get_pending (OsmTileWorker *worker)
+{
+    guint pending;
+
+    g_mutex_lock (&pool_lock);
+    pending = g_hash_table_size (worker->waiting);
+    g_mutex_unlock (&pool_lock);
+
+    return pending;
+}
@@ -0,0 +1,38 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TILE_WORKER_H__
+#define __TILE_WORKER_H__
+
+#include <glib.h>
+
+typedef struct _OsmTileWorker OsmTileWorker;
+
+/* Runs a job in a worker thread */
+typedef void (*OsmTileWorkerFunc) (gpointer job, gpointer user_data);
+/* Called in the main loop with the jobs (a GPtrArray) done since the last
+ * call, which are freed afterwards */
+typedef void (*OsmTileWorkerDoneFunc) (GPtrArray *jobs, gpointer user_data);
+
+OsmTileWorker  *osm_tile_worker_new             (OsmTileWorkerFunc run, OsmTileWorkerDoneFunc done, GDestroyNotify free_job, gpointer user_data);
+void            osm_tile_worker_free            (OsmTileWorker *worker);
+void            osm_tile_worker_push            (OsmTileWorker *worker, gpointer job, guint priority);
+guint           osm_tile_worker_get_pending     (OsmTileWorker *worker);
+
+#endif /* __TILE_WORKER_H__ */
@@ -1,7 +1,14 @@
 #!/usr/bin/env python3
 import unittest
 import cairo
+import gc
 import io
+import os
+import sqlite3
+import struct
+import tempfile
+import time
+import zlib
 
 import gi
 gi.require_version('OsmGpsMap', '1.2')
@@ -9,12 +16,69 @@ gi.require_version('OsmGpsMap', '1.2')
 from gi.repository import OsmGpsMap
 from gi.repository import Gdk, GdkPixbuf, Gtk
 
+# nothing listens there, tiles come from the tile cache
+TILE_REPO = "http://127.0.0.1:9/#Z/#X/#Y.png"
+
+def png_tile(color, size=256):
+	"""A PNG of a single RGB or RGBA color"""
+	def chunk(kind, data):
+		return struct.pack(">I", len(data)) + kind + data + struct.pack(">I", zlib.crc32(kind + data))
+	header = struct.pack(">IIBBBBB", size, size, 8, 6 if len(color) == 4 else 2, 0, 0, 0)
+	rows = (b"\x00" + bytes(color) * size) * size
+	return (b"\x89PNG\r\n\x1a\n" + chunk(b"IHDR", header) +
+	        chunk(b"IDAT", zlib.compress(rows)) + chunk(b"IEND", b""))
+
+def write_tiles(path, max_zoom, data):
+	"""Fills a tile cache directory with all the tiles up to max_zoom"""
+	for zoom in range(max_zoom + 1):
+		for x in range(1 << zoom):
+			os.makedirs(os.path.join(path, str(zoom), str(x)), exist_ok=True)
+			for y in range(1 << zoom):
+				with open(os.path.join(path, str(zoom), str(x), "%d.png" % y), "wb") as f:
+					f.write(data)
+
 class TestOsmGpsMap(unittest.TestCase):
 	def setUp(self):
 		self.lat = 50
 		self.lon = 13
 		self.zoom = 15
 		self.osm = OsmGpsMap.Map(user_agent="test/0.1")
+
+	def tile_map(self, path, **kwargs):
+		return OsmGpsMap.Map(repo_uri=TILE_REPO, image_format="png", tile_cache=path, **kwargs)
+
+	def show_map(self, osm, lat, lon, zoom):
+		window = Gtk.Window()
+		window.set_default_size(256, 256)
+		window.add(osm)
+		window.show_all()
+		self.addCleanup(window.destroy)
+		osm.set_center_and_zoom(lat, lon, zoom)
+
+	def run_until(self, predicate, timeout=10):
+		deadline = time.monotonic() + timeout
+		while not predicate() and time.monotonic() < deadline:
+			while Gtk.events_pending():
+				Gtk.main_iteration_do(False)
+			time.sleep(0.01)
+		return predicate()
+
+	def stat(self, osm, name):
+		return osm.get_property("statistics").unpack()[name]
+
+	def pixel(self, osm, dx, dy):
+		"""The RGB color painted dx,dy pixels from the center of the map"""
+		allocation = osm.get_allocation()
+		surface = cairo.ImageSurface(cairo.FORMAT_RGB24, allocation.width, allocation.height)
+		osm.draw(cairo.Context(surface))
+		surface.flush()
+		offset = (allocation.height // 2 + dy) * surface.get_stride() + (allocation.width // 2 + dx) * 4
+		value, = struct.unpack_from("=I", surface.get_data(), offset)
+		return ((value >> 16) & 0xff, (value >> 8) & 0xff, value & 0xff)
+
+	def assertColor(self, color, expected):
+		for got, want in zip(color, expected):
+			self.assertLessEqual(abs(got - want), 2, "%r is not %r" % (color, expected))
 		
 	def test_map(self):
 		test_window = Gtk.Window()
@@ -122,5 +186,350 @@ class TestOsmGpsMap(unittest.TestCase):
 		
 		self.osm.track_remove(track)
 
+	def test_tile_cache(self):
+		self.assertEqual(self.osm.get_property("tile-cache-bytes"), 64*1024*1024)
+		self.osm.set_property("tile-cache-bytes", 1024*1024)
+		self.assertEqual(self.osm.get_property("tile-cache-bytes"), 1024*1024)
+		self.osm.set_property("tile-cache-bytes", 0)
+		self.assertEqual(self.osm.get_property("tile-cache-bytes"), 0)
+
+	def test_tile_cache_eviction(self):
+		path = tempfile.mkdtemp()
+		write_tiles(path, 3, png_tile((40, 80, 120)))
+		# a budget of the four tiles in view evicts the tiles of zoom 1 once
+		# those of zoom 3 are shown, the default one keeps them in memory
+		for budget, evicted in ((4*256*256*4, True), (64*1024*1024, False)):
+			osm = self.tile_map(path)
+			osm.set_property("tile-cache-bytes", budget)
+			self.show_map(osm, 0, 0, 1)
+			self.assertTrue(self.run_until(lambda: self.stat(osm, "disk-hits") >= 4))
+			self.assertColor(self.pixel(osm, 16, 16), (40, 80, 120))
+
+			hits = self.stat(osm, "disk-hits")
+			osm.set_center_and_zoom(0, 0, 3)
+			self.assertTrue(self.run_until(lambda: self.stat(osm, "disk-hits") >= hits + 4))
+			self.run_until(lambda: False, 0.5)
+
+			hits = self.stat(osm, "disk-hits")
+			memory_hits = self.stat(osm, "memory-hits")
+			osm.set_center_and_zoom(0, 0, 1)
+			if evicted:
+				self.assertTrue(self.run_until(lambda: self.stat(osm, "disk-hits") >= hits + 4))
+			else:
+				self.run_until(lambda: False, 0.5)
+				self.assertEqual(self.stat(osm, "disk-hits"), hits)
+				self.assertGreaterEqual(self.stat(osm, "memory-hits"), memory_hits + 4)
+			self.assertColor(self.pixel(osm, 16, 16), (40, 80, 120))
+
+	def test_tile_decode_workers(self):
+		# every tile of zoom 2 has its own color, so each decoded surface
+		# has to land on the tile it was read for
+		path = tempfile.mkdtemp()
+		color = lambda x, y: (40 * x + 20, 60 * y + 10, 90)
+		for x in range(4):
+			os.makedirs(os.path.join(path, "2", str(x)))
+			for y in range(4):
+				with open(os.path.join(path, "2", str(x), "%d.png" % y), "wb") as f:
+					f.write(png_tile(color(x, y)))
+		osm = self.tile_map(path)
+		self.show_map(osm, 0, 0, 2)
+		self.assertTrue(self.run_until(lambda: self.stat(osm, "disk-hits") >= 4))
+		self.run_until(lambda: False, 0.2)
+		stats = osm.get_property("statistics").unpack()
+		self.assertGreaterEqual(stats["decoded"], stats["disk-hits"] - stats["dedup-hits"])
+		self.assertColor(self.pixel(osm, -16, -16), color(1, 1))
+		self.assertColor(self.pixel(osm, 16, -16), color(2, 1))
+		self.assertColor(self.pixel(osm, -16, 16), color(1, 2))
+		self.assertColor(self.pixel(osm, 16, 16), color(2, 2))
+
+	def test_tile_decode_colors(self):
+		# a half transparent tile is painted over the white background,
+		# which only gives these colors if the decoder premultiplied the
+		# alpha and kept the channels in cairo's order
+		for color, expected in (((200, 100, 0, 128), (227, 177, 127)),
+		                        ((40, 80, 120), (40, 80, 120))):
+			path = tempfile.mkdtemp()
+			write_tiles(path, 1, png_tile(color))
+			osm = self.tile_map(path)
+			self.show_map(osm, 0, 0, 1)
+			self.assertTrue(self.run_until(lambda: self.stat(osm, "decoded") >= 4))
+			self.run_until(lambda: False, 0.2)
+			self.assertColor(self.pixel(osm, 16, 16), expected)
+			self.assertColor(self.pixel(osm, -16, -16), expected)
+
+	def test_tile_load_dropped(self):
+		# the tiles around 0,0 and those far north east have their own
+		# color, jumping between both leaves loads behind that are dropped
+		path = tempfile.mkdtemp()
+		write_tiles(path, 4, png_tile((40, 80, 120)))
+		for x in (12, 13):
+			for y in (4, 5):
+				with open(os.path.join(path, "4", str(x), "%d.png" % y), "wb") as f:
+					f.write(png_tile((200, 40, 60)))
+		osm = self.tile_map(path)
+		self.show_map(osm, 0, 0, 4)
+		for i in range(10):
+			osm.set_center_and_zoom(60, 112.5, 4)
+			osm.map_redraw()
+			osm.set_center_and_zoom(0, 0, 4)
+			osm.map_redraw()
+		self.assertTrue(self.run_until(lambda: self.stat(osm, "disk-hits") >= 4))
+		self.run_until(lambda: False, 0.2)
+		stats = osm.get_property("statistics").unpack()
+		self.assertGreaterEqual(stats["disk-hits"] + stats["decodes-dropped"], 8)
+		self.assertColor(self.pixel(osm, 16, 16), (40, 80, 120))
+		self.assertColor(self.pixel(osm, -16, -16), (40, 80, 120))
+
+		# the dropped tiles are loaded again once back in view
+		hits = self.stat(osm, "disk-hits")
+		osm.set_center_and_zoom(60, 112.5, 4)
+		self.run_until(lambda: self.stat(osm, "disk-hits") >= hits + 4, 2)
+		self.run_until(lambda: False, 0.2)
+		self.assertColor(self.pixel(osm, 16, 16), (200, 40, 60))
+		self.assertColor(self.pixel(osm, -16, -16), (200, 40, 60))
+
+	def test_tile_load_dropped_shared(self):
+		# a map dropping its loads must not throw away the tiles another
+		# map sharing the cache has read meanwhile
+		path = tempfile.mkdtemp()
+		write_tiles(path, 4, png_tile((40, 80, 120)))
+		a = self.tile_map(path, shared_tile_cache=True)
+		b = self.tile_map(path, shared_tile_cache=True)
+		self.show_map(a, 0, 0, 4)
+		self.show_map(b, 0, 0, 4)
+		for i in range(10):
+			b.set_center_and_zoom(60, 112.5, 4)
+			b.map_redraw()
+			b.set_center_and_zoom(0, 0, 4)
+			b.map_redraw()
+		b.set_center_and_zoom(60, 112.5, 4)
+		# the tiles are read by either map
+		self.run_until(lambda: False, 0.5)
+		a.map_redraw()
+		self.run_until(lambda: False, 0.5)
+
+		hits = self.stat(a, "disk-hits")
+		a.map_redraw()
+		self.run_until(lambda: False, 0.2)
+		self.assertEqual(self.stat(a, "disk-hits"), hits)
+		self.assertColor(self.pixel(a, 16, 16), (40, 80, 120))
+
+	def test_shared_tile_cache(self):
+		self.assertFalse(self.osm.get_property("shared-tile-cache"))
+		a = OsmGpsMap.Map(shared_tile_cache=True)
+		b = OsmGpsMap.Map(shared_tile_cache=True)
+		self.assertTrue(a.get_property("shared-tile-cache"))
+		a.set_property("tile-cache-bytes", 1024*1024)
+		self.assertEqual(b.get_property("tile-cache-bytes"), 1024*1024)
+		self.assertEqual(self.osm.get_property("tile-cache-bytes"), 64*1024*1024)
+
+	def test_mbtiles_cache(self):
+		path = os.path.join(tempfile.mkdtemp(), "tiles.mbtiles")
+		osm = OsmGpsMap.Map(tile_cache=path)
+		self.assertEqual(osm.get_property("tile-cache"), path)
+
+	def test_mbtiles_read(self):
+		# rows are numbered from the south, the north half is red
+		path = os.path.join(tempfile.mkdtemp(), "tiles.mbtiles")
+		db = sqlite3.connect(path)
+		db.execute("CREATE TABLE metadata (name text, value text)")
+		db.execute("INSERT INTO metadata VALUES ('format', 'png')")
+		db.execute("CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob)")
+		db.execute("INSERT INTO tiles VALUES (0, 0, 0, ?)", (png_tile((40, 80, 120)),))
+		for x in range(2):
+			db.execute("INSERT INTO tiles VALUES (1, ?, 1, ?)", (x, png_tile((200, 40, 60))))
+			db.execute("INSERT INTO tiles VALUES (1, ?, 0, ?)", (x, png_tile((40, 80, 120))))
+		db.commit()
+		db.close()
+
+		osm = self.tile_map(path)
+		self.show_map(osm, 0, 0, 1)
+		self.assertTrue(self.run_until(lambda: self.stat(osm, "disk-hits") >= 4))
+		self.run_until(lambda: False, 0.2)
+		self.assertColor(self.pixel(osm, 16, -16), (200, 40, 60))
+		self.assertColor(self.pixel(osm, -16, 16), (40, 80, 120))
+
+	def test_pmtiles_cache(self):
+		# an empty archive of png tiles, with an uncompressed root directory
+		header = struct.pack("<7sB8Q", b"PMTiles", 3, 127, 1, 128, 0, 128, 0, 128, 0)
+		header += struct.pack("<3QBBBBBB", 0, 0, 0, 1, 1, 1, 2, 0, 0)
+		header += bytes(127 - len(header))
+		path = os.path.join(tempfile.mkdtemp(), "tiles.pmtiles")
+		with open(path, "wb") as f:
+			f.write(header + b"\x00")
+		osm = OsmGpsMap.Map(tile_cache=path)
+		self.assertEqual(osm.get_property("tile-cache"), path)
+		osm.download_maps(OsmGpsMap.MapPoint.new_degrees(1,1), OsmGpsMap.MapPoint.new_degrees(0,0), 1, 1)
+		self.assertEqual(osm.get_property("tiles-queued"), 0)
+
+	def test_estimate_download(self):
+		osm = OsmGpsMap.Map(tile_cache=tempfile.mkdtemp())
+		tiles, size = osm.estimate_download(OsmGpsMap.MapPoint.new_degrees(1,-1), OsmGpsMap.MapPoint.new_degrees(-1,1), 1, 1)
+		self.assertEqual(tiles, 4)
+		self.assertEqual(size, 0)
+
+	def test_cache_export_import(self):
+		osm = OsmGpsMap.Map(tile_cache=tempfile.mkdtemp())
+		path = os.path.join(tempfile.mkdtemp(), "pack.pmtiles")
+		progress = []
+		self.assertTrue(osm.cache_export(OsmGpsMap.MapPoint.new_degrees(1,-1), OsmGpsMap.MapPoint.new_degrees(-1,1), 1, 2,
+		                                 path, None, lambda *args: progress.append(args[:2])))
+		self.assertTrue(os.path.exists(path))
+		self.assertEqual(progress[-1], (0, 0))
+		other = OsmGpsMap.Map(tile_cache=tempfile.mkdtemp())
+		self.assertTrue(other.cache_import(path, None, None))
+
+	def test_pmtiles_round_trip(self):
+		path = tempfile.mkdtemp()
+		data = png_tile((200, 40, 60))
+		write_tiles(path, 2, data)
+		pack = os.path.join(tempfile.mkdtemp(), "pack.pmtiles")
+		osm = self.tile_map(path)
+		self.assertTrue(osm.cache_export(OsmGpsMap.MapPoint.new_degrees(85, -180), OsmGpsMap.MapPoint.new_degrees(-85, 179.9),
+		                                 0, 2, pack, None, None))
+
+		# the pack is read as a tile cache of its own
+		reader = self.tile_map(pack)
+		self.show_map(reader, 0, 0, 1)
+		self.assertTrue(self.run_until(lambda: self.stat(reader, "disk-hits") >= 4))
+		self.assertColor(self.pixel(reader, 16, 16), (200, 40, 60))
+		self.assertColor(self.pixel(reader, -16, -16), (200, 40, 60))
+
+		# and imported into an empty one tile for tile
+		other = tempfile.mkdtemp()
+		# the map goes at once, the tiles still queued are written anyway
+		self.assertTrue(self.tile_map(other).cache_import(pack, None, None))
+		gc.collect()
+		def imported():
+			for zoom in range(3):
+				for x in range(1 << zoom):
+					for y in range(1 << zoom):
+						try:
+							with open(os.path.join(other, str(zoom), str(x), "%d.png" % y), "rb") as f:
+								if f.read() != data:
+									return False
+						except OSError:
+							return False
+			return True
+		self.assertTrue(imported())
+
+	def test_cache_export_import_async(self):
+		path = tempfile.mkdtemp()
+		data = png_tile((200, 40, 60))
+		write_tiles(path, 2, data)
+		pack = os.path.join(tempfile.mkdtemp(), "pack.pmtiles")
+		osm = self.tile_map(path)
+		done = []
+		osm.cache_export_async(OsmGpsMap.MapPoint.new_degrees(85, -180), OsmGpsMap.MapPoint.new_degrees(-85, 179.9),
+		                       0, 2, pack, None, None, lambda map, result: done.append(map.cache_export_finish(result)))
+		self.assertTrue(self.run_until(lambda: done))
+		self.assertTrue(done[0])
+
+		other = tempfile.mkdtemp()
+		importer = self.tile_map(other)
+		done = []
+		importer.cache_import_async(pack, None, None, lambda map, result: done.append(map.cache_import_finish(result)))
+		self.assertTrue(self.run_until(lambda: done))
+		self.assertTrue(done[0])
+		self.assertTrue(self.run_until(lambda: os.path.exists(os.path.join(other, "2", "3", "3.png"))))
+
+	def test_tile_dedup(self):
+		self.assertFalse(self.osm.get_property("tile-dedup"))
+		path = os.path.join(tempfile.mkdtemp(), "tiles.mbtiles")
+		osm = OsmGpsMap.Map(tile_cache=path, tile_dedup=True)
+		self.assertTrue(osm.get_property("tile-dedup"))
+		stats = osm.get_property("statistics").unpack()
+		self.assertEqual(stats["dedup-hits"], 0)
+
+	def test_tile_dedup_hits(self):
+		# every tile is the same image, those of zoom 2 reuse the surface
+		# decoded for zoom 1
+		path = tempfile.mkdtemp()
+		write_tiles(path, 2, png_tile((40, 80, 120)))
+		osm = self.tile_map(path, tile_dedup=True)
+		self.show_map(osm, 0, 0, 1)
+		self.assertTrue(self.run_until(lambda: self.stat(osm, "disk-hits") >= 4))
+		osm.set_center_and_zoom(0, 0, 2)
+		self.assertTrue(self.run_until(lambda: self.stat(osm, "disk-hits") >= 8))
+		self.run_until(lambda: False, 0.2)
+		self.assertGreater(self.stat(osm, "dedup-hits"), 0)
+		self.assertColor(self.pixel(osm, 16, 16), (40, 80, 120))
+
+	def test_disk_cache_max_bytes(self):
+		self.assertEqual(self.osm.get_property("disk-cache-max-bytes"), 0)
+		self.osm.set_property("disk-cache-max-bytes", 100*1024*1024)
+		self.assertEqual(self.osm.get_property("disk-cache-max-bytes"), 100*1024*1024)
+		stats = self.osm.get_property("statistics").unpack()
+		self.assertEqual(stats["disk-evicted"], 0)
+
+	def test_disk_cache_eviction(self):
+		data = png_tile((40, 80, 120))
+		path = tempfile.mkdtemp()
+		write_tiles(path, 2, data)
+		def on_disk():
+			total = 0
+			for folder, dirs, files in os.walk(path):
+				total += sum(os.path.getsize(os.path.join(folder, name))
+				             for name in files if name.endswith(".png"))
+			return total
+		self.assertEqual(on_disk(), 21 * len(data))
+
+		# the janitor evicts the tiles over the quota in the background
+		osm = self.tile_map(path)
+		osm.set_property("disk-cache-max-bytes", 8 * len(data))
+		self.assertTrue(self.run_until(lambda: self.stat(osm, "disk-evicted") >= 13))
+		self.assertLessEqual(self.stat(osm, "disk-cache-bytes"), 8 * len(data))
+		self.assertLessEqual(on_disk(), 8 * len(data))
+
+	def test_disk_index_recovery(self):
+		data = png_tile((40, 80, 120))
+		stat = lambda osm: self.stat(osm, "disk-cache-bytes")
+		# without an index all the tiles are found
+		path = tempfile.mkdtemp()
+		write_tiles(path, 1, data)
+		osm = self.tile_map(path)
+		self.assertTrue(self.run_until(lambda: stat(osm) == 5 * len(data)))
+
+		# after a crash only the tiles noted since the last save are looked
+		# at, not the two written behind the cache's back
+		path = tempfile.mkdtemp()
+		write_tiles(path, 1, data)
+		with open(os.path.join(path, "tile-index"), "w") as f:
+			f.write("0/0/0 %d 1000 0 0 0 \n1/0/0 %d 1000 0 0 0 \n#clean\n#open\n?1/1/1\n?1/0/1\n-1/0/1\n"
+			        % (len(data), len(data)))
+		osm = self.tile_map(path)
+		self.assertTrue(self.run_until(lambda: stat(osm) == 3 * len(data)))
+		self.run_until(lambda: False, 0.3)
+		self.assertEqual(stat(osm), 3 * len(data))
+
+	def test_statistics(self):
+		stats = self.osm.get_property("statistics").unpack()
+		self.assertEqual(stats["memory-hits"], 0)
+		self.assertEqual(stats["downloads"], 0)
+		self.assertEqual(stats["disk-write-queue"], 0)
+		self.assertEqual(stats["decodes-dropped"], 0)
+		self.assertEqual(stats["cache-max-bytes"], 64*1024*1024)
+		self.assertEqual(len(stats["download-latency"]), len(stats["download-latency-bounds"]) + 1)
+		self.osm.set_property("statistics-interval", 5)
+		self.assertEqual(self.osm.get_property("statistics-interval"), 5)
+
+	def test_trim_memory(self):
+		self.assertEqual(self.osm.trim_memory(OsmGpsMap.MapTrimLevel_t.CRITICAL), 0)
+		self.assertEqual(self.osm.get_property("tile-cache-bytes"), 64*1024*1024)
+
+	def test_trim_memory_populated(self):
+		path = tempfile.mkdtemp()
+		write_tiles(path, 1, png_tile((40, 80, 120)))
+		osm = self.tile_map(path)
+		self.show_map(osm, 0, 0, 1)
+		self.assertTrue(self.run_until(lambda: self.stat(osm, "decoded") >= 4))
+		self.run_until(lambda: False, 0.2)
+		self.assertGreaterEqual(self.stat(osm, "cache-bytes"), 4*256*256*4)
+
+		freed = osm.trim_memory(OsmGpsMap.MapTrimLevel_t.CRITICAL)
+		self.assertGreaterEqual(freed, 4*256*256*4)
+		self.assertEqual(self.stat(osm, "trimmed-bytes"), freed)
+		self.assertEqual(self.stat(osm, "cache-bytes"), 0)
+
 if __name__ == "__main__":
 	unittest.main()